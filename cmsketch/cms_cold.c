@@ -0,0 +1,199 @@
+/*******************************************************************************
+***     Two layer cold filter in front of a count-min sketch
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cms_cold.h"
+#include "cms_common.h"
+
+#define L1_BLOCK_COUNTERS (CMS_COLD_BLOCK_SIZE * 2)
+#define L2_BLOCK_COUNTERS (CMS_COLD_BLOCK_SIZE / 2)
+#define L1_INDEX_BITS 7     /* log2(L1_BLOCK_COUNTERS) */
+#define L2_INDEX_BITS 5     /* log2(L2_BLOCK_COUNTERS) */
+
+/* the counters of a key within one layer */
+typedef struct {
+    uint32_t block;
+    uint32_t index[CMS_COLD_L1_HASHES > CMS_COLD_L2_HASHES ? CMS_COLD_L1_HASHES : CMS_COLD_L2_HASHES];
+} __cold_position;
+
+/* private functions */
+static void __l1_position(const CmsColdFilter* cf, uint64_t hash, __cold_position* pos);
+static void __l2_position(const CmsColdFilter* cf, uint64_t hash, __cold_position* pos);
+static __inline__ uint32_t __l1_get(const uint8_t* block, uint32_t index);
+static __inline__ void __l1_set(uint8_t* block, uint32_t index, uint32_t val);
+static uint32_t __l1_min(const CmsColdFilter* cf, const __cold_position* pos);
+static uint32_t __l2_min(const CmsColdFilter* cf, const __cold_position* pos);
+
+
+int cms_cold_init(CmsColdFilter* cf, CountMinSketch* cms, size_t l1_bytes, size_t l2_bytes) {
+    memset(cf, 0, sizeof(CmsColdFilter));
+    if (l1_bytes == 0 || l2_bytes == 0) {
+        fprintf(stderr, "Both layers of the cold filter need memory!\n");
+        return CMS_ERROR;
+    }
+    cf->l1_blocks = (uint32_t) ((l1_bytes + CMS_COLD_BLOCK_SIZE - 1) / CMS_COLD_BLOCK_SIZE);
+    cf->l2_blocks = (uint32_t) ((l2_bytes + CMS_COLD_BLOCK_SIZE - 1) / CMS_COLD_BLOCK_SIZE);
+    cf->l1 = (uint8_t*)aligned_alloc(CMS_COLD_BLOCK_SIZE, (size_t) cf->l1_blocks * CMS_COLD_BLOCK_SIZE);
+    cf->l2 = (uint16_t*)aligned_alloc(CMS_COLD_BLOCK_SIZE, (size_t) cf->l2_blocks * CMS_COLD_BLOCK_SIZE);
+    if (cf->l1 == NULL || cf->l2 == NULL) {
+        fprintf(stderr, "Failed to allocate the cold filter!\n");
+        cms_cold_destroy(cf);
+        return CMS_ERROR;
+    }
+    cf->cms = cms;
+    cms_cold_clear(cf);
+    return CMS_SUCCESS;
+}
+
+int cms_cold_destroy(CmsColdFilter* cf) {
+    free(cf->l1);
+    free(cf->l2);
+    cf->l1 = NULL;
+    cf->l2 = NULL;
+    cf->l1_blocks = 0;
+    cf->l2_blocks = 0;
+    cf->elements_added = 0;
+    cf->cms = NULL;
+    return CMS_SUCCESS;
+}
+
+int cms_cold_clear(CmsColdFilter* cf) {
+    memset(cf->l1, 0, (size_t) cf->l1_blocks * CMS_COLD_BLOCK_SIZE);
+    memset(cf->l2, 0, (size_t) cf->l2_blocks * CMS_COLD_BLOCK_SIZE);
+    cf->elements_added = 0;
+    return cms_clear(cf->cms);
+}
+
+int32_t cms_cold_add_inc_alt(CmsColdFilter* cf, uint64_t* hashes, unsigned int num_hashes, uint32_t x) {
+    if (num_hashes < cf->cms->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the addition of the element to the cold filter!");
+        return CMS_ERROR;
+    }
+    cf->elements_added += x;
+    __cold_position pos;
+
+    /* layer 1; raise the key's smallest counters (conservative update) */
+    __l1_position(cf, hashes[0], &pos);
+    uint32_t v1 = __l1_min(cf, &pos);
+    if (v1 < CMS_COLD_L1_MAX) {
+        uint32_t inc = (x < CMS_COLD_L1_MAX - v1) ? x : CMS_COLD_L1_MAX - v1;
+        uint8_t* block = cf->l1 + ((size_t) pos.block * CMS_COLD_BLOCK_SIZE);
+        for (unsigned int i = 0; i < CMS_COLD_L1_HASHES; ++i) {
+            if (__l1_get(block, pos.index[i]) < v1 + inc) {
+                __l1_set(block, pos.index[i], v1 + inc);
+            }
+        }
+        x -= inc;
+        if (x == 0) {
+            return (int32_t) (v1 + inc);
+        }
+    }
+
+    /* layer 2 */
+    __l2_position(cf, hashes[0], &pos);
+    uint32_t v2 = __l2_min(cf, &pos);
+    if (v2 < CMS_COLD_L2_MAX) {
+        uint32_t inc = (x < CMS_COLD_L2_MAX - v2) ? x : CMS_COLD_L2_MAX - v2;
+        uint16_t* block = cf->l2 + ((size_t) pos.block * L2_BLOCK_COUNTERS);
+        for (unsigned int i = 0; i < CMS_COLD_L2_HASHES; ++i) {
+            if (block[pos.index[i]] < v2 + inc) {
+                block[pos.index[i]] = (uint16_t) (v2 + inc);
+            }
+        }
+        x -= inc;
+        if (x == 0) {
+            return (int32_t) (CMS_COLD_L1_MAX + v2 + inc);
+        }
+    }
+
+    /* both layers are saturated; the rest goes to the sketch */
+    int32_t num_add = cms_add_inc_alt(cf->cms, hashes, num_hashes, x);
+    return __clamp_int32((int64_t) CMS_COLD_L1_MAX + CMS_COLD_L2_MAX + num_add);
+}
+
+int32_t cms_cold_add_inc(CmsColdFilter* cf, const char* key, uint32_t x) {
+    uint64_t* hashes = cms_get_hashes(cf->cms, key);
+    int32_t num_add = cms_cold_add_inc_alt(cf, hashes, cf->cms->depth, x);
+    free(hashes);
+    return num_add;
+}
+
+int32_t cms_cold_check_alt(CmsColdFilter* cf, uint64_t* hashes, unsigned int num_hashes) {
+    if (num_hashes < cf->cms->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the min lookup of the element in the cold filter!");
+        return CMS_ERROR;
+    }
+    __cold_position pos;
+    __l1_position(cf, hashes[0], &pos);
+    uint32_t v1 = __l1_min(cf, &pos);
+    if (v1 < CMS_COLD_L1_MAX) {
+        return (int32_t) v1;
+    }
+    __l2_position(cf, hashes[0], &pos);
+    uint32_t v2 = __l2_min(cf, &pos);
+    if (v2 < CMS_COLD_L2_MAX) {
+        return (int32_t) (CMS_COLD_L1_MAX + v2);
+    }
+    int32_t num_add = cms_check_alt(cf->cms, hashes, num_hashes);
+    return __clamp_int32((int64_t) CMS_COLD_L1_MAX + CMS_COLD_L2_MAX + num_add);
+}
+
+int32_t cms_cold_check(CmsColdFilter* cf, const char* key) {
+    uint64_t* hashes = cms_get_hashes(cf->cms, key);
+    int32_t num_add = cms_cold_check_alt(cf, hashes, cf->cms->depth);
+    free(hashes);
+    return num_add;
+}
+
+
+/*******************************************************************************
+*    PRIVATE FUNCTIONS
+*******************************************************************************/
+/* the block comes from the high half of the mixed hash, the counters inside
+   it from the low bits */
+static void __l1_position(const CmsColdFilter* cf, uint64_t hash, __cold_position* pos) {
+    uint64_t m = __mix(hash);
+    pos->block = (uint32_t) (((m >> 32) * cf->l1_blocks) >> 32);
+    for (unsigned int i = 0; i < CMS_COLD_L1_HASHES; ++i) {
+        pos->index[i] = (uint32_t) (m >> (i * L1_INDEX_BITS)) & (L1_BLOCK_COUNTERS - 1);
+    }
+}
+
+static void __l2_position(const CmsColdFilter* cf, uint64_t hash, __cold_position* pos) {
+    uint64_t m = __mix(hash ^ 0x9E3779B97F4A7C15ULL);
+    pos->block = (uint32_t) (((m >> 32) * cf->l2_blocks) >> 32);
+    for (unsigned int i = 0; i < CMS_COLD_L2_HASHES; ++i) {
+        pos->index[i] = (uint32_t) (m >> (i * L2_INDEX_BITS)) & (L2_BLOCK_COUNTERS - 1);
+    }
+}
+
+static __inline__ uint32_t __l1_get(const uint8_t* block, uint32_t index) {
+    return (block[index >> 1] >> ((index & 1) * 4)) & 0xF;
+}
+
+static __inline__ void __l1_set(uint8_t* block, uint32_t index, uint32_t val) {
+    uint32_t shift = (index & 1) * 4;
+    block[index >> 1] = (uint8_t) ((block[index >> 1] & ~(0xF << shift)) | (val << shift));
+}
+
+static uint32_t __l1_min(const CmsColdFilter* cf, const __cold_position* pos) {
+    const uint8_t* block = cf->l1 + ((size_t) pos->block * CMS_COLD_BLOCK_SIZE);
+    uint32_t min = CMS_COLD_L1_MAX;
+    for (unsigned int i = 0; i < CMS_COLD_L1_HASHES; ++i) {
+        uint32_t val = __l1_get(block, pos->index[i]);
+        min = (val < min) ? val : min;
+    }
+    return min;
+}
+
+static uint32_t __l2_min(const CmsColdFilter* cf, const __cold_position* pos) {
+    const uint16_t* block = cf->l2 + ((size_t) pos->block * L2_BLOCK_COUNTERS);
+    uint32_t min = CMS_COLD_L2_MAX;
+    for (unsigned int i = 0; i < CMS_COLD_L2_HASHES; ++i) {
+        min = (block[pos->index[i]] < min) ? block[pos->index[i]] : min;
+    }
+    return min;
+}
@@ -0,0 +1,91 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_COLD_H__
+#define BARRUST_COUNT_MIN_SKETCH_COLD_H__
+
+/*******************************************************************************
+***     Two layer cold filter in front of a count-min sketch
+***
+***     Most distinct keys of a stream are seen only a few times. The filter
+***     absorbs them in a layer of 4-bit counters and then a layer of 16-bit
+***     counters, both updated conservatively (only the smallest counters of
+***     a key are raised). A key is only counted in the sketch once its
+***     counters in both layers are saturated, so the sketch is touched far
+***     less often and, holding only the heavy keys, can be narrower for the
+***     same error. All counters of a key in one layer lie in a single 64 byte
+***     block, so a layer costs one cache miss.
+***
+***     Paper: Zhou, Yang, et al. - "Cold Filter: A Meta-Framework for Faster
+***     and More Accurate Stream Processing" (SIGMOD 2018)
+*******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "cmsketch.h"
+
+#define CMS_COLD_BLOCK_SIZE     64
+#define CMS_COLD_L1_HASHES      3       /* 4-bit counters per key */
+#define CMS_COLD_L2_HASHES      3       /* 16-bit counters per key */
+#define CMS_COLD_L1_MAX         15
+#define CMS_COLD_L2_MAX         65535
+
+typedef struct {
+    uint32_t l1_blocks;
+    uint32_t l2_blocks;
+    uint8_t* l1;                /* two 4-bit counters per byte */
+    uint16_t* l2;
+    int64_t elements_added;     /* including those absorbed by the filter */
+    CountMinSketch* cms;        /* receives the keys that saturate both layers */
+} CmsColdFilter, cms_cold_filter;
+
+
+/*  Put a cold filter with layers of (at least) `l1_bytes` and `l2_bytes` in
+    front of the initialized count-min sketch `cms`, which is not owned by
+    the filter
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When a layer is empty or unable to allocate */
+int cms_cold_init(CmsColdFilter* cf, CountMinSketch* cms, size_t l1_bytes, size_t l2_bytes);
+
+/*  Free the filter layers; the sketch is left alone
+
+    Returns:
+        CMS_SUCCESS */
+int cms_cold_destroy(CmsColdFilter* cf);
+
+/*  Reset the filter and the sketch to zero elements inserted
+
+    Returns:
+        CMS_SUCCESS */
+int cms_cold_clear(CmsColdFilter* cf);
+
+/*  Insert the key `x` times; the filter layers are filled first and only
+    the remainder reaches the sketch
+
+    Returns:
+        The estimate of the key after the insert
+        CMS_ERROR   -   When there are insufficient hashes
+
+    NOTE: The filter does not support removes */
+int32_t cms_cold_add_inc(CmsColdFilter* cf, const char* key, uint32_t x);
+int32_t cms_cold_add_inc_alt(CmsColdFilter* cf, uint64_t* hashes, unsigned int num_hashes, uint32_t x);
+static __inline__ int32_t cms_cold_add(CmsColdFilter* cf, const char* key) {
+    return cms_cold_add_inc(cf, key, 1);
+}
+
+/*  Determine the maximum number of times the key may have been inserted;
+    the layer counts plus, for saturated keys, the sketch estimate
+
+    Returns:
+        The estimate
+        CMS_ERROR   -   When there are insufficient hashes */
+int32_t cms_cold_check(CmsColdFilter* cf, const char* key);
+int32_t cms_cold_check_alt(CmsColdFilter* cf, uint64_t* hashes, unsigned int num_hashes);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
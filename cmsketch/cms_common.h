@@ -0,0 +1,35 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_COMMON_H__
+#define BARRUST_COUNT_MIN_SKETCH_COMMON_H__
+
+/*******************************************************************************
+***     Helpers shared by the sketch implementations; not part of the API
+*******************************************************************************/
+
+#include <stdint.h>
+#include "cmsketch.h"
+
+/* sketches up to this depth keep their per-row scratch arrays on the stack;
+   deeper ones allocate them */
+#define CMS_STACK_DEPTH 32
+
+/* splitmix64 finalizer */
+static __inline__ uint64_t __mix(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+    return h;
+}
+
+/* estimates are reported as int32_t; INT32_MIN is CMS_ERROR */
+static __inline__ int32_t __clamp_int32(int64_t val) {
+    if (val >= INT32_MAX) {
+        return INT32_MAX;
+    } else if (val <= INT32_MIN) {
+        return INT32_MIN + 1;
+    }
+    return (int32_t) val;
+}
+
+#endif
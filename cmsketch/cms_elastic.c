@@ -0,0 +1,320 @@
+/*******************************************************************************
+***     Elastic sketch: heavy part of voted buckets over a count-min light part
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cms_elastic.h"
+#include "cms_common.h"
+
+#define ELASTIC_MAGIC "CMSELS01"
+#define ELASTIC_MAGIC_SIZE 8
+
+/*  On disk: header, `num_buckets` buckets and the `width` x `depth` bins of
+    the light part */
+typedef struct {
+    char magic[ELASTIC_MAGIC_SIZE];
+    uint32_t num_buckets;
+    uint32_t key_size;
+    uint32_t width;
+    uint32_t depth;
+    int64_t elements_added;
+} __elastic_header;
+
+/* private functions */
+static int32_t __elastic_add(CmsElastic* es, const char* key, uint64_t fingerprint, uint32_t x);
+static int32_t __elastic_check(CmsElastic* es, uint64_t fingerprint);
+static __inline__ cms_elastic_bucket* __bucket(CmsElastic* es, uint64_t fingerprint);
+static void __light_hashes(const CmsElastic* es, uint64_t fingerprint, uint64_t* hashes);
+static int32_t __light_add(CmsElastic* es, uint64_t fingerprint, uint32_t x);
+static int32_t __light_check(CmsElastic* es, uint64_t fingerprint);
+static void __set_key(cms_elastic_bucket* bucket, const char* key);
+
+
+int cms_elastic_init_alt(CmsElastic* es, unsigned int num_buckets, unsigned int width, unsigned int depth, cms_hash_function hash_function) {
+    memset(es, 0, sizeof(CmsElastic));
+    if (num_buckets == 0 || depth > CMS_ELASTIC_MAX_DEPTH) {
+        fprintf(stderr, "An elastic sketch needs at least 1 bucket and a depth of at most %d!\n", CMS_ELASTIC_MAX_DEPTH);
+        return CMS_ERROR;
+    }
+    es->buckets = (cms_elastic_bucket*)calloc(num_buckets, sizeof(cms_elastic_bucket));
+    if (es->buckets == NULL) {
+        fprintf(stderr, "Failed to allocate the heavy part of the elastic sketch!\n");
+        return CMS_ERROR;
+    }
+    es->num_buckets = num_buckets;
+    if (cms_init_alt(&es->light, width, depth, hash_function) == CMS_ERROR) {
+        cms_elastic_destroy(es);
+        return CMS_ERROR;
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_elastic_destroy(CmsElastic* es) {
+    free(es->buckets);
+    es->buckets = NULL;
+    es->num_buckets = 0;
+    cms_destroy(&es->light);
+    return CMS_SUCCESS;
+}
+
+int cms_elastic_clear(CmsElastic* es) {
+    memset(es->buckets, 0, es->num_buckets * sizeof(cms_elastic_bucket));
+    return cms_clear(&es->light);
+}
+
+int32_t cms_elastic_add_inc_alt(CmsElastic* es, uint64_t* hashes, unsigned int num_hashes, uint32_t x) {
+    if (num_hashes < 1) {
+        fprintf(stderr, "Insufficient hashes to complete the addition of the element to the elastic sketch!");
+        return CMS_ERROR;
+    }
+    return __elastic_add(es, NULL, hashes[0], x);
+}
+
+int32_t cms_elastic_add_inc(CmsElastic* es, const char* key, uint32_t x) {
+    uint64_t* hashes = cms_get_hashes_alt(&es->light, 1, key);
+    int32_t num_add = __elastic_add(es, key, hashes[0], x);
+    free(hashes);
+    return num_add;
+}
+
+int32_t cms_elastic_check_alt(CmsElastic* es, uint64_t* hashes, unsigned int num_hashes) {
+    if (num_hashes < 1) {
+        fprintf(stderr, "Insufficient hashes to complete the lookup of the element in the elastic sketch!");
+        return CMS_ERROR;
+    }
+    return __elastic_check(es, hashes[0]);
+}
+
+int32_t cms_elastic_check(CmsElastic* es, const char* key) {
+    uint64_t* hashes = cms_get_hashes_alt(&es->light, 1, key);
+    int32_t num_add = __elastic_check(es, hashes[0]);
+    free(hashes);
+    return num_add;
+}
+
+unsigned int cms_elastic_heavy_hitters(CmsElastic* es, int64_t threshold, cms_elastic_hitter* hitters, unsigned int max_hitters) {
+    unsigned int found = 0;
+    for (uint32_t b = 0; b < es->num_buckets; ++b) {
+        cms_elastic_bucket* bucket = &es->buckets[b];
+        if (bucket->vote_pos == 0) {
+            continue;
+        }
+        int64_t count = bucket->vote_pos;
+        if (bucket->flag) {
+            count += __light_check(es, bucket->fingerprint);
+        }
+        if (count < threshold) {
+            continue;
+        }
+        if (found < max_hitters) {
+            hitters[found].key = bucket->has_key ? bucket->key : NULL;
+            hitters[found].fingerprint = bucket->fingerprint;
+            hitters[found].count = count;
+        }
+        ++found;
+    }
+    return found;
+}
+
+int cms_elastic_compress(CmsElastic* es, unsigned int factor) {
+    return cms_fold_max(&es->light, factor);
+}
+
+int cms_elastic_merge(CmsElastic* es, CmsElastic* other) {
+    if (es->num_buckets != other->num_buckets || es->light.depth != other->light.depth
+            || es->light.hash_function != other->light.hash_function) {
+        fprintf(stderr, "Unable to merge elastic sketches of different shapes or hash functions!\n");
+        return CMS_ERROR;
+    }
+    uint32_t width = es->light.width, other_width = other->light.width;
+    if ((width > other_width && width % other_width != 0) || (other_width > width && other_width % width != 0)) {
+        fprintf(stderr, "Unable to merge light parts of widths %u and %u!\n", width, other_width);
+        return CMS_ERROR;
+    }
+
+    /* light parts; the wider one is compressed to the narrower width */
+    if (width > other_width) {
+        cms_fold_max(&es->light, width / other_width);
+    }
+    int res;
+    if (other_width > width) {
+        CountMinSketch light;
+        if (cms_merge(&light, 1, &other->light) == CMS_ERROR) {
+            return CMS_ERROR;
+        }
+        cms_fold_max(&light, other_width / width);
+        res = cms_merge_into(&es->light, 1, &light);
+        cms_destroy(&light);
+    } else {
+        res = cms_merge_into(&es->light, 1, &other->light);
+    }
+    if (res == CMS_ERROR) {
+        return CMS_ERROR;
+    }
+
+    /* heavy parts; of two different keys the larger stays */
+    for (uint32_t b = 0; b < es->num_buckets; ++b) {
+        cms_elastic_bucket* mine = &es->buckets[b];
+        const cms_elastic_bucket* theirs = &other->buckets[b];
+        if (theirs->vote_pos == 0) {
+            continue;
+        }
+        if (mine->vote_pos == 0) {
+            *mine = *theirs;
+        } else if (mine->fingerprint == theirs->fingerprint) {
+            mine->vote_pos = (uint32_t) __clamp_int32((int64_t) mine->vote_pos + theirs->vote_pos);
+            mine->vote_neg = (uint32_t) __clamp_int32((int64_t) mine->vote_neg + theirs->vote_neg);
+            mine->flag |= theirs->flag;
+            if (!mine->has_key && theirs->has_key) {
+                memcpy(mine->key, theirs->key, CMS_ELASTIC_KEY_SIZE);
+                mine->has_key = 1;
+            }
+        } else if (theirs->vote_pos > mine->vote_pos) {
+            __light_add(es, mine->fingerprint, mine->vote_pos);
+            uint32_t vote_neg = (uint32_t) __clamp_int32((int64_t) theirs->vote_neg + mine->vote_neg + mine->vote_pos);
+            *mine = *theirs;
+            mine->vote_neg = vote_neg;
+            mine->flag = 1;     /* it may have lost votes here and be in the light part */
+        } else {
+            __light_add(es, theirs->fingerprint, theirs->vote_pos);
+            mine->vote_neg = (uint32_t) __clamp_int32((int64_t) mine->vote_neg + theirs->vote_neg + theirs->vote_pos);
+            mine->flag = 1;
+        }
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_elastic_export(CmsElastic* es, const char* filepath) {
+    FILE* fp = fopen(filepath, "w+b");
+    if (fp == NULL) {
+        fprintf(stderr, "Can't open file %s!\n", filepath);
+        return CMS_ERROR;
+    }
+    cms_flush(&es->light);
+    __elastic_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ELASTIC_MAGIC, ELASTIC_MAGIC_SIZE);
+    header.num_buckets = es->num_buckets;
+    header.key_size = CMS_ELASTIC_KEY_SIZE;
+    header.width = es->light.width;
+    header.depth = es->light.depth;
+    header.elements_added = es->light.elements_added;
+    size_t num_bins = (size_t) es->light.width * es->light.depth;
+    int res = (fwrite(&header, sizeof(header), 1, fp) == 1
+            && fwrite(es->buckets, sizeof(cms_elastic_bucket), es->num_buckets, fp) == es->num_buckets
+            && fwrite(es->light.bins, sizeof(int32_t), num_bins, fp) == num_bins) ? CMS_SUCCESS : CMS_ERROR;
+    if (fclose(fp) != 0) {
+        res = CMS_ERROR;
+    }
+    return res;
+}
+
+int cms_elastic_import_alt(CmsElastic* es, const char* filepath, cms_hash_function hash_function) {
+    FILE* fp = fopen(filepath, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Can't open file %s!\n", filepath);
+        return CMS_ERROR;
+    }
+    __elastic_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, ELASTIC_MAGIC, ELASTIC_MAGIC_SIZE) != 0
+            || header.key_size != CMS_ELASTIC_KEY_SIZE
+            || cms_elastic_init_alt(es, header.num_buckets, header.width, header.depth, hash_function) == CMS_ERROR) {
+        fprintf(stderr, "%s is not an elastic sketch!\n", filepath);
+        fclose(fp);
+        return CMS_ERROR;
+    }
+    size_t num_bins = (size_t) header.width * header.depth;
+    if (fread(es->buckets, sizeof(cms_elastic_bucket), es->num_buckets, fp) != es->num_buckets
+            || fread(es->light.bins, sizeof(int32_t), num_bins, fp) != num_bins) {
+        fprintf(stderr, "%s is truncated!\n", filepath);
+        cms_elastic_destroy(es);
+        fclose(fp);
+        return CMS_ERROR;
+    }
+    es->light.elements_added = header.elements_added;
+    fclose(fp);
+    return CMS_SUCCESS;
+}
+
+
+/*******************************************************************************
+*    PRIVATE FUNCTIONS
+*******************************************************************************/
+static int32_t __elastic_add(CmsElastic* es, const char* key, uint64_t fingerprint, uint32_t x) {
+    cms_elastic_bucket* bucket = __bucket(es, fingerprint);
+    if (bucket->vote_pos == 0) {
+        bucket->fingerprint = fingerprint;
+        bucket->vote_pos = x;
+        bucket->vote_neg = 0;
+        bucket->flag = 0;
+        __set_key(bucket, key);
+        return __clamp_int32(x);
+    }
+    if (bucket->fingerprint == fingerprint) {
+        bucket->vote_pos = (uint32_t) __clamp_int32((int64_t) bucket->vote_pos + x);
+        if (key != NULL && !bucket->has_key) {
+            __set_key(bucket, key);
+        }
+        return __elastic_check(es, fingerprint);
+    }
+
+    bucket->vote_neg = (uint32_t) __clamp_int32((int64_t) bucket->vote_neg + x);
+    if ((uint64_t) bucket->vote_neg < (uint64_t) CMS_ELASTIC_LAMBDA * bucket->vote_pos) {
+        return __light_add(es, fingerprint, x);
+    }
+    /* the resident key lost the vote; it continues in the light part */
+    __light_add(es, bucket->fingerprint, bucket->vote_pos);
+    bucket->fingerprint = fingerprint;
+    bucket->vote_pos = x;
+    bucket->vote_neg = 0;
+    bucket->flag = 1;
+    __set_key(bucket, key);
+    return __elastic_check(es, fingerprint);
+}
+
+static int32_t __elastic_check(CmsElastic* es, uint64_t fingerprint) {
+    const cms_elastic_bucket* bucket = __bucket(es, fingerprint);
+    if (bucket->vote_pos != 0 && bucket->fingerprint == fingerprint) {
+        int64_t count = bucket->vote_pos;
+        if (bucket->flag) {
+            count += __light_check(es, fingerprint);
+        }
+        return __clamp_int32(count);
+    }
+    return __light_check(es, fingerprint);
+}
+
+static __inline__ cms_elastic_bucket* __bucket(CmsElastic* es, uint64_t fingerprint) {
+    uint64_t m = __mix(fingerprint);
+    return &es->buckets[((m >> 32) * es->num_buckets) >> 32];
+}
+
+/* the light part is hashed from the fingerprint so that an evicted key can
+   be moved there without its original key or hashes */
+static void __light_hashes(const CmsElastic* es, uint64_t fingerprint, uint64_t* hashes) {
+    for (unsigned int i = 0; i < es->light.depth; ++i) {
+        hashes[i] = __mix(fingerprint + ((i + 1) * 0x9E3779B97F4A7C15ULL));
+    }
+}
+
+static int32_t __light_add(CmsElastic* es, uint64_t fingerprint, uint32_t x) {
+    uint64_t hashes[CMS_ELASTIC_MAX_DEPTH];
+    __light_hashes(es, fingerprint, hashes);
+    return cms_add_inc_alt(&es->light, hashes, es->light.depth, x);
+}
+
+static int32_t __light_check(CmsElastic* es, uint64_t fingerprint) {
+    uint64_t hashes[CMS_ELASTIC_MAX_DEPTH];
+    __light_hashes(es, fingerprint, hashes);
+    return cms_check_alt(&es->light, hashes, es->light.depth);
+}
+
+static void __set_key(cms_elastic_bucket* bucket, const char* key) {
+    memset(bucket->key, 0, CMS_ELASTIC_KEY_SIZE);
+    bucket->has_key = (key != NULL);
+    if (key != NULL) {
+        strncpy(bucket->key, key, CMS_ELASTIC_KEY_SIZE - 1);
+    }
+}
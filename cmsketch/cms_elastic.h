@@ -0,0 +1,148 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_ELASTIC_H__
+#define BARRUST_COUNT_MIN_SKETCH_ELASTIC_H__
+
+/*******************************************************************************
+***     Elastic sketch: heavy part of voted buckets over a count-min light part
+***
+***     Each key maps to one bucket of the heavy part, which holds a key with
+***     its count (the positive votes) and the count of the other keys that
+***     hit the bucket (the negative votes). Once the negative votes reach
+***     CMS_ELASTIC_LAMBDA times the positive ones, the resident key is moved
+***     to the light part, a count-min sketch, and the newcomer takes its
+***     place. Large flows therefore stay in the heavy part, with their key,
+***     where they are counted exactly and can be listed; everything else goes
+***     to the light part. The light part can be compressed with a max fold
+***     before shipping and sketches of different widths can be merged.
+***
+***     Paper: Yang, Jiang, et al. - "Elastic Sketch: Adaptive and Fast
+***     Network-wide Measurements" (SIGCOMM 2018)
+*******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "cmsketch.h"
+
+#define CMS_ELASTIC_KEY_SIZE    32      /* bytes of a key kept for recovery, including the NUL */
+#define CMS_ELASTIC_LAMBDA      8       /* negative to positive vote ratio that evicts a key */
+#define CMS_ELASTIC_MAX_DEPTH   32
+
+typedef struct {
+    uint64_t fingerprint;       /* first hash of the key */
+    uint32_t vote_pos;          /* count of the key; 0 marks an empty bucket */
+    uint32_t vote_neg;          /* count of the other keys that hit the bucket */
+    uint32_t flag;              /* the key may also have counts in the light part */
+    uint32_t has_key;           /* `key` is valid (added by key, not by hashes) */
+    char key[CMS_ELASTIC_KEY_SIZE];
+} cms_elastic_bucket;
+
+typedef struct {
+    const char* key;            /* NULL when the key was only added by its hashes */
+    uint64_t fingerprint;
+    int64_t count;
+} cms_elastic_hitter;
+
+typedef struct {
+    uint32_t num_buckets;
+    cms_elastic_bucket* buckets;
+    CountMinSketch light;
+} CmsElastic, cms_elastic;
+
+
+/*  Initialize an elastic sketch of `num_buckets` heavy buckets and a light
+    part of `width` x `depth` (at most CMS_ELASTIC_MAX_DEPTH)
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When a dimension is 0 or unable to allocate */
+int cms_elastic_init_alt(CmsElastic* es, unsigned int num_buckets, unsigned int width, unsigned int depth, cms_hash_function hash_function);
+static __inline__ int cms_elastic_init(CmsElastic* es, unsigned int num_buckets, unsigned int width, unsigned int depth) {
+    return cms_elastic_init_alt(es, num_buckets, width, depth, NULL);
+}
+
+/*  Free all memory of the heavy and light parts
+
+    Returns:
+        CMS_SUCCESS */
+int cms_elastic_destroy(CmsElastic* es);
+
+/*  Reset both parts to zero elements inserted
+
+    Returns:
+        CMS_SUCCESS */
+int cms_elastic_clear(CmsElastic* es);
+
+/*  Insert the key `x` times; the hashes version does not keep the key, so
+    it can only be recovered by fingerprint
+
+    Returns:
+        The estimate of the key after the insert
+        CMS_ERROR   -   When there are insufficient hashes
+
+    NOTE: Keys longer than CMS_ELASTIC_KEY_SIZE - 1 bytes are counted in
+    full but recovered truncated
+    NOTE: The elastic sketch does not support removes */
+int32_t cms_elastic_add_inc(CmsElastic* es, const char* key, uint32_t x);
+int32_t cms_elastic_add_inc_alt(CmsElastic* es, uint64_t* hashes, unsigned int num_hashes, uint32_t x);
+static __inline__ int32_t cms_elastic_add(CmsElastic* es, const char* key) {
+    return cms_elastic_add_inc(es, key, 1);
+}
+
+/*  Determine the maximum number of times the key may have been inserted
+
+    Returns:
+        The estimate
+        CMS_ERROR   -   When there are insufficient hashes */
+int32_t cms_elastic_check(CmsElastic* es, const char* key);
+int32_t cms_elastic_check_alt(CmsElastic* es, uint64_t* hashes, unsigned int num_hashes);
+
+/*  List the keys of the heavy part whose estimate is at least `threshold`
+    into `hitters` (room for `max_hitters`); the keys point into the sketch
+    and are valid until it is next updated
+
+    Returns:
+        The number of heavy hitters found, which may exceed `max_hitters` */
+unsigned int cms_elastic_heavy_hitters(CmsElastic* es, int64_t threshold, cms_elastic_hitter* hitters, unsigned int max_hitters);
+
+/*  Shrink the light part by `factor` with a max fold (see `cms_fold_max`)
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When `factor` does not divide the light part's width */
+int cms_elastic_compress(CmsElastic* es, unsigned int factor);
+
+/*  Merge `other` into `es`; both need the same number of buckets and depth,
+    and the wider light part is compressed to the width of the narrower one,
+    which must divide it. Buckets holding different keys keep the larger one
+    and move the other to the light part.
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the sketches are not compatible */
+int cms_elastic_merge(CmsElastic* es, CmsElastic* other);
+
+/*  Export the elastic sketch to file; the heavy buckets are followed by the
+    light part
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the file cannot be written */
+int cms_elastic_export(CmsElastic* es, const char* filepath);
+
+/*  Import an elastic sketch previously exported with `cms_elastic_export`
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the file cannot be read or is not an elastic sketch */
+int cms_elastic_import_alt(CmsElastic* es, const char* filepath, cms_hash_function hash_function);
+static __inline__ int cms_elastic_import(CmsElastic* es, const char* filepath) {
+    return cms_elastic_import_alt(es, filepath, NULL);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
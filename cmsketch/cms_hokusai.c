@@ -0,0 +1,147 @@
+/*******************************************************************************
+***     Hokusai style time-aggregated count-min sketch
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cms_hokusai.h"
+
+/* private functions */
+static int __make_room(CmsHokusai* hk, unsigned int j);
+static __inline__ uint32_t __level_width(const CmsHokusai* hk, unsigned int level);
+
+
+int cms_hokusai_init_alt(CmsHokusai* hk, unsigned int width, unsigned int depth, unsigned int min_width, cms_hash_function hash_function) {
+    memset(hk, 0, sizeof(CmsHokusai));
+    if (min_width == 0 || min_width > width || width % min_width != 0
+            || ((width / min_width) & ((width / min_width) - 1)) != 0) {
+        fprintf(stderr, "The minimum width %u must be the width %u halved zero or more times!\n", min_width, width);
+        return CMS_ERROR;
+    }
+    hk->width = width;
+    hk->min_width = min_width;
+    if (cms_init_alt(&hk->current, width, depth, hash_function) == CMS_ERROR) {
+        return CMS_ERROR;
+    }
+    /* merged blocks sum up to 2^j units; they inherit the promotion */
+    return cms_set_auto_promote(&hk->current, 1);
+}
+
+int cms_hokusai_destroy(CmsHokusai* hk) {
+    for (unsigned int j = 0; j < hk->num_levels; ++j) {
+        for (uint32_t b = 0; b < hk->levels[j].num_blocks; ++b) {
+            cms_destroy(&hk->levels[j].blocks[b].cms);
+        }
+        hk->levels[j].num_blocks = 0;
+    }
+    cms_destroy(&hk->current);
+    hk->num_levels = 0;
+    hk->now = 0;
+    return CMS_SUCCESS;
+}
+
+int32_t cms_hokusai_add_inc_alt(CmsHokusai* hk, uint64_t* hashes, unsigned int num_hashes, uint32_t x) {
+    return cms_add_inc_alt(&hk->current, hashes, num_hashes, x);
+}
+
+int32_t cms_hokusai_add_inc(CmsHokusai* hk, const char* key, uint32_t x) {
+    return cms_add_inc(&hk->current, key, x);
+}
+
+int cms_hokusai_tick(CmsHokusai* hk) {
+    CountMinSketch next;
+    if (cms_init_alt(&next, hk->width, hk->current.depth, hk->current.hash_function) == CMS_ERROR) {
+        return CMS_ERROR;
+    }
+    cms_set_auto_promote(&next, 1);
+    if (__make_room(hk, 0) == CMS_ERROR) {
+        cms_destroy(&next);
+        return CMS_ERROR;
+    }
+    cms_flush(&hk->current);
+    cms_hokusai_level* level = &hk->levels[0];
+    level->blocks[level->num_blocks].start = hk->now;
+    level->blocks[level->num_blocks].cms = hk->current;
+    ++level->num_blocks;
+    if (hk->num_levels == 0) {
+        hk->num_levels = 1;
+    }
+    hk->current = next;
+    ++hk->now;
+    return CMS_SUCCESS;
+}
+
+int64_t cms_hokusai_check_range_alt(CmsHokusai* hk, uint64_t* hashes, unsigned int num_hashes, uint64_t begin, uint64_t end) {
+    if (num_hashes < hk->current.depth) {
+        fprintf(stderr, "Insufficient hashes to complete the min lookup of the element to the count-min sketch!");
+        return CMS_ERROR;
+    }
+    int64_t total = 0;
+    if (begin <= hk->now && hk->now < end) {
+        total += cms_check_wide_alt(&hk->current, hashes, num_hashes);
+    }
+    for (unsigned int j = 0; j < hk->num_levels; ++j) {
+        cms_hokusai_level* level = &hk->levels[j];
+        for (uint32_t b = 0; b < level->num_blocks; ++b) {
+            uint64_t start = level->blocks[b].start;
+            if (start < end && start + (UINT64_C(1) << j) > begin) {
+                total += cms_check_wide_alt(&level->blocks[b].cms, hashes, num_hashes);
+            }
+        }
+    }
+    return total;
+}
+
+int64_t cms_hokusai_check_range(CmsHokusai* hk, const char* key, uint64_t begin, uint64_t end) {
+    uint64_t* hashes = cms_get_hashes(&hk->current, key);
+    int64_t num_add = cms_hokusai_check_range_alt(hk, hashes, hk->current.depth, begin, end);
+    free(hashes);
+    return num_add;
+}
+
+
+/*******************************************************************************
+*    PRIVATE FUNCTIONS
+*******************************************************************************/
+static __inline__ uint32_t __level_width(const CmsHokusai* hk, unsigned int level) {
+    uint32_t width = (level >= 32) ? 0 : (hk->width >> level);
+    return (width < hk->min_width) ? hk->min_width : width;
+}
+
+/*  Make space for one more block on level `j`: a full level has its two
+    blocks merged into one block of level j + 1, which gets space first. The
+    merged block is built aside, so a failure leaves level `j` untouched and
+    the levels above it carried but consistent. */
+static int __make_room(CmsHokusai* hk, unsigned int j) {
+    cms_hokusai_level* level = &hk->levels[j];
+    if (level->num_blocks < 2) {
+        return CMS_SUCCESS;
+    }
+    if (j + 1 >= CMS_HOKUSAI_MAX_LEVELS) {
+        fprintf(stderr, "The Hokusai ladder is full!\n");
+        return CMS_ERROR;
+    }
+    if (__make_room(hk, j + 1) == CMS_ERROR) {
+        return CMS_ERROR;
+    }
+    CountMinSketch merged;
+    if (cms_merge(&merged, 2, &level->blocks[0].cms, &level->blocks[1].cms) == CMS_ERROR) {
+        return CMS_ERROR;
+    }
+    if (cms_fold(&merged, __level_width(hk, j) / __level_width(hk, j + 1)) == CMS_ERROR) {
+        cms_destroy(&merged);
+        return CMS_ERROR;
+    }
+    cms_hokusai_level* up = &hk->levels[j + 1];
+    up->blocks[up->num_blocks].start = level->blocks[0].start;
+    up->blocks[up->num_blocks].cms = merged;
+    ++up->num_blocks;
+    cms_destroy(&level->blocks[0].cms);
+    cms_destroy(&level->blocks[1].cms);
+    level->num_blocks = 0;
+    if (hk->num_levels < j + 2) {
+        hk->num_levels = j + 2;
+    }
+    return CMS_SUCCESS;
+}
@@ -0,0 +1,98 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_HOKUSAI_H__
+#define BARRUST_COUNT_MIN_SKETCH_HOKUSAI_H__
+
+/*******************************************************************************
+***     Hokusai style time-aggregated count-min sketch
+***
+***     Updates go into the sketch of the current time unit. Every tick closes
+***     the unit and pushes its sketch onto a binary-counter ladder: level `j`
+***     holds at most two blocks of 2^j units each, and a block pushed onto a
+***     full level first merges its two blocks into one block of level j + 1,
+***     which is folded to half the width (but not below `min_width`). Older intervals
+***     are therefore kept at a coarser time and item resolution; memory grows
+***     with the logarithm of the elapsed units. The sketches promote their
+***     counters to 64-bit instead of saturating (see cms_set_auto_promote).
+***
+***     Paper: Matusevych, Smola, Ahmed - "Hokusai - Sketching Streams in Real
+***     Time" (UAI 2012)
+*******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "cmsketch.h"
+
+#define CMS_HOKUSAI_MAX_LEVELS  64
+
+typedef struct {
+    uint64_t start;             /* first unit of the block */
+    CountMinSketch cms;
+} cms_hokusai_block;
+
+typedef struct {
+    uint32_t num_blocks;
+    cms_hokusai_block blocks[2];    /* oldest first */
+} cms_hokusai_level;
+
+typedef struct {
+    uint64_t now;               /* the current time unit */
+    uint32_t width;
+    uint32_t min_width;
+    uint32_t num_levels;
+    CountMinSketch current;
+    cms_hokusai_level levels[CMS_HOKUSAI_MAX_LEVELS];
+} CmsHokusai, cms_hokusai;
+
+
+/*  Initialize the ladder for sketches of `width` x `depth`; older levels
+    fold down to `min_width`, which must be width / 2^k
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the widths do not fold into each other or unable
+                        to allocate */
+int cms_hokusai_init_alt(CmsHokusai* hk, unsigned int width, unsigned int depth, unsigned int min_width, cms_hash_function hash_function);
+static __inline__ int cms_hokusai_init(CmsHokusai* hk, unsigned int width, unsigned int depth, unsigned int min_width) {
+    return cms_hokusai_init_alt(hk, width, depth, min_width, NULL);
+}
+
+/*  Free all levels
+
+    Returns:
+        CMS_SUCCESS */
+int cms_hokusai_destroy(CmsHokusai* hk);
+
+/*  Insert the key into the sketch of the current unit; the return values
+    are those of `cms_add_inc` */
+int32_t cms_hokusai_add_inc(CmsHokusai* hk, const char* key, uint32_t x);
+int32_t cms_hokusai_add_inc_alt(CmsHokusai* hk, uint64_t* hashes, unsigned int num_hashes, uint32_t x);
+static __inline__ int32_t cms_hokusai_add(CmsHokusai* hk, const char* key) {
+    return cms_hokusai_add_inc(hk, key, 1);
+}
+
+/*  Close the current unit and start the next one; amortized O(width)
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When unable to allocate the new unit's sketch or a
+                        merged block; the ladder and the current unit are
+                        then left as they were */
+int cms_hokusai_tick(CmsHokusai* hk);
+
+/*  Estimate the number of times the key was inserted in units
+    [begin, end); blocks only partly inside the range are counted whole, so
+    the range is in effect rounded out to the blocks covering it
+
+    Returns:
+        The estimate
+        CMS_ERROR   -   When there are insufficient hashes */
+int64_t cms_hokusai_check_range(CmsHokusai* hk, const char* key, uint64_t begin, uint64_t end);
+int64_t cms_hokusai_check_range_alt(CmsHokusai* hk, uint64_t* hashes, unsigned int num_hashes, uint64_t begin, uint64_t end);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,288 @@
+/*******************************************************************************
+***     Invertible count-min sketch for fixed length keys
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cms_invertible.h"
+#include "cms_common.h"
+
+#define INVERTIBLE_MAGIC "CMSINV01"
+#define INVERTIBLE_MAGIC_SIZE 8
+
+/*  On disk: header, the `width` x `depth` bins and `key_bytes` * 8 bit-sums
+    per bin */
+typedef struct {
+    char magic[INVERTIBLE_MAGIC_SIZE];
+    uint32_t width;
+    uint32_t depth;
+    uint32_t key_bytes;
+    uint32_t reserved;
+    int64_t elements_added;
+} __invertible_header;
+
+/* private functions */
+static uint64_t* __hashes_alloc(const CmsInvertible* inv, uint64_t* stack_hashes);
+static void __key_hashes(const CmsInvertible* inv, const uint8_t* key, uint64_t* hashes);
+static uint64_t __fnv_1a_bytes(const uint8_t* key, unsigned int len, int seed);
+static void __update_bit_sums(CmsInvertible* inv, const uint64_t* hashes, const uint8_t* key, int64_t x);
+static int __decode_bin(const CmsInvertible* inv, uint64_t bin, int32_t threshold, uint8_t* key);
+
+
+int cms_inv_init(CmsInvertible* inv, unsigned int width, unsigned int depth, unsigned int key_bytes) {
+    memset(inv, 0, sizeof(CmsInvertible));
+    if (key_bytes == 0 || key_bytes > CMS_INV_MAX_KEY_BYTES) {
+        fprintf(stderr, "Keys of an invertible sketch need 1 to %d bytes!\n", CMS_INV_MAX_KEY_BYTES);
+        return CMS_ERROR;
+    }
+    if (cms_init_alt(&inv->cms, width, depth, NULL) == CMS_ERROR) {
+        return CMS_ERROR;
+    }
+    inv->key_bytes = key_bytes;
+    inv->key_bits = key_bytes * 8;
+    inv->bit_sums = (int32_t*)calloc((size_t) width * depth * inv->key_bits, sizeof(int32_t));
+    if (inv->bit_sums == NULL) {
+        fprintf(stderr, "Failed to allocate the bit-sums of the invertible sketch!\n");
+        cms_inv_destroy(inv);
+        return CMS_ERROR;
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_inv_destroy(CmsInvertible* inv) {
+    free(inv->bit_sums);
+    inv->bit_sums = NULL;
+    inv->key_bytes = 0;
+    inv->key_bits = 0;
+    cms_destroy(&inv->cms);
+    return CMS_SUCCESS;
+}
+
+int cms_inv_clear(CmsInvertible* inv) {
+    memset(inv->bit_sums, 0, (size_t) inv->cms.width * inv->cms.depth * inv->key_bits * sizeof(int32_t));
+    return cms_clear(&inv->cms);
+}
+
+int32_t cms_inv_add_inc(CmsInvertible* inv, const uint8_t* key, uint32_t x) {
+    uint64_t stack_hashes[CMS_STACK_DEPTH];
+    uint64_t* hashes = __hashes_alloc(inv, stack_hashes);
+    if (hashes == NULL) {
+        return CMS_ERROR;
+    }
+    __key_hashes(inv, key, hashes);
+    __update_bit_sums(inv, hashes, key, x);
+    int32_t num_add = cms_add_inc_alt(&inv->cms, hashes, inv->cms.depth, x);
+    if (hashes != stack_hashes) {
+        free(hashes);
+    }
+    return num_add;
+}
+
+int32_t cms_inv_remove_inc(CmsInvertible* inv, const uint8_t* key, uint32_t x) {
+    uint64_t stack_hashes[CMS_STACK_DEPTH];
+    uint64_t* hashes = __hashes_alloc(inv, stack_hashes);
+    if (hashes == NULL) {
+        return CMS_ERROR;
+    }
+    __key_hashes(inv, key, hashes);
+    __update_bit_sums(inv, hashes, key, -(int64_t) x);
+    int32_t num_add = cms_remove_inc_alt(&inv->cms, hashes, inv->cms.depth, x);
+    if (hashes != stack_hashes) {
+        free(hashes);
+    }
+    return num_add;
+}
+
+int32_t cms_inv_check(CmsInvertible* inv, const uint8_t* key) {
+    uint64_t stack_hashes[CMS_STACK_DEPTH];
+    uint64_t* hashes = __hashes_alloc(inv, stack_hashes);
+    if (hashes == NULL) {
+        return CMS_ERROR;
+    }
+    __key_hashes(inv, key, hashes);
+    int32_t num_add = cms_check_alt(&inv->cms, hashes, inv->cms.depth);
+    if (hashes != stack_hashes) {
+        free(hashes);
+    }
+    return num_add;
+}
+
+int cms_inv_merge(CmsInvertible* inv, CmsInvertible* other) {
+    if (inv->key_bytes != other->key_bytes) {
+        fprintf(stderr, "Unable to merge invertible sketches of different key lengths!\n");
+        return CMS_ERROR;
+    }
+    if (cms_merge_into(&inv->cms, 1, &other->cms) == CMS_ERROR) {
+        return CMS_ERROR;
+    }
+    uint64_t num_sums = (uint64_t) inv->cms.width * inv->cms.depth * inv->key_bits;
+    for (uint64_t i = 0; i < num_sums; ++i) {
+        inv->bit_sums[i] = __clamp_int32((int64_t) inv->bit_sums[i] + other->bit_sums[i]);
+    }
+    return CMS_SUCCESS;
+}
+
+unsigned int cms_inv_decode(CmsInvertible* inv, int32_t threshold, uint8_t* keys, int32_t* counts, unsigned int max_keys) {
+    uint32_t width = inv->cms.width, depth = inv->cms.depth;
+    uint8_t key[CMS_INV_MAX_KEY_BYTES], other[CMS_INV_MAX_KEY_BYTES];
+    uint64_t stack_hashes[CMS_STACK_DEPTH];
+    uint64_t* hashes = __hashes_alloc(inv, stack_hashes);
+    unsigned int found = 0;
+
+    if (hashes == NULL) {
+        return 0;
+    }
+
+    if (threshold < 1) {
+        threshold = 1;  /* empty counters decode to the all zero key */
+    }
+    for (uint32_t i = 0; i < depth; ++i) {
+        for (uint32_t j = 0; j < width; ++j) {
+            uint64_t bin = (uint64_t) i * width + j;
+            if (!__decode_bin(inv, bin, threshold, key)) {
+                continue;
+            }
+            /* a key decoded from a counter it does not hash to is noise */
+            __key_hashes(inv, key, hashes);
+            if (hashes[i] % width != j) {
+                continue;
+            }
+            int32_t count = cms_check_alt(&inv->cms, hashes, depth);
+            if (count < threshold) {
+                continue;
+            }
+            /* report each key from the first row it decodes in */
+            int seen = 0;
+            for (uint32_t k = 0; k < i && !seen; ++k) {
+                uint64_t prev = (hashes[k] % width) + (uint64_t) k * width;
+                seen = __decode_bin(inv, prev, threshold, other) && memcmp(key, other, inv->key_bytes) == 0;
+            }
+            if (seen) {
+                continue;
+            }
+            if (found < max_keys) {
+                memcpy(keys + (size_t) found * inv->key_bytes, key, inv->key_bytes);
+                counts[found] = count;
+            }
+            ++found;
+        }
+    }
+    if (hashes != stack_hashes) {
+        free(hashes);
+    }
+    return found;
+}
+
+int cms_inv_export(CmsInvertible* inv, const char* filepath) {
+    FILE* fp = fopen(filepath, "w+b");
+    if (fp == NULL) {
+        fprintf(stderr, "Can't open file %s!\n", filepath);
+        return CMS_ERROR;
+    }
+    __invertible_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INVERTIBLE_MAGIC, INVERTIBLE_MAGIC_SIZE);
+    header.width = inv->cms.width;
+    header.depth = inv->cms.depth;
+    header.key_bytes = inv->key_bytes;
+    header.elements_added = inv->cms.elements_added;
+    size_t num_bins = (size_t) inv->cms.width * inv->cms.depth;
+    size_t num_sums = num_bins * inv->key_bits;
+    int res = (fwrite(&header, sizeof(header), 1, fp) == 1
+            && fwrite(inv->cms.bins, sizeof(int32_t), num_bins, fp) == num_bins
+            && fwrite(inv->bit_sums, sizeof(int32_t), num_sums, fp) == num_sums) ? CMS_SUCCESS : CMS_ERROR;
+    if (fclose(fp) != 0) {
+        res = CMS_ERROR;
+    }
+    return res;
+}
+
+int cms_inv_import(CmsInvertible* inv, const char* filepath) {
+    FILE* fp = fopen(filepath, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Can't open file %s!\n", filepath);
+        return CMS_ERROR;
+    }
+    __invertible_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, INVERTIBLE_MAGIC, INVERTIBLE_MAGIC_SIZE) != 0
+            || cms_inv_init(inv, header.width, header.depth, header.key_bytes) == CMS_ERROR) {
+        fprintf(stderr, "%s is not an invertible sketch!\n", filepath);
+        fclose(fp);
+        return CMS_ERROR;
+    }
+    size_t num_bins = (size_t) header.width * header.depth;
+    size_t num_sums = num_bins * inv->key_bits;
+    if (fread(inv->cms.bins, sizeof(int32_t), num_bins, fp) != num_bins
+            || fread(inv->bit_sums, sizeof(int32_t), num_sums, fp) != num_sums) {
+        fprintf(stderr, "%s is truncated!\n", filepath);
+        cms_inv_destroy(inv);
+        fclose(fp);
+        return CMS_ERROR;
+    }
+    inv->cms.elements_added = header.elements_added;
+    fclose(fp);
+    return CMS_SUCCESS;
+}
+
+
+/*******************************************************************************
+*    PRIVATE FUNCTIONS
+*******************************************************************************/
+/* room for the `depth` hashes of a key: `stack_hashes` for up to
+   CMS_STACK_DEPTH rows, allocated beyond that */
+static uint64_t* __hashes_alloc(const CmsInvertible* inv, uint64_t* stack_hashes) {
+    if (inv->cms.depth <= CMS_STACK_DEPTH) {
+        return stack_hashes;
+    }
+    uint64_t* hashes = (uint64_t*)malloc(inv->cms.depth * sizeof(uint64_t));
+    if (hashes == NULL) {
+        fprintf(stderr, "Failed to allocate the hashes of the key!\n");
+    }
+    return hashes;
+}
+
+/* keys are raw bytes and may hold NULs, so the sketch's string hash can't be used */
+static void __key_hashes(const CmsInvertible* inv, const uint8_t* key, uint64_t* hashes) {
+    for (unsigned int i = 0; i < inv->cms.depth; ++i) {
+        hashes[i] = __fnv_1a_bytes(key, inv->key_bytes, i);
+    }
+}
+
+static uint64_t __fnv_1a_bytes(const uint8_t* key, unsigned int len, int seed) {
+    uint64_t h = 14695981039346656037ULL + (31 * seed);
+    for (unsigned int i = 0; i < len; ++i) {
+        h = h ^ key[i];
+        h = h * 1099511628211ULL;
+    }
+    return h;
+}
+
+static void __update_bit_sums(CmsInvertible* inv, const uint64_t* hashes, const uint8_t* key, int64_t x) {
+    uint32_t width = inv->cms.width;
+    for (unsigned int i = 0; i < inv->cms.depth; ++i) {
+        uint64_t bin = (hashes[i] % width) + (uint64_t) i * width;
+        int32_t* sums = inv->bit_sums + bin * inv->key_bits;
+        for (unsigned int b = 0; b < inv->key_bits; ++b) {
+            if ((key[b >> 3] >> (b & 7)) & 1) {
+                sums[b] = __clamp_int32((int64_t) sums[b] + x);
+            }
+        }
+    }
+}
+
+/* majority vote of the bit-sums of a counter of at least `threshold` */
+static int __decode_bin(const CmsInvertible* inv, uint64_t bin, int32_t threshold, uint8_t* key) {
+    int64_t count = inv->cms.bins[bin];
+    if (count < threshold) {
+        return 0;
+    }
+    const int32_t* sums = inv->bit_sums + bin * inv->key_bits;
+    memset(key, 0, inv->key_bytes);
+    for (unsigned int b = 0; b < inv->key_bits; ++b) {
+        if (2 * (int64_t) sums[b] > count) {
+            key[b >> 3] |= (uint8_t) (1 << (b & 7));
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,105 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_INVERTIBLE_H__
+#define BARRUST_COUNT_MIN_SKETCH_INVERTIBLE_H__
+
+/*******************************************************************************
+***     Invertible count-min sketch for fixed length keys
+***
+***     Next to each counter the sketch keeps one bit-sum counter per key bit:
+***     the total count of the keys in the counter that have that bit set. A
+***     counter dominated by a heavy key has each bit-sum either close to the
+***     counter (bit set) or close to 0 (bit clear), so the key can be read
+***     back by majority vote and then verified by hashing it. Every counter
+***     is a plain sum, so sketches from different collectors are merged by
+***     adding them and heavy keys decoded from the merged sketch.
+*******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "cmsketch.h"
+
+#define CMS_INV_MAX_KEY_BYTES   64
+
+typedef struct {
+    uint32_t key_bytes;
+    uint32_t key_bits;
+    int32_t* bit_sums;          /* key_bits per counter, in the order of the bins */
+    CountMinSketch cms;         /* hashed with FNV-1a over the key bytes */
+} CmsInvertible, cms_invertible;
+
+
+/*  Initialize an invertible sketch of `width` x `depth` for keys of exactly
+    `key_bytes` bytes (at most CMS_INV_MAX_KEY_BYTES)
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When a dimension is 0 or unable to allocate */
+int cms_inv_init(CmsInvertible* inv, unsigned int width, unsigned int depth, unsigned int key_bytes);
+
+/*  Free all memory of the sketch
+
+    Returns:
+        CMS_SUCCESS */
+int cms_inv_destroy(CmsInvertible* inv);
+
+/*  Reset the sketch to zero elements inserted
+
+    Returns:
+        CMS_SUCCESS */
+int cms_inv_clear(CmsInvertible* inv);
+
+/*  Insert or remove the `key_bytes` bytes long key `x` times; the return
+    values are those of `cms_add_inc` and `cms_remove_inc`, or CMS_ERROR
+    when a sketch deeper than CMS_STACK_DEPTH cannot allocate the hashes */
+int32_t cms_inv_add_inc(CmsInvertible* inv, const uint8_t* key, uint32_t x);
+int32_t cms_inv_remove_inc(CmsInvertible* inv, const uint8_t* key, uint32_t x);
+static __inline__ int32_t cms_inv_add(CmsInvertible* inv, const uint8_t* key) {
+    return cms_inv_add_inc(inv, key, 1);
+}
+
+/* Determine the maximum number of times the key may have been inserted */
+int32_t cms_inv_check(CmsInvertible* inv, const uint8_t* key);
+
+/*  Add the counters of `other` to `inv`; both need the same dimensions and
+    key length
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the sketches are not compatible */
+int cms_inv_merge(CmsInvertible* inv, CmsInvertible* other);
+
+/*  Recover the keys whose estimate is at least `threshold`; up to
+    `max_keys` keys are written one after the other to `keys` (each
+    `key_bytes` long) with their estimates in `counts`
+
+    A key is only reported if it hashes back to the counter it was decoded
+    from and its estimate over all rows reaches the threshold, so keys that
+    share their counters with other heavy keys in every row can be missed.
+
+    Returns:
+        The number of keys recovered, which may exceed `max_keys`; 0 when a
+        sketch deeper than CMS_STACK_DEPTH cannot allocate the hashes */
+unsigned int cms_inv_decode(CmsInvertible* inv, int32_t threshold, uint8_t* keys, int32_t* counts, unsigned int max_keys);
+
+/*  Export the invertible sketch to file; a header with the dimensions and
+    key length is followed by the bins and the bit-sums
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the file cannot be written */
+int cms_inv_export(CmsInvertible* inv, const char* filepath);
+
+/*  Import an invertible sketch previously exported with `cms_inv_export`
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the file cannot be read or is not an invertible sketch */
+int cms_inv_import(CmsInvertible* inv, const char* filepath);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,209 @@
+/*******************************************************************************
+***     Count-Min-Log sketch with 8-bit logarithmic counters
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "cms_log.h"
+#include "cms_common.h"
+
+/* private functions */
+static uint8_t __log_advance(const CmsLog* cl, uint8_t c, uint64_t x);
+static __inline__ double __rand_double(void);
+static double __median(double* values, unsigned int n);
+static __inline__ int64_t __round_estimate(double val);
+
+/* per thread xorshift64* state; seeded on first use */
+static _Thread_local uint64_t __rng_state = 0;
+static uint64_t __rng_seeds = 0;
+
+
+int cms_log_init_alt(CmsLog* cl, unsigned int width, unsigned int depth, double base, cms_hash_function hash_function) {
+    memset(cl, 0, sizeof(CmsLog));
+    if (width == 0 || depth == 0 || !(base > 1.0)) {
+        fprintf(stderr, "Unable to initialize the Count-Min-Log sketch since it needs a width, depth and a base larger than 1!\n");
+        return CMS_ERROR;
+    }
+    cl->hash_function = (hash_function == NULL) ? cms_default_hash : hash_function;
+
+    cl->bins = (uint8_t*)calloc((size_t) width * depth, sizeof(uint8_t));
+    if (cl->bins == NULL) {
+        fprintf(stderr, "Failed to allocate the Count-Min-Log sketch!\n");
+        return CMS_ERROR;
+    }
+    cl->width = width;
+    cl->depth = depth;
+    cl->base = base;
+    for (unsigned int c = 0; c < CMS_LOG_LEVELS; ++c) {
+        cl->step[c] = pow(base, c);
+        cl->value[c] = (cl->step[c] - 1.0) / (base - 1.0);
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_log_destroy(CmsLog* cl) {
+    free(cl->bins);
+    cl->bins = NULL;
+    cl->width = 0;
+    cl->depth = 0;
+    cl->elements_added = 0;
+    cl->hash_function = NULL;
+    return CMS_SUCCESS;
+}
+
+int cms_log_clear(CmsLog* cl) {
+    memset(cl->bins, 0, (size_t) cl->width * cl->depth);
+    cl->elements_added = 0;
+    return CMS_SUCCESS;
+}
+
+int cms_log_add_inc_alt(CmsLog* cl, uint64_t* hashes, unsigned int num_hashes, uint64_t x) {
+    if (num_hashes < cl->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the addition of the element to the Count-Min-Log sketch!");
+        return CMS_ERROR;
+    }
+    cl->elements_added += x;
+    for (unsigned int i = 0; i < cl->depth; ++i) {
+        uint64_t bin = (hashes[i] % cl->width) + (uint64_t) i * cl->width;
+        cl->bins[bin] = __log_advance(cl, cl->bins[bin], x);
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_log_add_inc(CmsLog* cl, const char* key, uint64_t x) {
+    uint64_t* hashes = cl->hash_function(cl->depth, key);
+    int res = cms_log_add_inc_alt(cl, hashes, cl->depth, x);
+    free(hashes);
+    return res;
+}
+
+int64_t cms_log_check_alt(CmsLog* cl, uint64_t* hashes, unsigned int num_hashes) {
+    if (num_hashes < cl->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the min lookup of the element in the Count-Min-Log sketch!");
+        return CMS_ERROR;
+    }
+    uint8_t min = UINT8_MAX;
+    for (unsigned int i = 0; i < cl->depth; ++i) {
+        uint8_t c = cl->bins[(hashes[i] % cl->width) + (uint64_t) i * cl->width];
+        min = (c < min) ? c : min;
+    }
+    return __round_estimate(cl->value[min]);
+}
+
+int64_t cms_log_check(CmsLog* cl, const char* key) {
+    uint64_t* hashes = cl->hash_function(cl->depth, key);
+    int64_t num_add = cms_log_check_alt(cl, hashes, cl->depth);
+    free(hashes);
+    return num_add;
+}
+
+int64_t cms_log_check_mean_alt(CmsLog* cl, uint64_t* hashes, unsigned int num_hashes) {
+    if (num_hashes < cl->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the mean lookup of the element in the Count-Min-Log sketch!");
+        return CMS_ERROR;
+    }
+    double sum = 0.0;
+    for (unsigned int i = 0; i < cl->depth; ++i) {
+        sum += cl->value[cl->bins[(hashes[i] % cl->width) + (uint64_t) i * cl->width]];
+    }
+    return __round_estimate(sum / cl->depth);
+}
+
+int64_t cms_log_check_mean(CmsLog* cl, const char* key) {
+    uint64_t* hashes = cl->hash_function(cl->depth, key);
+    int64_t num_add = cms_log_check_mean_alt(cl, hashes, cl->depth);
+    free(hashes);
+    return num_add;
+}
+
+int64_t cms_log_check_mean_min_alt(CmsLog* cl, uint64_t* hashes, unsigned int num_hashes) {
+    if (num_hashes < cl->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the mean-min lookup of the element in the Count-Min-Log sketch!");
+        return CMS_ERROR;
+    }
+    double stack_values[CMS_STACK_DEPTH];
+    double* mean_min_values = (cl->depth <= CMS_STACK_DEPTH) ? stack_values : (double*)malloc(cl->depth * sizeof(double));
+    if (mean_min_values == NULL) {
+        fprintf(stderr, "Failed to allocate the mean-min lookup!\n");
+        return CMS_ERROR;
+    }
+    double elements_added = (double) cl->elements_added;
+    for (unsigned int i = 0; i < cl->depth; ++i) {
+        double val = cl->value[cl->bins[(hashes[i] % cl->width) + (uint64_t) i * cl->width]];
+        mean_min_values[i] = (cl->width > 1) ? val - ((elements_added - val) / (cl->width - 1)) : val;
+    }
+    int64_t num_add = __round_estimate(__median(mean_min_values, cl->depth));
+    if (mean_min_values != stack_values) {
+        free(mean_min_values);
+    }
+    return num_add;
+}
+
+int64_t cms_log_check_mean_min(CmsLog* cl, const char* key) {
+    uint64_t* hashes = cl->hash_function(cl->depth, key);
+    int64_t num_add = cms_log_check_mean_min_alt(cl, hashes, cl->depth);
+    free(hashes);
+    return num_add;
+}
+
+
+/*******************************************************************************
+*    PRIVATE FUNCTIONS
+*******************************************************************************/
+/*  Advance the exponent by `x` events: whole steps are taken directly and the
+    remainder raises it with probability remainder / step, which keeps the
+    represented value unbiased */
+static uint8_t __log_advance(const CmsLog* cl, uint8_t c, uint64_t x) {
+    double remaining = (double) x;
+    while (remaining > 0.0 && c < CMS_LOG_LEVELS - 1) {
+        double step = cl->step[c];
+        if (remaining >= step) {
+            remaining -= step;
+            ++c;
+        } else {
+            if (__rand_double() * step < remaining) {
+                ++c;
+            }
+            break;
+        }
+    }
+    return c;
+}
+
+/* uniform in [0, 1) from the top 53 bits of xorshift64* */
+static __inline__ double __rand_double(void) {
+    uint64_t s = __rng_state;
+    if (s == 0) {
+        /* distinct streams per thread: the thread's state address and a shared sequence */
+        s = __mix((uint64_t) (uintptr_t) &__rng_state ^ __atomic_add_fetch(&__rng_seeds, 0x9E3779B97F4A7C15ULL, __ATOMIC_RELAXED));
+        s = (s == 0) ? 1 : s;
+    }
+    s ^= s >> 12;
+    s ^= s << 25;
+    s ^= s >> 27;
+    __rng_state = s;
+    return (double) ((s * 0x2545F4914F6CDD1DULL) >> 11) * 0x1.0p-53;
+}
+
+/* median by insertion sort; depth is small */
+static double __median(double* values, unsigned int n) {
+    for (unsigned int i = 1; i < n; ++i) {
+        double v = values[i];
+        unsigned int j = i;
+        while (j > 0 && values[j - 1] > v) {
+            values[j] = values[j - 1];
+            --j;
+        }
+        values[j] = v;
+    }
+    return (n % 2 == 1) ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2.0;
+}
+
+static __inline__ int64_t __round_estimate(double val) {
+    if (val <= 0.0) {
+        return 0;
+    }
+    return (val >= (double) INT64_MAX) ? INT64_MAX : llround(val);
+}
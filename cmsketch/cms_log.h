@@ -0,0 +1,103 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_LOG_H__
+#define BARRUST_COUNT_MIN_SKETCH_LOG_H__
+
+/*******************************************************************************
+***     Count-Min-Log sketch with 8-bit logarithmic counters
+***
+***     Each counter holds an exponent c and stands for (base^c - 1) / (base - 1)
+***     events. Adding one event raises c with probability base^-c (Morris
+***     counting), so the represented value grows by one in expectation while
+***     a byte covers counts far beyond INT32_MAX: with the default base of
+***     1.12 a counter saturates at about 2.9e13. The price is a relative
+***     error of roughly sqrt((base - 1) / 2) on every counter; a base closer
+***     to 1 is more accurate but saturates earlier. Large increments advance
+***     the counter deterministically through whole steps and only draw for
+***     the remainder, so they cost O(steps) rather than O(x). The random
+***     numbers come from a thread-local xorshift generator.
+***
+***     Paper: Pitel, Fouquier - "Count-Min-Log sketch: Approximately counting
+***     with approximate counters" (2015)
+*******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "cmsketch.h"
+
+#define CMS_LOG_LEVELS          256
+#define CMS_LOG_DEFAULT_BASE    1.12
+
+typedef struct {
+    uint32_t depth;
+    uint32_t width;
+    int64_t elements_added;
+    double base;
+    cms_hash_function hash_function;
+    uint8_t* bins;
+    double value[CMS_LOG_LEVELS];   /* the count a counter stands for */
+    double step[CMS_LOG_LEVELS];    /* events needed to advance a counter: base^c */
+} CmsLog, cms_log;
+
+
+/*  Initialize a Count-Min-Log sketch of `width` x `depth` 8-bit counters of
+    the given `base`, which must be larger than 1
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When a dimension is 0, the base is invalid or unable
+                        to allocate */
+int cms_log_init_alt(CmsLog* cl, unsigned int width, unsigned int depth, double base, cms_hash_function hash_function);
+static __inline__ int cms_log_init(CmsLog* cl, unsigned int width, unsigned int depth) {
+    return cms_log_init_alt(cl, width, depth, CMS_LOG_DEFAULT_BASE, NULL);
+}
+
+/*  Free all memory of the sketch
+
+    Returns:
+        CMS_SUCCESS */
+int cms_log_destroy(CmsLog* cl);
+
+/*  Reset the sketch to zero elements inserted
+
+    Returns:
+        CMS_SUCCESS */
+int cms_log_clear(CmsLog* cl);
+
+/*  Insert the key `x` times; every row advances its counter independently
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When there are insufficient hashes
+
+    NOTE: The Count-Min-Log sketch does not support removes */
+int cms_log_add_inc(CmsLog* cl, const char* key, uint64_t x);
+int cms_log_add_inc_alt(CmsLog* cl, uint64_t* hashes, unsigned int num_hashes, uint64_t x);
+static __inline__ int cms_log_add(CmsLog* cl, const char* key) {
+    return cms_log_add_inc(cl, key, 1);
+}
+
+/*  Estimate the number of times the key was inserted from the smallest of
+    its counters, as `cms_check` does
+
+    Returns:
+        The estimate
+        CMS_ERROR   -   When there are insufficient hashes */
+int64_t cms_log_check(CmsLog* cl, const char* key);
+int64_t cms_log_check_alt(CmsLog* cl, uint64_t* hashes, unsigned int num_hashes);
+
+/*  Estimate from the mean of the key's counters, as `cms_check_mean` does */
+int64_t cms_log_check_mean(CmsLog* cl, const char* key);
+int64_t cms_log_check_mean_alt(CmsLog* cl, uint64_t* hashes, unsigned int num_hashes);
+
+/*  Estimate from the median of the key's counters less the expected noise of
+    their rows, as `cms_check_mean_min` does */
+int64_t cms_log_check_mean_min(CmsLog* cl, const char* key);
+int64_t cms_log_check_mean_min_alt(CmsLog* cl, uint64_t* hashes, unsigned int num_hashes);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
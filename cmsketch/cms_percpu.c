@@ -0,0 +1,142 @@
+/*******************************************************************************
+***     Per-CPU sharded count-min sketch
+*******************************************************************************/
+
+#define _GNU_SOURCE         /* sched_getcpu */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include "cms_percpu.h"
+#include "cms_common.h"
+
+/* private functions */
+static cms_percpu_shard* __lock_current_shard(CmsPerCpu* pc);
+static void __lock(int* lock);
+static void __unlock(int* lock);
+
+
+int cms_percpu_init_alt(CmsPerCpu* pc, unsigned int width, unsigned int depth, cms_hash_function hash_function) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    pc->num_shards = (num_cpus < 1) ? 1 : (uint32_t) num_cpus;
+    pc->width = width;
+    pc->depth = depth;
+    pc->shards = (cms_percpu_shard*)aligned_alloc(CMS_CACHE_LINE_SIZE, pc->num_shards * sizeof(cms_percpu_shard));
+    if (pc->shards == NULL) {
+        fprintf(stderr, "Failed to allocate %u per-CPU shards!\n", pc->num_shards);
+        return CMS_ERROR;
+    }
+    memset(pc->shards, 0, pc->num_shards * sizeof(cms_percpu_shard));
+    for (uint32_t i = 0; i < pc->num_shards; ++i) {
+        if (cms_init_alt(&pc->shards[i].cms, width, depth, hash_function) == CMS_ERROR) {
+            pc->num_shards = i;
+            cms_percpu_destroy(pc);
+            return CMS_ERROR;
+        }
+    }
+    pc->hash_function = pc->shards[0].cms.hash_function;
+    return CMS_SUCCESS;
+}
+
+int cms_percpu_destroy(CmsPerCpu* pc) {
+    for (uint32_t i = 0; i < pc->num_shards; ++i) {
+        cms_destroy(&pc->shards[i].cms);
+    }
+    free(pc->shards);
+    pc->shards = NULL;
+    pc->num_shards = 0;
+    pc->width = 0;
+    pc->depth = 0;
+    pc->hash_function = NULL;
+    return CMS_SUCCESS;
+}
+
+int cms_percpu_clear(CmsPerCpu* pc) {
+    for (uint32_t i = 0; i < pc->num_shards; ++i) {
+        __lock(&pc->shards[i].lock);
+        cms_clear(&pc->shards[i].cms);
+        __unlock(&pc->shards[i].lock);
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_percpu_add_inc_alt(CmsPerCpu* pc, uint64_t* hashes, unsigned int num_hashes, uint32_t x) {
+    if (num_hashes < pc->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the addition of the element to the count-min sketch!");
+        return CMS_ERROR;
+    }
+    cms_percpu_shard* shard = __lock_current_shard(pc);
+    cms_add_inc_alt(&shard->cms, hashes, num_hashes, x);
+    __unlock(&shard->lock);
+    return CMS_SUCCESS;
+}
+
+int cms_percpu_add_inc(CmsPerCpu* pc, const char* key, uint32_t x) {
+    uint64_t* hashes = pc->hash_function(pc->depth, key);
+    int res = cms_percpu_add_inc_alt(pc, hashes, pc->depth, x);
+    free(hashes);
+    return res;
+}
+
+int32_t cms_percpu_check_alt(CmsPerCpu* pc, uint64_t* hashes, unsigned int num_hashes) {
+    if (num_hashes < pc->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the min lookup of the element to the count-min sketch!");
+        return CMS_ERROR;
+    }
+    int64_t num_add = INT64_MAX;
+    for (unsigned int i = 0; i < pc->depth; ++i) {
+        uint64_t bin = (hashes[i] % pc->width) + ((uint64_t) i * pc->width);
+        int64_t sum = 0;
+        for (uint32_t s = 0; s < pc->num_shards; ++s) {
+            sum += __atomic_load_n(&pc->shards[s].cms.bins[bin], __ATOMIC_RELAXED);
+        }
+        if (sum < num_add) {
+            num_add = sum;
+        }
+    }
+    return __clamp_int32(num_add);
+}
+
+int32_t cms_percpu_check(CmsPerCpu* pc, const char* key) {
+    uint64_t* hashes = pc->hash_function(pc->depth, key);
+    int32_t num_add = cms_percpu_check_alt(pc, hashes, pc->depth);
+    free(hashes);
+    return num_add;
+}
+
+int cms_percpu_merge(CmsPerCpu* pc, CountMinSketch* cms) {
+    if (cms_init_alt(cms, pc->width, pc->depth, pc->hash_function) == CMS_ERROR) {
+        return CMS_ERROR;
+    }
+    for (uint32_t i = 0; i < pc->num_shards; ++i) {
+        __lock(&pc->shards[i].lock);
+        cms_merge_into(cms, 1, &pc->shards[i].cms);
+        __unlock(&pc->shards[i].lock);
+    }
+    return CMS_SUCCESS;
+}
+
+
+/*******************************************************************************
+*    PRIVATE FUNCTIONS
+*******************************************************************************/
+static cms_percpu_shard* __lock_current_shard(CmsPerCpu* pc) {
+    int cpu = sched_getcpu();
+    uint32_t idx = (cpu < 0) ? 0 : (uint32_t) cpu % pc->num_shards;
+    cms_percpu_shard* shard = &pc->shards[idx];
+    __lock(&shard->lock);
+    return shard;
+}
+
+static void __lock(int* lock) {
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+            sched_yield();
+        }
+    }
+}
+
+static void __unlock(int* lock) {
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,93 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_PERCPU_H__
+#define BARRUST_COUNT_MIN_SKETCH_PERCPU_H__
+
+/*******************************************************************************
+***     Per-CPU sharded count-min sketch
+***
+***     One count-min sketch shard per CPU; an update goes to the shard of the
+***     CPU the calling thread is running on (`sched_getcpu`) so memory is
+***     bounded by the number of cores rather than the number of threads.
+***     Each shard has a spin lock that is only contended when a thread is
+***     migrated in the middle of an update. Queries merge the shards on the
+***     fly by summing each row's counters across the shards.
+*******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "cmsketch.h"
+
+#define CMS_CACHE_LINE_SIZE 64
+
+/* every shard header starts on its own cache line so shards never share one */
+typedef struct {
+    int lock;
+    CountMinSketch cms;
+} __attribute__((aligned(CMS_CACHE_LINE_SIZE))) cms_percpu_shard;
+
+typedef struct {
+    uint32_t num_shards;
+    uint32_t depth;
+    uint32_t width;
+    cms_hash_function hash_function;
+    cms_percpu_shard* shards;
+} CmsPerCpu, cms_percpu;
+
+
+/*  Initialize one count-min sketch of `width` x `depth` per configured CPU
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When unable to allocate the shards or width or depth are 0 */
+int cms_percpu_init_alt(CmsPerCpu* pc, unsigned int width, unsigned int depth, cms_hash_function hash_function);
+static __inline__ int cms_percpu_init(CmsPerCpu* pc, unsigned int width, unsigned int depth) {
+    return cms_percpu_init_alt(pc, width, depth, NULL);
+}
+
+/*  Free all memory used by the shards
+
+    Returns:
+        CMS_SUCCESS */
+int cms_percpu_destroy(CmsPerCpu* pc);
+
+/*  Reset every shard to zero elements inserted
+
+    Returns:
+        CMS_SUCCESS */
+int cms_percpu_clear(CmsPerCpu* pc);
+
+/*  Add the key (or its hashes) `x` times to the shard of the current CPU;
+    safe to call from any number of threads
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When there are insufficient hashes */
+int cms_percpu_add_inc(CmsPerCpu* pc, const char* key, uint32_t x);
+int cms_percpu_add_inc_alt(CmsPerCpu* pc, uint64_t* hashes, unsigned int num_hashes, uint32_t x);
+static __inline__ int cms_percpu_add(CmsPerCpu* pc, const char* key) {
+    return cms_percpu_add_inc(pc, key, 1);
+}
+
+/*  Determine the maximum number of times the key may have been inserted
+    across all shards; each row is summed over the shards before taking the
+    minimum, so the result matches that of the merged sketch
+
+    NOTE: Runs concurrently with updates without locking; updates in flight
+    may or may not be counted */
+int32_t cms_percpu_check(CmsPerCpu* pc, const char* key);
+int32_t cms_percpu_check_alt(CmsPerCpu* pc, uint64_t* hashes, unsigned int num_hashes);
+
+/*  Merge all of the shards into the newly initialized count-min sketch `cms`
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When unable to allocate the count-min sketch */
+int cms_percpu_merge(CmsPerCpu* pc, CountMinSketch* cms);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,238 @@
+/*******************************************************************************
+***     Library-level thread pool for bulk count-min sketch operations
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "cmsketch.h"
+#include "cms_pool.h"
+
+#define TASKS_PER_THREAD 4
+
+typedef struct {
+    cms_range_function body;
+    void* arg;
+    uint64_t num_items;
+    unsigned int num_tasks;
+} __range_job;
+
+/* a job of the library pool; lives on the stack of the submitting thread */
+typedef struct {
+    cms_task_function task;
+    void* arg;
+    unsigned int num_tasks;
+    unsigned int next_task;
+    unsigned int completed;         /* guarded by the pool lock */
+    unsigned int active;            /* workers inside the job; guarded by the pool lock */
+} __pool_job;
+
+/* the one library pool; its workers run one job at a time */
+static struct {
+    pthread_mutex_t config_lock;    /* guards the executor and `users` */
+    pthread_cond_t idle;            /* signalled when `users` drops to 0 */
+    unsigned int users;             /* parallel loops running on the executor */
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t* threads;
+    unsigned int num_threads;
+    uint64_t generation;
+    int stop;
+    __pool_job* job;                /* the running job, NULL between jobs */
+    cms_executor executor;
+    void* context;
+    unsigned int concurrency;
+} __pool = {
+    .config_lock = PTHREAD_MUTEX_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+/* private functions */
+static void* __worker(void* arg);
+static void __run_tasks(__pool_job* job);
+static void __pool_execute(void* context, cms_task_function task, void* arg, unsigned int num_tasks);
+static void __range_task(void* arg, unsigned int task);
+
+
+int cms_pool_init(unsigned int num_threads) {
+    cms_pool_destroy();
+    if (num_threads == 0) {
+        return CMS_SUCCESS;
+    }
+    __pool.threads = (pthread_t*)calloc(num_threads, sizeof(pthread_t));
+    if (__pool.threads == NULL) {
+        fprintf(stderr, "Failed to allocate the thread pool!\n");
+        return CMS_ERROR;
+    }
+    __pool.stop = 0;
+    for (unsigned int i = 0; i < num_threads; ++i) {
+        if (pthread_create(&__pool.threads[i], NULL, __worker, NULL) != 0) {
+            fprintf(stderr, "Failed to start thread pool worker %u!\n", i);
+            __pool.num_threads = i;
+            cms_pool_destroy();
+            return CMS_ERROR;
+        }
+        __pool.num_threads = i + 1;
+    }
+    __pool.executor = __pool_execute;
+    __pool.context = NULL;
+    __pool.concurrency = num_threads + 1;
+    return CMS_SUCCESS;
+}
+
+int cms_pool_destroy(void) {
+    pthread_mutex_lock(&__pool.config_lock);
+    while (__pool.users > 0) {
+        pthread_cond_wait(&__pool.idle, &__pool.config_lock);
+    }
+    pthread_mutex_lock(&__pool.lock);
+    __pool.stop = 1;
+    pthread_cond_broadcast(&__pool.work);
+    pthread_mutex_unlock(&__pool.lock);
+    for (unsigned int i = 0; i < __pool.num_threads; ++i) {
+        pthread_join(__pool.threads[i], NULL);
+    }
+    free(__pool.threads);
+    __pool.threads = NULL;
+    __pool.num_threads = 0;
+    __pool.executor = NULL;
+    __pool.context = NULL;
+    __pool.concurrency = 0;
+    pthread_mutex_unlock(&__pool.config_lock);
+    return CMS_SUCCESS;
+}
+
+int cms_pool_set_executor(cms_executor executor, void* context, unsigned int concurrency) {
+    if (executor == NULL || concurrency == 0) {
+        fprintf(stderr, "An executor needs a function and a concurrency of at least 1!\n");
+        return CMS_ERROR;
+    }
+    cms_pool_destroy();
+    pthread_mutex_lock(&__pool.config_lock);
+    __pool.executor = executor;
+    __pool.context = context;
+    __pool.concurrency = concurrency;
+    pthread_mutex_unlock(&__pool.config_lock);
+    return CMS_SUCCESS;
+}
+
+void cms_pool_parallel_for(uint64_t num_items, uint64_t min_items, cms_range_function body, void* arg) {
+    if (min_items == 0) {
+        min_items = 1;
+    }
+    pthread_mutex_lock(&__pool.config_lock);
+    uint64_t num_tasks = (uint64_t) __pool.concurrency * TASKS_PER_THREAD;
+    if (num_tasks > num_items / min_items) {
+        num_tasks = num_items / min_items;
+    }
+    if (__pool.executor == NULL || num_tasks <= 1) {
+        pthread_mutex_unlock(&__pool.config_lock);
+        body(arg, 0, num_items);
+        return;
+    }
+    /* the executor is only pinned, not locked, while the loop runs, so loops
+       over different sketches run concurrently on an application executor */
+    cms_executor executor = __pool.executor;
+    void* context = __pool.context;
+    ++__pool.users;
+    pthread_mutex_unlock(&__pool.config_lock);
+
+    __range_job job = {body, arg, num_items, (unsigned int) num_tasks};
+    executor(context, __range_task, &job, job.num_tasks);
+
+    pthread_mutex_lock(&__pool.config_lock);
+    if (--__pool.users == 0) {
+        pthread_cond_broadcast(&__pool.idle);
+    }
+    pthread_mutex_unlock(&__pool.config_lock);
+}
+
+
+/*******************************************************************************
+*    PRIVATE FUNCTIONS
+*******************************************************************************/
+static void __range_task(void* arg, unsigned int task) {
+    __range_job* job = (__range_job*) arg;
+    uint64_t begin = (job->num_items * task) / job->num_tasks;
+    uint64_t end = (job->num_items * (task + 1)) / job->num_tasks;
+    job->body(job->arg, begin, end);
+}
+
+/* the executor of the library pool; the calling thread runs tasks as well.
+   The workers take one job at a time, so a caller waits for the running job
+   to retire before handing them its own */
+static void __pool_execute(void* context, cms_task_function task, void* arg, unsigned int num_tasks) {
+    (void) context;
+    __pool_job job = {task, arg, num_tasks, 0, 0, 0};
+    pthread_mutex_lock(&__pool.lock);
+    while (__pool.job != NULL) {
+        pthread_cond_wait(&__pool.done, &__pool.lock);
+    }
+    __pool.job = &job;
+    ++__pool.generation;
+    pthread_cond_broadcast(&__pool.work);
+    pthread_mutex_unlock(&__pool.lock);
+
+    __run_tasks(&job);
+
+    /* wait for the last task and for every worker to leave the job, then
+       retire it so that a late worker never sees it */
+    pthread_mutex_lock(&__pool.lock);
+    while (job.completed < job.num_tasks || job.active > 0) {
+        pthread_cond_wait(&__pool.done, &__pool.lock);
+    }
+    __pool.job = NULL;
+    pthread_cond_broadcast(&__pool.done);     /* wake callers queued for the workers */
+    pthread_mutex_unlock(&__pool.lock);
+}
+
+/* claim and run tasks of `job` until none are left */
+static void __run_tasks(__pool_job* job) {
+    for (;;) {
+        unsigned int task = __atomic_fetch_add(&job->next_task, 1, __ATOMIC_RELAXED);
+        if (task >= job->num_tasks) {
+            break;
+        }
+        job->task(job->arg, task);
+        pthread_mutex_lock(&__pool.lock);
+        if (++job->completed == job->num_tasks) {
+            pthread_cond_broadcast(&__pool.done);
+        }
+        pthread_mutex_unlock(&__pool.lock);
+    }
+}
+
+static void* __worker(void* arg) {
+    (void) arg;
+    uint64_t seen = 0;
+    pthread_mutex_lock(&__pool.lock);
+    seen = __pool.generation;
+    for (;;) {
+        while (__pool.generation == seen && !__pool.stop) {
+            pthread_cond_wait(&__pool.work, &__pool.lock);
+        }
+        if (__pool.stop) {
+            break;
+        }
+        seen = __pool.generation;
+        __pool_job* job = __pool.job;
+        if (job == NULL) {
+            continue;       /* woke after the job was retired */
+        }
+        ++job->active;
+        pthread_mutex_unlock(&__pool.lock);
+
+        __run_tasks(job);
+
+        pthread_mutex_lock(&__pool.lock);
+        if (--job->active == 0) {
+            pthread_cond_broadcast(&__pool.done);
+        }
+    }
+    pthread_mutex_unlock(&__pool.lock);
+    return NULL;
+}
@@ -0,0 +1,73 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_POOL_H__
+#define BARRUST_COUNT_MIN_SKETCH_POOL_H__
+
+/*******************************************************************************
+***     Library-level thread pool for bulk count-min sketch operations
+***
+***     Operations that sweep the whole bins array (clear, merge, ...) split
+***     the bin range across the workers of this pool. The pool is either
+***     owned by the library (`cms_pool_init`) or borrowed from the
+***     application through an executor callback (`cms_pool_set_executor`).
+***     Without either, or for sketches with fewer than CMS_PARALLEL_MIN_BINS
+***     counters, everything stays on the calling thread.
+*******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* sketches with fewer counters are always processed on the calling thread */
+#define CMS_PARALLEL_MIN_BINS   (1U << 20)
+/* smallest number of counters handed to a single task */
+#define CMS_PARALLEL_MIN_CHUNK  (1U << 16)
+
+/* a unit of work; `task` is in the range [0, num_tasks) */
+typedef void (*cms_task_function)(void* arg, unsigned int task);
+
+/*  A user supplied executor: run `task(arg, i)` for every i in
+    [0, num_tasks), in any order and on any threads, and return only when all
+    of them have completed */
+typedef void (*cms_executor)(void* context, cms_task_function task, void* arg, unsigned int num_tasks);
+
+/* the body of a parallel loop over [begin, end) */
+typedef void (*cms_range_function)(void* arg, uint64_t begin, uint64_t end);
+
+
+/*  Start the library thread pool with `num_threads` workers (the calling
+    thread also participates); replaces any executor set previously
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When unable to start the threads */
+int cms_pool_init(unsigned int num_threads);
+
+/*  Stop the library thread pool (or forget the executor); bulk operations
+    go back to running on the calling thread
+
+    Returns:
+        CMS_SUCCESS */
+int cms_pool_destroy(void);
+
+/*  Use an application executor instead of the library thread pool;
+    `concurrency` is the number of tasks it can usefully run at once
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the executor is NULL or concurrency is 0 */
+int cms_pool_set_executor(cms_executor executor, void* context, unsigned int concurrency);
+
+/*  Split [0, num_items) into ranges of at least `min_items` items and run
+    `body` on them in parallel; returns once every range is done
+
+    NOTE: Safe to call from several threads at once; the loops are handed to
+    an application executor concurrently, while the library pool runs them
+    one after another */
+void cms_pool_parallel_for(uint64_t num_items, uint64_t min_items, cms_range_function body, void* arg);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
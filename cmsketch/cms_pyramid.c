@@ -0,0 +1,170 @@
+/*******************************************************************************
+***     Pyramid count-min sketch with variable size counters
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cms_pyramid.h"
+#include "cms_common.h"
+
+#define LEAF_BITS       4
+#define PARENT_BITS     6
+#define PARENT_COUNT    ((1U << PARENT_BITS) - 1)
+#define PARENT_FLAG(side) (0x40U << (side))   /* bit 6 for the left child, bit 7 for the right */
+#define WIDTH_ALIGN     (1U << (CMS_PYRAMID_LAYERS - 1))
+
+/* private functions */
+static void __column_add(CmsPyramid* pm, unsigned int row, uint32_t column, uint32_t x);
+static int64_t __column_value(const CmsPyramid* pm, unsigned int row, uint32_t column);
+static __inline__ size_t __layer_bytes(const CmsPyramid* pm, unsigned int layer);
+
+
+int cms_pyramid_init_alt(CmsPyramid* pm, unsigned int width, unsigned int depth, cms_hash_function hash_function) {
+    memset(pm, 0, sizeof(CmsPyramid));
+    if (width == 0 || depth == 0) {
+        fprintf(stderr, "Unable to initialize the pyramid sketch since both width and depth are required!\n");
+        return CMS_ERROR;
+    }
+    pm->hash_function = (hash_function == NULL) ? cms_default_hash : hash_function;
+    pm->depth = depth;
+    pm->width = (width + WIDTH_ALIGN - 1) & ~(WIDTH_ALIGN - 1);
+    pm->leaves = (uint8_t*)calloc(__layer_bytes(pm, 0), 1);
+    int ok = (pm->leaves != NULL);
+    for (unsigned int l = 0; l < CMS_PYRAMID_LAYERS - 1; ++l) {
+        pm->parents[l] = (uint8_t*)calloc(__layer_bytes(pm, l + 1), 1);
+        ok = ok && (pm->parents[l] != NULL);
+    }
+    if (!ok) {
+        fprintf(stderr, "Failed to allocate the pyramid sketch!\n");
+        cms_pyramid_destroy(pm);
+        return CMS_ERROR;
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_pyramid_destroy(CmsPyramid* pm) {
+    free(pm->leaves);
+    pm->leaves = NULL;
+    for (unsigned int l = 0; l < CMS_PYRAMID_LAYERS - 1; ++l) {
+        free(pm->parents[l]);
+        pm->parents[l] = NULL;
+    }
+    pm->width = 0;
+    pm->depth = 0;
+    pm->elements_added = 0;
+    pm->hash_function = NULL;
+    return CMS_SUCCESS;
+}
+
+int cms_pyramid_clear(CmsPyramid* pm) {
+    memset(pm->leaves, 0, __layer_bytes(pm, 0));
+    for (unsigned int l = 0; l < CMS_PYRAMID_LAYERS - 1; ++l) {
+        memset(pm->parents[l], 0, __layer_bytes(pm, l + 1));
+    }
+    pm->elements_added = 0;
+    return CMS_SUCCESS;
+}
+
+size_t cms_pyramid_bytes(const CmsPyramid* pm) {
+    size_t bytes = 0;
+    for (unsigned int l = 0; l < CMS_PYRAMID_LAYERS; ++l) {
+        bytes += __layer_bytes(pm, l);
+    }
+    return bytes;
+}
+
+int32_t cms_pyramid_add_inc_alt(CmsPyramid* pm, uint64_t* hashes, unsigned int num_hashes, uint32_t x) {
+    if (num_hashes < pm->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the addition of the element to the pyramid sketch!");
+        return CMS_ERROR;
+    }
+    pm->elements_added += x;
+    int64_t num_add = INT64_MAX;
+    for (unsigned int i = 0; i < pm->depth; ++i) {
+        uint32_t column = (uint32_t) (hashes[i] % pm->width);
+        __column_add(pm, i, column, x);
+        int64_t val = __column_value(pm, i, column);
+        num_add = (val < num_add) ? val : num_add;
+    }
+    return __clamp_int32(num_add);
+}
+
+int32_t cms_pyramid_add_inc(CmsPyramid* pm, const char* key, uint32_t x) {
+    uint64_t* hashes = pm->hash_function(pm->depth, key);
+    int32_t num_add = cms_pyramid_add_inc_alt(pm, hashes, pm->depth, x);
+    free(hashes);
+    return num_add;
+}
+
+int32_t cms_pyramid_check_alt(CmsPyramid* pm, uint64_t* hashes, unsigned int num_hashes) {
+    if (num_hashes < pm->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the min lookup of the element in the pyramid sketch!");
+        return CMS_ERROR;
+    }
+    int64_t num_add = INT64_MAX;
+    for (unsigned int i = 0; i < pm->depth; ++i) {
+        int64_t val = __column_value(pm, i, (uint32_t) (hashes[i] % pm->width));
+        num_add = (val < num_add) ? val : num_add;
+    }
+    return __clamp_int32(num_add);
+}
+
+int32_t cms_pyramid_check(CmsPyramid* pm, const char* key) {
+    uint64_t* hashes = pm->hash_function(pm->depth, key);
+    int32_t num_add = cms_pyramid_check_alt(pm, hashes, pm->depth);
+    free(hashes);
+    return num_add;
+}
+
+
+/*******************************************************************************
+*    PRIVATE FUNCTIONS
+*******************************************************************************/
+/* add to the leaf and carry the overflow up, flagging the side it came from */
+static void __column_add(CmsPyramid* pm, unsigned int row, uint32_t column, uint32_t x) {
+    uint64_t leaf = (uint64_t) row * pm->width + column;
+    uint8_t* byte = pm->leaves + (leaf >> 1);
+    unsigned int shift = (column & 1) * LEAF_BITS;
+    uint64_t val = ((*byte >> shift) & 0xF) + (uint64_t) x;
+    *byte = (uint8_t) ((*byte & ~(0xF << shift)) | ((val & 0xF) << shift));
+    uint64_t carry = val >> LEAF_BITS;
+
+    uint32_t index = column;
+    for (unsigned int l = 0; carry != 0 && l < CMS_PYRAMID_LAYERS - 1; ++l) {
+        unsigned int side = index & 1;
+        index >>= 1;
+        uint8_t* node = pm->parents[l] + (uint64_t) row * (pm->width >> (l + 1)) + index;
+        val = (*node & PARENT_COUNT) + carry;
+        if (l == CMS_PYRAMID_LAYERS - 2 && val > PARENT_COUNT) {
+            val = PARENT_COUNT;    /* the top layer saturates */
+        }
+        *node = (uint8_t) ((*node & ~PARENT_COUNT) | PARENT_FLAG(side) | (val & PARENT_COUNT));
+        carry = val >> PARENT_BITS;
+    }
+}
+
+/* walk up while the parent holds a carry from this side */
+static int64_t __column_value(const CmsPyramid* pm, unsigned int row, uint32_t column) {
+    uint64_t leaf = (uint64_t) row * pm->width + column;
+    int64_t val = (pm->leaves[leaf >> 1] >> ((column & 1) * LEAF_BITS)) & 0xF;
+    int64_t unit = 1 << LEAF_BITS;
+
+    uint32_t index = column;
+    for (unsigned int l = 0; l < CMS_PYRAMID_LAYERS - 1; ++l) {
+        unsigned int side = index & 1;
+        index >>= 1;
+        uint8_t node = pm->parents[l][(uint64_t) row * (pm->width >> (l + 1)) + index];
+        if ((node & PARENT_FLAG(side)) == 0) {
+            break;
+        }
+        val += (node & PARENT_COUNT) * unit;
+        unit <<= PARENT_BITS;
+    }
+    return val;
+}
+
+/* layer 0 is the packed leaves, layer `l` has width / 2^l parents per row */
+static __inline__ size_t __layer_bytes(const CmsPyramid* pm, unsigned int layer) {
+    return (layer == 0) ? (size_t) pm->width * pm->depth / 2 : ((size_t) pm->width >> layer) * pm->depth;
+}
@@ -0,0 +1,92 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_PYRAMID_H__
+#define BARRUST_COUNT_MIN_SKETCH_PYRAMID_H__
+
+/*******************************************************************************
+***     Pyramid count-min sketch with variable size counters
+***
+***     Each row is a pyramid of counters instead of an array of int32_t. The
+***     bottom layer holds one 4-bit counter per column; a counter that
+***     overflows carries into its parent, a byte shared with its sibling
+***     whose two high bits flag which children have carried into it and
+***     whose six low bits count. Parents carry in turn up to the top layer.
+***     A column is read by walking up while its flag is set, so a counter
+***     only pays for the layers it actually reached. With most counters of a
+***     skewed stream staying small, a row needs about 1.5 bytes per column.
+***     Only counters whose sibling subtree also carried can be overestimated,
+***     which keeps the count-min guarantee.
+***
+***     Paper: Yang, Zhou, et al. - "Pyramid Sketch: a Sketch Framework for
+***     Frequency Estimation of Data Streams" (VLDB 2017)
+*******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "cmsketch.h"
+
+#define CMS_PYRAMID_LAYERS      6       /* the 4-bit leaves and five layers of parents */
+
+typedef struct {
+    uint32_t depth;
+    uint32_t width;             /* leaves per row; a multiple of 2^(CMS_PYRAMID_LAYERS - 1) */
+    int64_t elements_added;
+    cms_hash_function hash_function;
+    uint8_t* leaves;            /* two 4-bit counters per byte */
+    uint8_t* parents[CMS_PYRAMID_LAYERS - 1];
+} CmsPyramid, cms_pyramid;
+
+
+/*  Initialize a pyramid sketch of `depth` rows of `width` columns; the width
+    is rounded up to a multiple of 2^(CMS_PYRAMID_LAYERS - 1)
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When a dimension is 0 or unable to allocate */
+int cms_pyramid_init_alt(CmsPyramid* pm, unsigned int width, unsigned int depth, cms_hash_function hash_function);
+static __inline__ int cms_pyramid_init(CmsPyramid* pm, unsigned int width, unsigned int depth) {
+    return cms_pyramid_init_alt(pm, width, depth, NULL);
+}
+
+/*  Free all memory of the sketch
+
+    Returns:
+        CMS_SUCCESS */
+int cms_pyramid_destroy(CmsPyramid* pm);
+
+/*  Reset the sketch to zero elements inserted
+
+    Returns:
+        CMS_SUCCESS */
+int cms_pyramid_clear(CmsPyramid* pm);
+
+/* The bytes used by the counters of the sketch */
+size_t cms_pyramid_bytes(const CmsPyramid* pm);
+
+/*  Insert the key `x` times
+
+    Returns:
+        The estimate of the key after the insert
+        CMS_ERROR   -   When there are insufficient hashes
+
+    NOTE: The pyramid sketch does not support removes */
+int32_t cms_pyramid_add_inc(CmsPyramid* pm, const char* key, uint32_t x);
+int32_t cms_pyramid_add_inc_alt(CmsPyramid* pm, uint64_t* hashes, unsigned int num_hashes, uint32_t x);
+static __inline__ int32_t cms_pyramid_add(CmsPyramid* pm, const char* key) {
+    return cms_pyramid_add_inc(pm, key, 1);
+}
+
+/*  Determine the maximum number of times the key may have been inserted
+
+    Returns:
+        The estimate
+        CMS_ERROR   -   When there are insufficient hashes */
+int32_t cms_pyramid_check(CmsPyramid* pm, const char* key);
+int32_t cms_pyramid_check_alt(CmsPyramid* pm, uint64_t* hashes, unsigned int num_hashes);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,205 @@
+/*******************************************************************************
+***     Lock-free ingestion queue for a count-min sketch
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <time.h>
+#include "cms_queue.h"
+
+#define SPINS_BEFORE_YIELD  128
+#define IDLE_SLEEP_NS       50000
+
+/* private functions */
+static void* __applier(void* arg);
+static unsigned int __drain(CmsQueue* q, uint64_t* hashes, uint32_t* increments);
+static void __backoff(unsigned int* spins);
+static void __free_buffers(CmsQueue* q);
+
+
+int cms_queue_init(CmsQueue* q, CountMinSketch* cms, unsigned int capacity, cms_queue_policy policy) {
+    uint32_t size = 1;
+    capacity = (capacity == 0) ? CMS_QUEUE_CAPACITY : capacity;
+    while (size < capacity && size < (1U << 31)) {
+        size <<= 1;
+    }
+    memset(q, 0, sizeof(CmsQueue));
+    q->cms = cms;
+    q->capacity = size;
+    q->depth = cms->depth;
+    q->policy = policy;
+    q->sequences = (uint64_t*)malloc((size_t) size * sizeof(uint64_t));
+    q->hashes = (uint64_t*)malloc((size_t) size * q->depth * sizeof(uint64_t));
+    q->increments = (uint32_t*)malloc((size_t) size * sizeof(uint32_t));
+    q->batch_hashes = (uint64_t*)malloc((size_t) CMS_QUEUE_BATCH * q->depth * sizeof(uint64_t));
+    q->batch_increments = (uint32_t*)malloc(CMS_QUEUE_BATCH * sizeof(uint32_t));
+    if (q->sequences == NULL || q->hashes == NULL || q->increments == NULL
+            || q->batch_hashes == NULL || q->batch_increments == NULL) {
+        fprintf(stderr, "Failed to allocate the ingestion queue!\n");
+        __free_buffers(q);
+        return CMS_ERROR;
+    }
+    for (uint32_t i = 0; i < size; ++i) {
+        q->sequences[i] = i;
+    }
+    if (pthread_create(&q->applier, NULL, __applier, q) != 0) {
+        fprintf(stderr, "Failed to start the ingestion queue applier thread!\n");
+        __free_buffers(q);
+        return CMS_ERROR;
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_queue_destroy(CmsQueue* q) {
+    cms_queue_flush(q);
+    __atomic_store_n(&q->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(q->applier, NULL);
+    __free_buffers(q);
+    q->cms = NULL;
+    return CMS_SUCCESS;
+}
+
+/*  Bounded queue with a sequence number per cell (D. Vyukov): a producer
+    claims position `pos` with a CAS once the cell's sequence equals `pos`,
+    fills it and publishes it by setting the sequence to `pos + 1`. */
+int cms_queue_add_inc_alt(CmsQueue* q, uint64_t* hashes, unsigned int num_hashes, uint32_t x) {
+    if (num_hashes < q->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the addition of the element to the count-min sketch!");
+        return CMS_ERROR;
+    }
+    uint64_t mask = q->capacity - 1;
+    uint64_t pos = __atomic_load_n(&q->enqueue_pos.value, __ATOMIC_RELAXED);
+    unsigned int spins = 0;
+    for (;;) {
+        uint64_t seq = __atomic_load_n(&q->sequences[pos & mask], __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t) (seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enqueue_pos.value, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            /* the queue is full */
+            if (q->policy == CMS_QUEUE_DROP) {
+                __atomic_fetch_add(&q->dropped, 1, __ATOMIC_RELAXED);
+                return CMS_ERROR;
+            } else if (q->policy == CMS_QUEUE_SPILL) {
+                __atomic_fetch_add(&q->spilled, x, __ATOMIC_RELAXED);
+                return CMS_SUCCESS;
+            }
+            __backoff(&spins);
+            pos = __atomic_load_n(&q->enqueue_pos.value, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&q->enqueue_pos.value, __ATOMIC_RELAXED);
+        }
+    }
+    uint64_t cell = pos & mask;
+    memcpy(q->hashes + (cell * q->depth), hashes, q->depth * sizeof(uint64_t));
+    q->increments[cell] = x;
+    __atomic_store_n(&q->sequences[cell], pos + 1, __ATOMIC_RELEASE);
+    return CMS_SUCCESS;
+}
+
+int cms_queue_add_inc(CmsQueue* q, const char* key, uint32_t x) {
+    uint64_t* hashes = cms_get_hashes(q->cms, key);
+    int res = cms_queue_add_inc_alt(q, hashes, q->depth, x);
+    free(hashes);
+    return res;
+}
+
+int cms_queue_flush(CmsQueue* q) {
+    uint64_t target = __atomic_load_n(&q->enqueue_pos.value, __ATOMIC_ACQUIRE);
+    unsigned int spins = 0;
+    while (__atomic_load_n(&q->applied.value, __ATOMIC_ACQUIRE) < target) {
+        __backoff(&spins);
+    }
+    return CMS_SUCCESS;
+}
+
+uint64_t cms_queue_dropped(CmsQueue* q) {
+    return __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+}
+
+uint64_t cms_queue_spilled(CmsQueue* q) {
+    return __atomic_load_n(&q->spilled, __ATOMIC_RELAXED);
+}
+
+
+/*******************************************************************************
+*    PRIVATE FUNCTIONS
+*******************************************************************************/
+static void* __applier(void* arg) {
+    CmsQueue* q = (CmsQueue*) arg;
+    CountMinSketch* cms = q->cms;
+    uint64_t* hashes = q->batch_hashes;
+    uint32_t* increments = q->batch_increments;
+    uint64_t spilled = 0;
+    unsigned int spins = 0;
+
+    for (;;) {
+        unsigned int n = __drain(q, hashes, increments);
+        if (n > 0) {
+            cms_add_inc_batch_alt(cms, hashes, q->depth, n, increments);
+            __atomic_fetch_add(&q->applied.value, n, __ATOMIC_RELEASE);
+            spins = 0;
+        }
+
+        uint64_t total_spilled = __atomic_load_n(&q->spilled, __ATOMIC_RELAXED);
+        if (total_spilled != spilled) {
+            cms_add_elements(cms, (int64_t) (total_spilled - spilled));
+            spilled = total_spilled;
+        }
+
+        if (n == 0) {
+            if (__atomic_load_n(&q->stop, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            if (++spins > SPINS_BEFORE_YIELD) {
+                struct timespec ts = {0, IDLE_SLEEP_NS};
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* copy up to CMS_QUEUE_BATCH published updates out of the queue */
+static unsigned int __drain(CmsQueue* q, uint64_t* hashes, uint32_t* increments) {
+    uint64_t mask = q->capacity - 1;
+    uint64_t pos = q->dequeue_pos.value;
+    unsigned int n = 0;
+    while (n < CMS_QUEUE_BATCH) {
+        uint64_t cell = pos & mask;
+        if (__atomic_load_n(&q->sequences[cell], __ATOMIC_ACQUIRE) != pos + 1) {
+            break;
+        }
+        memcpy(hashes + ((size_t) n * q->depth), q->hashes + (cell * q->depth), q->depth * sizeof(uint64_t));
+        increments[n] = q->increments[cell];
+        __atomic_store_n(&q->sequences[cell], pos + q->capacity, __ATOMIC_RELEASE);
+        ++pos;
+        ++n;
+    }
+    q->dequeue_pos.value = pos;
+    return n;
+}
+
+static void __free_buffers(CmsQueue* q) {
+    free(q->sequences);
+    free(q->hashes);
+    free(q->increments);
+    free(q->batch_hashes);
+    free(q->batch_increments);
+    q->sequences = NULL;
+    q->hashes = NULL;
+    q->increments = NULL;
+    q->batch_hashes = NULL;
+    q->batch_increments = NULL;
+}
+
+static void __backoff(unsigned int* spins) {
+    if (++(*spins) > SPINS_BEFORE_YIELD) {
+        sched_yield();
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_QUEUE_H__
+#define BARRUST_COUNT_MIN_SKETCH_QUEUE_H__
+
+/*******************************************************************************
+***     Lock-free ingestion queue for a count-min sketch
+***
+***     Any number of producer threads push pre-hashed updates into a bounded
+***     lock-free queue; a single applier thread owns the count-min sketch and
+***     drains the queue in batches through `cms_add_inc_batch_alt`. A
+***     producer pays for hashing its key and one enqueue, never for the
+***     counters themselves.
+*******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+#include "cmsketch.h"
+
+#define CMS_QUEUE_CAPACITY  (1U << 16)  /* default number of queued updates */
+#define CMS_QUEUE_BATCH     1024        /* updates applied per batch */
+
+/* what a producer does when the queue is full */
+typedef enum {
+    CMS_QUEUE_DROP = 0,     /* discard the update and return CMS_ERROR */
+    CMS_QUEUE_BLOCK = 1,    /* wait for the applier to make room */
+    CMS_QUEUE_SPILL = 2     /* discard the update but count its increment; see cms_queue_spilled */
+} cms_queue_policy;
+
+typedef struct {
+    uint64_t value;
+    char padding[56];       /* keep the producer and consumer positions on separate cache lines */
+} cms_queue_position;
+
+typedef struct {
+    cms_queue_position enqueue_pos;
+    cms_queue_position dequeue_pos;
+    cms_queue_position applied;     /* number of updates applied to the sketch */
+    CountMinSketch* cms;
+    uint32_t capacity;
+    uint32_t depth;
+    cms_queue_policy policy;
+    uint64_t* sequences;    /* per cell sequence numbers of the bounded queue */
+    uint64_t* hashes;       /* capacity x depth hashes */
+    uint32_t* increments;
+    uint64_t* batch_hashes;     /* CMS_QUEUE_BATCH x depth; drained by the applier */
+    uint32_t* batch_increments;
+    uint64_t dropped;       /* number of updates rejected under CMS_QUEUE_DROP */
+    uint64_t spilled;       /* sum of increments rejected under CMS_QUEUE_SPILL */
+    int stop;
+    pthread_t applier;
+} CmsQueue, cms_queue;
+
+
+/*  Create the queue and start its applier thread; `capacity` is rounded up to
+    a power of two and 0 uses CMS_QUEUE_CAPACITY
+
+    NOTE: While the queue is running the applier thread is the only writer of
+    the count-min sketch; enable `cms_set_concurrent_reads` on the sketch to
+    query it at the same time
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When unable to allocate memory or start the thread */
+int cms_queue_init(CmsQueue* q, CountMinSketch* cms, unsigned int capacity, cms_queue_policy policy);
+
+/*  Apply everything that is queued, stop the applier thread and free the
+    queue; the count-min sketch itself is left intact
+
+    Returns:
+        CMS_SUCCESS */
+int cms_queue_destroy(CmsQueue* q);
+
+/*  Queue the key (or its hashes) to be added `x` times; safe to call from
+    any number of threads
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When there are insufficient hashes or the update was
+                        dropped because the queue is full */
+int cms_queue_add_inc(CmsQueue* q, const char* key, uint32_t x);
+int cms_queue_add_inc_alt(CmsQueue* q, uint64_t* hashes, unsigned int num_hashes, uint32_t x);
+static __inline__ int cms_queue_add(CmsQueue* q, const char* key) {
+    return cms_queue_add_inc(q, key, 1);
+}
+
+/*  Wait until every update queued before the call has been applied
+
+    Returns:
+        CMS_SUCCESS */
+int cms_queue_flush(CmsQueue* q);
+
+/*  Number of updates dropped and sum of the increments spilled because the
+    queue was full; spilled increments are still added to `elements_added`
+    of the count-min sketch so that the total stays correct */
+uint64_t cms_queue_dropped(CmsQueue* q);
+uint64_t cms_queue_spilled(CmsQueue* q);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,237 @@
+/*******************************************************************************
+***     Rollup of windowed count-min sketches into retention tiers
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cms_rollup.h"
+
+/* private functions */
+static void* __rollup_worker(void* arg);
+static int __roll_up(CmsRollup* rollup);
+static cms_rollup_window* __window(CmsRollup* rollup, cms_rollup_level* level, int64_t start);
+static void __free_levels(CmsRollup* rollup);
+static __inline__ int64_t __window_start(int64_t timestamp, int64_t span);
+
+
+int cms_rollup_init_alt(CmsRollup* rollup, unsigned int width, unsigned int depth, cms_hash_function hash_function, const cms_rollup_tier* tiers, unsigned int num_tiers, int flags) {
+    memset(rollup, 0, sizeof(CmsRollup));
+    if (width == 0 || depth == 0) {
+        fprintf(stderr, "Unable to initialize the rollup since both width and depth are required!\n");
+        return CMS_ERROR;
+    }
+    if (num_tiers < 1 || num_tiers > CMS_ROLLUP_MAX_TIERS) {
+        fprintf(stderr, "A rollup needs between 1 and %d tiers!\n", CMS_ROLLUP_MAX_TIERS);
+        return CMS_ERROR;
+    }
+    uint32_t tier_width = width;
+    for (unsigned int t = 0; t < num_tiers; ++t) {
+        uint32_t fold = (t == 0 || tiers[t].fold == 0) ? 1 : tiers[t].fold;
+        if (tiers[t].span <= 0 || (t > 0 && tiers[t].span % tiers[t - 1].span != 0)) {
+            fprintf(stderr, "The span of rollup tier %u must be a positive multiple of the previous tier's!\n", t);
+            return CMS_ERROR;
+        }
+        if (tier_width % fold != 0) {
+            fprintf(stderr, "Unable to fold a width of %u by %u for rollup tier %u!\n", tier_width, fold, t);
+            return CMS_ERROR;
+        }
+        tier_width /= fold;
+        rollup->levels[t].config = tiers[t];
+        rollup->levels[t].config.fold = fold;
+        rollup->levels[t].width = tier_width;
+    }
+    rollup->depth = depth;
+    rollup->num_tiers = num_tiers;
+    rollup->flags = flags;
+    rollup->hash_function = (hash_function == NULL) ? cms_default_hash : hash_function;
+
+    pthread_mutex_init(&rollup->lock, NULL);
+    pthread_cond_init(&rollup->work, NULL);
+    if ((flags & CMS_ROLLUP_BACKGROUND) && pthread_create(&rollup->thread, NULL, __rollup_worker, rollup) != 0) {
+        fprintf(stderr, "Failed to start the rollup thread!\n");
+        pthread_cond_destroy(&rollup->work);
+        pthread_mutex_destroy(&rollup->lock);
+        return CMS_ERROR;
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_rollup_destroy(CmsRollup* rollup) {
+    if (rollup->flags & CMS_ROLLUP_BACKGROUND) {
+        pthread_mutex_lock(&rollup->lock);
+        rollup->stop = 1;
+        pthread_cond_signal(&rollup->work);
+        pthread_mutex_unlock(&rollup->lock);
+        pthread_join(rollup->thread, NULL);
+    }
+    __free_levels(rollup);
+    pthread_cond_destroy(&rollup->work);
+    pthread_mutex_destroy(&rollup->lock);
+    rollup->num_tiers = 0;
+    return CMS_SUCCESS;
+}
+
+int cms_rollup_add(CmsRollup* rollup, CountMinSketch* cms, int64_t start) {
+    cms_rollup_level* level = &rollup->levels[0];
+    if (cms->width != level->width || cms->depth != rollup->depth) {
+        fprintf(stderr, "Unable to add a %u x %u count-min sketch to a rollup of %u x %u windows!\n", cms->width, cms->depth, level->width, rollup->depth);
+        return CMS_ERROR;
+    }
+    pthread_mutex_lock(&rollup->lock);
+    cms_rollup_window* window = __window(rollup, level, __window_start(start, level->config.span));
+    int res = (window == NULL) ? CMS_ERROR : cms_merge_into(&window->cms, 1, cms);
+    if (res == CMS_SUCCESS) {
+        /* the sketch is in; a failed roll up only delays the older tiers */
+        if (rollup->flags & CMS_ROLLUP_BACKGROUND) {
+            rollup->pending = 1;
+            pthread_cond_signal(&rollup->work);
+        } else if (__roll_up(rollup) == CMS_ERROR) {
+            fprintf(stderr, "Rollup failed; retrying on the next add!\n");
+        }
+    }
+    pthread_mutex_unlock(&rollup->lock);
+    return res;
+}
+
+int cms_rollup_sync(CmsRollup* rollup) {
+    pthread_mutex_lock(&rollup->lock);
+    rollup->pending = 0;
+    int res = __roll_up(rollup);
+    pthread_mutex_unlock(&rollup->lock);
+    return res;
+}
+
+int64_t cms_rollup_check_range_alt(CmsRollup* rollup, uint64_t* hashes, unsigned int num_hashes, int64_t begin, int64_t end) {
+    if (num_hashes < rollup->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the min lookup of the element to the count-min sketch!");
+        return CMS_ERROR;
+    }
+    int64_t total = 0;
+    pthread_mutex_lock(&rollup->lock);
+    for (unsigned int t = 0; t < rollup->num_tiers; ++t) {
+        cms_rollup_level* level = &rollup->levels[t];
+        for (uint32_t w = 0; w < level->num_windows && level->windows[w].start < end; ++w) {
+            if (level->windows[w].start + level->config.span > begin) {
+                total += cms_check_wide_alt(&level->windows[w].cms, hashes, num_hashes);
+            }
+        }
+    }
+    pthread_mutex_unlock(&rollup->lock);
+    return total;
+}
+
+int64_t cms_rollup_check_range(CmsRollup* rollup, const char* key, int64_t begin, int64_t end) {
+    uint64_t* hashes = rollup->hash_function(rollup->depth, key);
+    int64_t num_add = cms_rollup_check_range_alt(rollup, hashes, rollup->depth, begin, end);
+    free(hashes);
+    return num_add;
+}
+
+
+/*******************************************************************************
+*    PRIVATE FUNCTIONS
+*******************************************************************************/
+static __inline__ int64_t __window_start(int64_t timestamp, int64_t span) {
+    int64_t q = timestamp / span;
+    if (timestamp % span < 0) {
+        --q;    /* round down for timestamps before the epoch */
+    }
+    return q * span;
+}
+
+static void* __rollup_worker(void* arg) {
+    CmsRollup* rollup = (CmsRollup*) arg;
+    pthread_mutex_lock(&rollup->lock);
+    for (;;) {
+        while (!rollup->pending && !rollup->stop) {
+            pthread_cond_wait(&rollup->work, &rollup->lock);
+        }
+        if (rollup->stop) {
+            break;
+        }
+        rollup->pending = 0;
+        if (__roll_up(rollup) == CMS_ERROR) {
+            fprintf(stderr, "Background rollup failed; retrying on the next add!\n");
+        }
+    }
+    pthread_mutex_unlock(&rollup->lock);
+    return NULL;
+}
+
+/* move the oldest windows of every tier over its retention into the next tier */
+static int __roll_up(CmsRollup* rollup) {
+    for (unsigned int t = 0; t < rollup->num_tiers; ++t) {
+        cms_rollup_level* level = &rollup->levels[t];
+        if (level->config.retention == 0) {
+            continue;
+        }
+        while (level->num_windows > level->config.retention) {
+            cms_rollup_window* oldest = &level->windows[0];
+            if (t + 1 < rollup->num_tiers) {
+                /* a folded copy is merged, so a failure leaves the oldest window as it was */
+                cms_rollup_level* next = &rollup->levels[t + 1];
+                cms_rollup_window* window = __window(rollup, next, __window_start(oldest->start, next->config.span));
+                CountMinSketch folded;
+                if (window == NULL || cms_merge(&folded, 1, &oldest->cms) == CMS_ERROR) {
+                    return CMS_ERROR;
+                }
+                if (cms_fold(&folded, next->config.fold) == CMS_ERROR
+                        || cms_merge_into(&window->cms, 1, &folded) == CMS_ERROR) {
+                    cms_destroy(&folded);
+                    return CMS_ERROR;
+                }
+                cms_destroy(&folded);
+            }
+            cms_destroy(&oldest->cms);
+            --level->num_windows;
+            memmove(level->windows, level->windows + 1, level->num_windows * sizeof(cms_rollup_window));
+        }
+    }
+    return CMS_SUCCESS;
+}
+
+/* the window of the tier starting at `start`, created empty when missing */
+static cms_rollup_window* __window(CmsRollup* rollup, cms_rollup_level* level, int64_t start) {
+    /* windows are nearly always added at or near the end */
+    uint32_t pos = level->num_windows;
+    while (pos > 0 && level->windows[pos - 1].start >= start) {
+        if (level->windows[pos - 1].start == start) {
+            return &level->windows[pos - 1];
+        }
+        --pos;
+    }
+    if (level->num_windows == level->capacity) {
+        uint32_t capacity = (level->capacity == 0) ? 16 : level->capacity * 2;
+        cms_rollup_window* windows = (cms_rollup_window*)realloc(level->windows, capacity * sizeof(cms_rollup_window));
+        if (windows == NULL) {
+            fprintf(stderr, "Failed to grow the rollup windows!\n");
+            return NULL;
+        }
+        level->windows = windows;
+        level->capacity = capacity;
+    }
+    cms_rollup_window* window = &level->windows[pos];
+    memmove(window + 1, window, (level->num_windows - pos) * sizeof(cms_rollup_window));
+    if (cms_init_alt(&window->cms, level->width, rollup->depth, rollup->hash_function) == CMS_ERROR) {
+        memmove(window, window + 1, (level->num_windows - pos) * sizeof(cms_rollup_window));
+        return NULL;
+    }
+    cms_set_auto_promote(&window->cms, 1);     /* a window sums many sketches */
+    window->start = start;
+    ++level->num_windows;
+    return window;
+}
+
+static void __free_levels(CmsRollup* rollup) {
+    for (unsigned int t = 0; t < rollup->num_tiers; ++t) {
+        cms_rollup_level* level = &rollup->levels[t];
+        for (uint32_t w = 0; w < level->num_windows; ++w) {
+            cms_destroy(&level->windows[w].cms);
+        }
+        free(level->windows);
+        level->windows = NULL;
+        level->num_windows = 0;
+        level->capacity = 0;
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_ROLLUP_H__
+#define BARRUST_COUNT_MIN_SKETCH_ROLLUP_H__
+
+/*******************************************************************************
+***     Rollup of windowed count-min sketches into retention tiers
+***
+***     Sketches of the finest window (e.g. a minute) are added to tier 0. Once
+***     a tier holds more than `retention` windows, its oldest windows are
+***     merged into the window of the next tier (e.g. the hour) they fall in,
+***     folding the sketch down by the `fold` of that tier on the way. The
+***     last tier drops its oldest windows instead. Since every update lives in
+***     exactly one window of one tier, a range query sums the estimates of the
+***     windows overlapping the range across all tiers, which automatically
+***     uses the coarsest tier that holds each part of the range. The windows
+***     promote their counters to 64-bit instead of saturating (see
+***     cms_set_auto_promote).
+*******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <pthread.h>
+#include "cmsketch.h"
+
+#define CMS_ROLLUP_MAX_TIERS    8
+
+/* flags for cms_rollup_init */
+#define CMS_ROLLUP_BACKGROUND   1   /* roll up on a background thread */
+
+typedef struct {
+    int64_t span;               /* length of one window; a multiple of the previous tier's */
+    uint32_t fold;              /* factor the width shrinks by entering this tier; 1 for tier 0 */
+    uint32_t retention;         /* windows kept before rolling up (or dropping); 0 keeps all */
+} CmsRollupTier, cms_rollup_tier;
+
+typedef struct {
+    int64_t start;
+    CountMinSketch cms;
+} cms_rollup_window;
+
+typedef struct {
+    cms_rollup_tier config;
+    uint32_t width;
+    uint32_t num_windows;
+    uint32_t capacity;
+    cms_rollup_window* windows;     /* ordered by start */
+} cms_rollup_level;
+
+typedef struct {
+    uint32_t depth;
+    uint32_t num_tiers;
+    cms_hash_function hash_function;
+    cms_rollup_level levels[CMS_ROLLUP_MAX_TIERS];
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_t thread;
+    int flags;
+    int pending;                /* windows were added since the last rollup */
+    int stop;
+} CmsRollup, cms_rollup;
+
+
+/*  Set up the tiers for windows of `width` x `depth` sketches
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the tiers do not nest, a fold does not divide the
+                        width or the background thread cannot be started */
+int cms_rollup_init_alt(CmsRollup* rollup, unsigned int width, unsigned int depth, cms_hash_function hash_function, const cms_rollup_tier* tiers, unsigned int num_tiers, int flags);
+static __inline__ int cms_rollup_init(CmsRollup* rollup, unsigned int width, unsigned int depth, const cms_rollup_tier* tiers, unsigned int num_tiers, int flags) {
+    return cms_rollup_init_alt(rollup, width, depth, NULL, tiers, num_tiers, flags);
+}
+
+/*  Stop the background thread and free every window
+
+    Returns:
+        CMS_SUCCESS */
+int cms_rollup_destroy(CmsRollup* rollup);
+
+/*  Add the sketch of the tier 0 window starting at `start`; it is merged
+    into that window, so the same window may be added more than once. The
+    rollup runs inline or is handed to the background thread.
+
+    Returns:
+        CMS_SUCCESS -   The sketch was merged into its window, even when the
+                        roll up that follows fails; it is retried on the next
+                        add and reported by `cms_rollup_sync`
+        CMS_ERROR   -   When the sketch is of another shape or unable to
+                        allocate or merge into the window; nothing was added */
+int cms_rollup_add(CmsRollup* rollup, CountMinSketch* cms, int64_t start);
+
+/*  Roll up every tier that is over its retention now
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When unable to allocate a window or merge into it;
+                        windows that could not be rolled up stay in their
+                        tier unchanged */
+int cms_rollup_sync(CmsRollup* rollup);
+
+/*  Estimate the number of times the key was inserted in the windows
+    overlapping [begin, end); windows only partly inside the range are
+    counted whole, so the range is in effect rounded out to the windows
+
+    Returns:
+        The estimate; 0 when no window overlaps
+        CMS_ERROR   -   When there are insufficient hashes */
+int64_t cms_rollup_check_range(CmsRollup* rollup, const char* key, int64_t begin, int64_t end);
+int64_t cms_rollup_check_range_alt(CmsRollup* rollup, uint64_t* hashes, unsigned int num_hashes, int64_t begin, int64_t end);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,225 @@
+/*******************************************************************************
+***     Row-partitioned parallel ingestion for a count-min sketch
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include "cms_row_ingest.h"
+
+#define SPINS_BEFORE_YIELD  128
+#define IDLE_SLEEP_NS       50000
+
+typedef struct {
+    CmsRowIngestor* ing;
+    uint32_t id;
+} __worker_args;
+
+/* private functions */
+static void* __row_worker(void* arg);
+static void __publish(CmsRowIngestor* ing);
+static void __wait_for_slot(CmsRowIngestor* ing);
+static uint64_t __min_consumed(CmsRowIngestor* ing);
+static void __backoff(unsigned int* spins);
+
+
+int cms_row_ingest_init(CmsRowIngestor* ing, CountMinSketch* cms, unsigned int num_threads, unsigned int batch_size, unsigned int ring_size) {
+    if (cms->concurrent_reads) {
+        fprintf(stderr, "Row-partitioned ingestion is not supported with concurrent reads enabled!\n");
+        return CMS_ERROR;
+    }
+    if (cms->membership != NULL) {
+        fprintf(stderr, "Row-partitioned ingestion is not supported with the membership filter enabled!\n");
+        return CMS_ERROR;
+    }
+    if (num_threads < 1 || num_threads > cms->depth) {
+        num_threads = cms->depth;
+    }
+    ing->cms = cms;
+    ing->num_threads = num_threads;
+    ing->batch_size = (batch_size == 0) ? CMS_ROW_INGEST_BATCH_SIZE : batch_size;
+    ing->ring_size = (ring_size == 0) ? CMS_ROW_INGEST_RING_SIZE : ring_size;
+    ing->fill = 0;
+    ing->published = 0;
+    ing->stop = 0;
+    ing->error = 0;
+
+    size_t slot_columns = (size_t) cms->depth * ing->batch_size;
+    ing->columns = (uint32_t*)malloc(ing->ring_size * slot_columns * sizeof(uint32_t));
+    ing->increments = (uint32_t*)malloc((size_t) ing->ring_size * ing->batch_size * sizeof(uint32_t));
+    ing->counts = (uint32_t*)calloc(ing->ring_size, sizeof(uint32_t));
+    ing->cursors = (cms_row_ingest_cursor*)calloc(num_threads, sizeof(cms_row_ingest_cursor));
+    ing->threads = (pthread_t*)calloc(num_threads, sizeof(pthread_t));
+    if (ing->columns == NULL || ing->increments == NULL || ing->counts == NULL || ing->cursors == NULL || ing->threads == NULL) {
+        fprintf(stderr, "Failed to allocate the row ingestion ring buffer!\n");
+        ing->num_threads = 0;
+        cms_row_ingest_destroy(ing);
+        return CMS_ERROR;
+    }
+
+    for (uint32_t i = 0; i < num_threads; ++i) {
+        __worker_args* args = (__worker_args*)malloc(sizeof(__worker_args));
+        int res = -1;
+        if (args != NULL) {
+            args->ing = ing;
+            args->id = i;
+            res = pthread_create(&ing->threads[i], NULL, __row_worker, args);
+        }
+        if (res != 0) {
+            fprintf(stderr, "Failed to start row ingestion thread %u!\n", i);
+            free(args);
+            ing->num_threads = i;
+            cms_row_ingest_destroy(ing);
+            return CMS_ERROR;
+        }
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_row_ingest_destroy(CmsRowIngestor* ing) {
+    int res = CMS_SUCCESS;
+    if (ing->num_threads > 0) {
+        res = cms_row_ingest_flush(ing);
+    }
+    __atomic_store_n(&ing->stop, 1, __ATOMIC_RELEASE);
+    for (uint32_t i = 0; i < ing->num_threads; ++i) {
+        pthread_join(ing->threads[i], NULL);
+    }
+    free(ing->columns);
+    free(ing->increments);
+    free(ing->counts);
+    free(ing->cursors);
+    free(ing->threads);
+    ing->columns = NULL;
+    ing->increments = NULL;
+    ing->counts = NULL;
+    ing->cursors = NULL;
+    ing->threads = NULL;
+    ing->num_threads = 0;
+    ing->cms = NULL;
+    return res;
+}
+
+int cms_row_ingest_add_inc_alt(CmsRowIngestor* ing, uint64_t* hashes, unsigned int num_hashes, uint32_t x) {
+    CountMinSketch* cms = ing->cms;
+    if (num_hashes < cms->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the addition of the element to the count-min sketch!");
+        return CMS_ERROR;
+    }
+    if (ing->fill == 0) {
+        __wait_for_slot(ing);
+    }
+    uint64_t slot = ing->published % ing->ring_size;
+    uint32_t* columns = ing->columns + (slot * cms->depth * ing->batch_size);
+    for (unsigned int i = 0; i < cms->depth; ++i) {
+        columns[(i * ing->batch_size) + ing->fill] = hashes[i] % cms->width;
+    }
+    ing->increments[(slot * ing->batch_size) + ing->fill] = x;
+    cms->elements_added += x;
+    if (++ing->fill == ing->batch_size) {
+        __publish(ing);
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_row_ingest_add_inc(CmsRowIngestor* ing, const char* key, uint32_t x) {
+    uint64_t* hashes = cms_get_hashes(ing->cms, key);
+    int res = cms_row_ingest_add_inc_alt(ing, hashes, ing->cms->depth, x);
+    free(hashes);
+    return res;
+}
+
+int cms_row_ingest_add_batch(CmsRowIngestor* ing, const char** keys, unsigned int num_keys, uint32_t x) {
+    for (unsigned int i = 0; i < num_keys; ++i) {
+        if (cms_row_ingest_add_inc(ing, keys[i], x) == CMS_ERROR) {
+            return CMS_ERROR;
+        }
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_row_ingest_flush(CmsRowIngestor* ing) {
+    if (ing->fill > 0) {
+        __publish(ing);
+    }
+    unsigned int spins = 0;
+    while (__min_consumed(ing) < ing->published) {
+        __backoff(&spins);
+    }
+    return __atomic_exchange_n(&ing->error, 0, __ATOMIC_RELAXED) ? CMS_ERROR : CMS_SUCCESS;
+}
+
+
+/*******************************************************************************
+*    PRIVATE FUNCTIONS
+*******************************************************************************/
+static void* __row_worker(void* arg) {
+    __worker_args* args = (__worker_args*) arg;
+    CmsRowIngestor* ing = args->ing;
+    uint32_t id = args->id;
+    free(args);
+
+    CountMinSketch* cms = ing->cms;
+    cms_row_ingest_cursor* cursor = &ing->cursors[id];
+    uint64_t consumed = cursor->consumed;
+    unsigned int spins = 0;
+    for (;;) {
+        uint64_t published = __atomic_load_n(&ing->published, __ATOMIC_ACQUIRE);
+        if (consumed == published) {
+            if (__atomic_load_n(&ing->stop, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            /* idle between batches; sleep rather than keep a core busy */
+            if (++spins > SPINS_BEFORE_YIELD) {
+                struct timespec ts = {0, IDLE_SLEEP_NS};
+                nanosleep(&ts, NULL);
+            }
+            continue;
+        }
+        spins = 0;
+        for (/* skip */; consumed < published; ++consumed) {
+            uint64_t slot = consumed % ing->ring_size;
+            const uint32_t* columns = ing->columns + (slot * cms->depth * ing->batch_size);
+            const uint32_t* increments = ing->increments + (slot * ing->batch_size);
+            for (uint32_t row = id; row < cms->depth; row += ing->num_threads) {
+                if (cms_add_row_inc(cms, row, columns + (row * ing->batch_size), increments, ing->counts[slot]) == CMS_ERROR) {
+                    __atomic_store_n(&ing->error, 1, __ATOMIC_RELAXED);
+                }
+            }
+            __atomic_store_n(&cursor->consumed, consumed + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+static void __publish(CmsRowIngestor* ing) {
+    ing->counts[ing->published % ing->ring_size] = ing->fill;
+    ing->fill = 0;
+    __atomic_store_n(&ing->published, ing->published + 1, __ATOMIC_RELEASE);
+}
+
+/* wait until the slot about to be filled has been applied by every worker */
+static void __wait_for_slot(CmsRowIngestor* ing) {
+    unsigned int spins = 0;
+    while (ing->published - __min_consumed(ing) >= ing->ring_size) {
+        __backoff(&spins);
+    }
+}
+
+static uint64_t __min_consumed(CmsRowIngestor* ing) {
+    uint64_t res = UINT64_MAX;
+    for (uint32_t i = 0; i < ing->num_threads; ++i) {
+        uint64_t consumed = __atomic_load_n(&ing->cursors[i].consumed, __ATOMIC_ACQUIRE);
+        if (consumed < res) {
+            res = consumed;
+        }
+    }
+    return res;
+}
+
+static void __backoff(unsigned int* spins) {
+    if (++(*spins) > SPINS_BEFORE_YIELD) {
+        sched_yield();
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_ROW_INGEST_H__
+#define BARRUST_COUNT_MIN_SKETCH_ROW_INGEST_H__
+
+/*******************************************************************************
+***     Row-partitioned parallel ingestion for a count-min sketch
+***
+***     The rows of a count-min sketch are independent, so instead of having
+***     every thread touch every row (and contend on the counters) each worker
+***     thread owns a set of rows and is the only writer of those rows. The
+***     producer hashes every key once, writes the per-row columns into a slot
+***     of a shared ring buffer and publishes it; the row owners then apply
+***     the slot to their rows without any synchronization on the counters.
+*******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+#include "cmsketch.h"
+
+#define CMS_ROW_INGEST_BATCH_SIZE   1024    /* default keys per ring slot */
+#define CMS_ROW_INGEST_RING_SIZE    8       /* default number of ring slots */
+
+typedef struct {
+    uint64_t consumed;          /* number of slots this worker has applied */
+    char padding[56];           /* keep each worker's cursor on its own cache line */
+} cms_row_ingest_cursor;
+
+typedef struct {
+    CountMinSketch* cms;
+    uint32_t num_threads;
+    uint32_t batch_size;
+    uint32_t ring_size;
+    uint32_t* columns;          /* ring_size x depth x batch_size columns */
+    uint32_t* increments;       /* ring_size x batch_size increments */
+    uint32_t* counts;           /* number of keys in each slot */
+    uint32_t fill;              /* number of keys in the slot being filled */
+    uint64_t published;         /* number of slots handed to the workers */
+    int stop;
+    int error;                  /* set by a worker whose row update failed; cleared by flush */
+    cms_row_ingest_cursor* cursors;
+    pthread_t* threads;
+} CmsRowIngestor, cms_row_ingestor;
+
+
+/*  Start `num_threads` row owner threads for the count-min sketch; rows are
+    assigned round robin so `num_threads` is capped at the depth of the
+    sketch. Passing 0 for `batch_size` or `ring_size` uses the defaults.
+
+    NOTE: The sketch must not be updated by anything else while the ingestor
+    is running and is only guaranteed to be up to date after
+    `cms_row_ingest_flush`
+    NOTE: Not compatible with concurrent reads (`cms_set_concurrent_reads`)
+    since there are several writers, nor with the membership filter
+    (`cms_set_membership_filter`) since the row owners do not see the keys
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the sketch has concurrent reads or the membership
+                        filter enabled, or unable to allocate memory or start
+                        the threads */
+int cms_row_ingest_init(CmsRowIngestor* ing, CountMinSketch* cms, unsigned int num_threads, unsigned int batch_size, unsigned int ring_size);
+
+/*  Flush outstanding updates, stop the worker threads and free the memory
+    used by the ingestor; the count-min sketch itself is left intact
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the final flush reports a failed update; the
+                        ingestor is freed regardless */
+int cms_row_ingest_destroy(CmsRowIngestor* ing);
+
+/*  Queue the key (or its hashes) to be added `x` times; the key is hashed on
+    the calling thread and the update is published once the slot is full
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When there are insufficient hashes */
+int cms_row_ingest_add_inc(CmsRowIngestor* ing, const char* key, uint32_t x);
+int cms_row_ingest_add_inc_alt(CmsRowIngestor* ing, uint64_t* hashes, unsigned int num_hashes, uint32_t x);
+static __inline__ int cms_row_ingest_add(CmsRowIngestor* ing, const char* key) {
+    return cms_row_ingest_add_inc(ing, key, 1);
+}
+
+/*  Queue `num_keys` keys to each be added `x` times
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When a key could not be queued; the keys before it
+                        were */
+int cms_row_ingest_add_batch(CmsRowIngestor* ing, const char** keys, unsigned int num_keys, uint32_t x);
+
+/*  Publish the partially filled slot and wait until every row owner has
+    applied every published update; afterwards the sketch may be queried
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When a row owner failed to apply an update since the
+                        previous flush (the cause is printed by the worker) */
+int cms_row_ingest_flush(CmsRowIngestor* ing);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
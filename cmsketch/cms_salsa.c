@@ -0,0 +1,347 @@
+/*******************************************************************************
+***     SALSA count-min sketch with self-adjusting counter sizes
+*******************************************************************************/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cms_salsa.h"
+#include "cms_common.h"
+
+#define SALSA_MAGIC "CMSSAL01"
+#define SALSA_MAGIC_SIZE 8
+
+/*  Layout of a group of four counters: bit 0 and 1 merge the first and the
+    second pair into 16-bit counters, bit 2 merges all four into one 32-bit
+    counter (the pair bits are then ignored) */
+#define PAIR_MERGED(pair)   (1U << (pair))
+#define QUAD_MERGED         4U
+
+/*  On disk: header, the `width` x `depth` counters and `width` * `depth` / 8
+    layout bytes */
+typedef struct {
+    char magic[SALSA_MAGIC_SIZE];
+    uint32_t width;
+    uint32_t depth;
+    int64_t elements_added;
+} __salsa_header;
+
+/* private functions */
+static int64_t __salsa_add(CmsSalsa* ss, unsigned int row, uint32_t column, uint32_t x);
+static uint8_t __quad_merge(uint8_t* dst, uint8_t dst_layout, const uint8_t* src, uint8_t src_layout);
+static __inline__ uint8_t __get_layout(const CmsSalsa* ss, uint64_t counter);
+static __inline__ void __set_layout(CmsSalsa* ss, uint64_t counter, uint8_t layout);
+static __inline__ unsigned int __counter_shift(uint8_t layout, uint32_t column);
+static __inline__ uint64_t __get_counter(const uint8_t* quad, uint8_t layout, uint32_t column);
+static __inline__ uint64_t __load(const uint8_t* p, unsigned int shift);
+static __inline__ void __store(uint8_t* p, unsigned int shift, uint64_t val);
+static __inline__ uint64_t __max_value(unsigned int shift);
+
+
+int cms_salsa_init_alt(CmsSalsa* ss, unsigned int width, unsigned int depth, cms_hash_function hash_function) {
+    memset(ss, 0, sizeof(CmsSalsa));
+    if (width == 0 || depth == 0) {
+        fprintf(stderr, "Unable to initialize the SALSA sketch since both width and depth are required!\n");
+        return CMS_ERROR;
+    }
+    ss->hash_function = (hash_function == NULL) ? cms_default_hash : hash_function;
+    ss->depth = depth;
+    ss->width = (width + 7) & ~7U;
+    size_t num_counters = (size_t) ss->width * depth;
+    ss->counters = (uint8_t*)calloc(num_counters, 1);
+    ss->layouts = (uint8_t*)calloc(num_counters / 8, 1);
+    if (ss->counters == NULL || ss->layouts == NULL) {
+        fprintf(stderr, "Failed to allocate the SALSA sketch!\n");
+        cms_salsa_destroy(ss);
+        return CMS_ERROR;
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_salsa_destroy(CmsSalsa* ss) {
+    free(ss->counters);
+    free(ss->layouts);
+    ss->counters = NULL;
+    ss->layouts = NULL;
+    ss->width = 0;
+    ss->depth = 0;
+    ss->elements_added = 0;
+    ss->hash_function = NULL;
+    return CMS_SUCCESS;
+}
+
+int cms_salsa_clear(CmsSalsa* ss) {
+    size_t num_counters = (size_t) ss->width * ss->depth;
+    memset(ss->counters, 0, num_counters);
+    memset(ss->layouts, 0, num_counters / 8);
+    ss->elements_added = 0;
+    return CMS_SUCCESS;
+}
+
+size_t cms_salsa_bytes(const CmsSalsa* ss) {
+    size_t num_counters = (size_t) ss->width * ss->depth;
+    return num_counters + num_counters / 8;
+}
+
+int32_t cms_salsa_add_inc_alt(CmsSalsa* ss, uint64_t* hashes, unsigned int num_hashes, uint32_t x) {
+    if (num_hashes < ss->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the addition of the element to the SALSA sketch!");
+        return CMS_ERROR;
+    }
+    ss->elements_added += x;
+    int64_t num_add = INT64_MAX;
+    for (unsigned int i = 0; i < ss->depth; ++i) {
+        int64_t val = __salsa_add(ss, i, (uint32_t) (hashes[i] % ss->width), x);
+        num_add = (val < num_add) ? val : num_add;
+    }
+    return __clamp_int32(num_add);
+}
+
+int32_t cms_salsa_add_inc(CmsSalsa* ss, const char* key, uint32_t x) {
+    uint64_t* hashes = ss->hash_function(ss->depth, key);
+    int32_t num_add = cms_salsa_add_inc_alt(ss, hashes, ss->depth, x);
+    free(hashes);
+    return num_add;
+}
+
+int32_t cms_salsa_check_alt(CmsSalsa* ss, uint64_t* hashes, unsigned int num_hashes) {
+    if (num_hashes < ss->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the min lookup of the element in the SALSA sketch!");
+        return CMS_ERROR;
+    }
+    uint64_t num_add = UINT64_MAX;
+    for (unsigned int i = 0; i < ss->depth; ++i) {
+        uint64_t counter = (uint64_t) i * ss->width + (hashes[i] % ss->width);
+        uint64_t val = __get_counter(ss->counters + (counter & ~3ULL), __get_layout(ss, counter), (uint32_t) counter);
+        num_add = (val < num_add) ? val : num_add;
+    }
+    return __clamp_int32((int64_t) num_add);
+}
+
+int32_t cms_salsa_check(CmsSalsa* ss, const char* key) {
+    uint64_t* hashes = ss->hash_function(ss->depth, key);
+    int32_t num_add = cms_salsa_check_alt(ss, hashes, ss->depth);
+    free(hashes);
+    return num_add;
+}
+
+int cms_salsa_merge(CmsSalsa* ss, CmsSalsa* other) {
+    if (ss->width != other->width || ss->depth != other->depth || ss->hash_function != other->hash_function) {
+        fprintf(stderr, "Unable to merge SALSA sketches of different shapes or hash functions!\n");
+        return CMS_ERROR;
+    }
+    uint64_t num_counters = (uint64_t) ss->width * ss->depth;
+    for (uint64_t q = 0; q < num_counters; q += 4) {
+        uint8_t layout = __quad_merge(ss->counters + q, __get_layout(ss, q), other->counters + q, __get_layout(other, q));
+        __set_layout(ss, q, layout);
+    }
+    ss->elements_added += other->elements_added;
+    return CMS_SUCCESS;
+}
+
+int cms_salsa_export(CmsSalsa* ss, const char* filepath) {
+    FILE* fp = fopen(filepath, "w+b");
+    if (fp == NULL) {
+        fprintf(stderr, "Can't open file %s!\n", filepath);
+        return CMS_ERROR;
+    }
+    __salsa_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SALSA_MAGIC, SALSA_MAGIC_SIZE);
+    header.width = ss->width;
+    header.depth = ss->depth;
+    header.elements_added = ss->elements_added;
+    size_t num_counters = (size_t) ss->width * ss->depth;
+    int res = (fwrite(&header, sizeof(header), 1, fp) == 1
+            && fwrite(ss->counters, 1, num_counters, fp) == num_counters
+            && fwrite(ss->layouts, 1, num_counters / 8, fp) == num_counters / 8) ? CMS_SUCCESS : CMS_ERROR;
+    if (fclose(fp) != 0) {
+        res = CMS_ERROR;
+    }
+    return res;
+}
+
+int cms_salsa_import_alt(CmsSalsa* ss, const char* filepath, cms_hash_function hash_function) {
+    FILE* fp = fopen(filepath, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Can't open file %s!\n", filepath);
+        return CMS_ERROR;
+    }
+    __salsa_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, SALSA_MAGIC, SALSA_MAGIC_SIZE) != 0
+            || (header.width & 7) != 0
+            || cms_salsa_init_alt(ss, header.width, header.depth, hash_function) == CMS_ERROR) {
+        fprintf(stderr, "%s is not a SALSA sketch!\n", filepath);
+        fclose(fp);
+        return CMS_ERROR;
+    }
+    size_t num_counters = (size_t) ss->width * ss->depth;
+    if (fread(ss->counters, 1, num_counters, fp) != num_counters
+            || fread(ss->layouts, 1, num_counters / 8, fp) != num_counters / 8) {
+        fprintf(stderr, "%s is truncated!\n", filepath);
+        cms_salsa_destroy(ss);
+        fclose(fp);
+        return CMS_ERROR;
+    }
+    ss->elements_added = header.elements_added;
+    fclose(fp);
+    return CMS_SUCCESS;
+}
+
+
+/*******************************************************************************
+*    PRIVATE FUNCTIONS
+*******************************************************************************/
+/* add to the counter of the column, merging it with its neighbours on overflow */
+static int64_t __salsa_add(CmsSalsa* ss, unsigned int row, uint32_t column, uint32_t x) {
+    uint64_t counter = (uint64_t) row * ss->width + column;
+    uint8_t* quad = ss->counters + (counter & ~3ULL);
+    uint8_t layout = __get_layout(ss, counter);
+    unsigned int shift = __counter_shift(layout, column);
+    uint32_t start = column & 3 & ~((1U << shift) - 1);
+    uint64_t val = __load(quad + start, shift) + x;
+    if (val <= __max_value(shift)) {
+        __store(quad + start, shift, val);
+        return (int64_t) val;
+    }
+
+    /* 8-bit overflow: merge the pair, keeping the larger value */
+    if (shift == 0) {
+        uint64_t sibling = quad[start ^ 1];
+        val = (val > sibling) ? val : sibling;
+        if (val <= __max_value(1)) {
+            __set_layout(ss, counter, layout | PAIR_MERGED((column >> 1) & 1));
+            __store(quad + (start & ~1U), 1, val);
+            return (int64_t) val;
+        }
+    }
+
+    /* 16-bit overflow: merge the group of four */
+    for (uint32_t c = 0; c < 4; ++c) {
+        uint64_t other = __get_counter(quad, layout, c);
+        val = (val > other) ? val : other;
+    }
+    if (val > __max_value(2)) {
+        val = __max_value(2);
+    }
+    __set_layout(ss, counter, QUAD_MERGED);
+    __store(quad, 2, val);
+    return (int64_t) val;
+}
+
+/*  Add the group of four `src` counters to `dst`; every column gets the wider
+    of its two counters, grown again where the sums overflow it
+
+    Returns:
+        The layout of the merged group */
+static uint8_t __quad_merge(uint8_t* dst, uint8_t dst_layout, const uint8_t* src, uint8_t src_layout) {
+    uint64_t a[4], b[4];
+    for (uint32_t c = 0; c < 4; ++c) {
+        a[c] = __get_counter(dst, dst_layout, c);
+        b[c] = __get_counter(src, src_layout, c);
+    }
+    uint8_t layout = (dst_layout | src_layout) & (QUAD_MERGED | PAIR_MERGED(0) | PAIR_MERGED(1));
+    uint64_t vals[4];
+    bool settled = false;
+    while (!settled) {
+        settled = true;
+        if (layout & QUAD_MERGED) {
+            uint64_t ma = 0, mb = 0;
+            for (uint32_t c = 0; c < 4; ++c) {
+                ma = (a[c] > ma) ? a[c] : ma;
+                mb = (b[c] > mb) ? b[c] : mb;
+            }
+            vals[0] = ma + mb;
+            vals[0] = (vals[0] > __max_value(2)) ? __max_value(2) : vals[0];
+            layout = QUAD_MERGED;
+            break;
+        }
+        for (uint32_t p = 0; p < 2 && settled; ++p) {
+            uint32_t c = p * 2;
+            if (layout & PAIR_MERGED(p)) {
+                vals[c] = ((a[c] > a[c + 1]) ? a[c] : a[c + 1]) + ((b[c] > b[c + 1]) ? b[c] : b[c + 1]);
+                if (vals[c] > __max_value(1)) {
+                    layout |= QUAD_MERGED;
+                    settled = false;
+                }
+            } else {
+                vals[c] = a[c] + b[c];
+                vals[c + 1] = a[c + 1] + b[c + 1];
+                if (vals[c] > __max_value(0) || vals[c + 1] > __max_value(0)) {
+                    layout |= PAIR_MERGED(p);
+                    settled = false;
+                }
+            }
+        }
+    }
+
+    if (layout & QUAD_MERGED) {
+        __store(dst, 2, vals[0]);
+        return layout;
+    }
+    for (uint32_t p = 0; p < 2; ++p) {
+        uint32_t c = p * 2;
+        if (layout & PAIR_MERGED(p)) {
+            __store(dst + c, 1, vals[c]);
+        } else {
+            dst[c] = (uint8_t) vals[c];
+            dst[c + 1] = (uint8_t) vals[c + 1];
+        }
+    }
+    return layout;
+}
+
+/* the width is a multiple of 8, so every layout byte covers two groups of one row */
+static __inline__ uint8_t __get_layout(const CmsSalsa* ss, uint64_t counter) {
+    return (ss->layouts[counter >> 3] >> (((counter >> 2) & 1) * 4)) & 0xF;
+}
+
+static __inline__ void __set_layout(CmsSalsa* ss, uint64_t counter, uint8_t layout) {
+    unsigned int shift = ((counter >> 2) & 1) * 4;
+    uint8_t* byte = ss->layouts + (counter >> 3);
+    *byte = (uint8_t) ((*byte & ~(0xF << shift)) | (layout << shift));
+}
+
+/* log2 of the bytes of the counter holding the column */
+static __inline__ unsigned int __counter_shift(uint8_t layout, uint32_t column) {
+    if (layout & QUAD_MERGED) {
+        return 2;
+    }
+    return (layout >> ((column >> 1) & 1)) & 1;
+}
+
+static __inline__ uint64_t __get_counter(const uint8_t* quad, uint8_t layout, uint32_t column) {
+    unsigned int shift = __counter_shift(layout, column);
+    return __load(quad + (column & 3 & ~((1U << shift) - 1)), shift);
+}
+
+static __inline__ uint64_t __load(const uint8_t* p, unsigned int shift) {
+    if (shift == 0) {
+        return *p;
+    } else if (shift == 1) {
+        uint16_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static __inline__ void __store(uint8_t* p, unsigned int shift, uint64_t val) {
+    if (shift == 0) {
+        *p = (uint8_t) val;
+    } else if (shift == 1) {
+        uint16_t v = (uint16_t) val;
+        memcpy(p, &v, sizeof(v));
+    } else {
+        uint32_t v = (uint32_t) val;
+        memcpy(p, &v, sizeof(v));
+    }
+}
+
+/* 32-bit counters stop at INT32_MAX so estimates stay valid int32_t values */
+static __inline__ uint64_t __max_value(unsigned int shift) {
+    return (shift == 0) ? UINT8_MAX : (shift == 1) ? UINT16_MAX : INT32_MAX;
+}
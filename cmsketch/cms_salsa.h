@@ -0,0 +1,115 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_SALSA_H__
+#define BARRUST_COUNT_MIN_SKETCH_SALSA_H__
+
+/*******************************************************************************
+***     SALSA count-min sketch with self-adjusting counter sizes
+***
+***     All counters start as 8-bit. A counter that overflows is merged with
+***     its neighbour into one 16-bit counter, and a 16-bit counter that
+***     overflows with the other half of its aligned group of four into one
+***     32-bit counter. The merged counter takes the larger of the values it
+***     replaces, so it still bounds every key that maps to it. The layout of
+***     each group of four counters is kept in a 4-bit entry of a bitmap, so
+***     finding a counter and its size is a couple of bit operations and add
+***     and check remain O(depth). A sketch costs 1 byte and 1 bit per counter.
+***
+***     Paper: Ben Basat, Einziger, Mitzenmacher, Vargaftik - "SALSA: Self-
+***     Adjusting Lean Streaming Analytics" (ICDE 2021)
+*******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "cmsketch.h"
+
+typedef struct {
+    uint32_t depth;
+    uint32_t width;             /* counters per row; a multiple of 8 */
+    int64_t elements_added;
+    cms_hash_function hash_function;
+    uint8_t* counters;          /* merged counters span their aligned bytes */
+    uint8_t* layouts;           /* one 4-bit layout per group of four counters */
+} CmsSalsa, cms_salsa;
+
+
+/*  Initialize a SALSA sketch of `depth` rows of `width` 8-bit counters; the
+    width is rounded up to a multiple of 8
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When a dimension is 0 or unable to allocate */
+int cms_salsa_init_alt(CmsSalsa* ss, unsigned int width, unsigned int depth, cms_hash_function hash_function);
+static __inline__ int cms_salsa_init(CmsSalsa* ss, unsigned int width, unsigned int depth) {
+    return cms_salsa_init_alt(ss, width, depth, NULL);
+}
+
+/*  Free all memory of the sketch
+
+    Returns:
+        CMS_SUCCESS */
+int cms_salsa_destroy(CmsSalsa* ss);
+
+/*  Reset the sketch to zero elements inserted and all counters to 8-bit
+
+    Returns:
+        CMS_SUCCESS */
+int cms_salsa_clear(CmsSalsa* ss);
+
+/* The bytes used by the counters and layouts of the sketch */
+size_t cms_salsa_bytes(const CmsSalsa* ss);
+
+/*  Insert the key `x` times
+
+    Returns:
+        The estimate of the key after the insert
+        CMS_ERROR   -   When there are insufficient hashes
+
+    NOTE: The SALSA sketch does not support removes */
+int32_t cms_salsa_add_inc(CmsSalsa* ss, const char* key, uint32_t x);
+int32_t cms_salsa_add_inc_alt(CmsSalsa* ss, uint64_t* hashes, unsigned int num_hashes, uint32_t x);
+static __inline__ int32_t cms_salsa_add(CmsSalsa* ss, const char* key) {
+    return cms_salsa_add_inc(ss, key, 1);
+}
+
+/*  Determine the maximum number of times the key may have been inserted
+
+    Returns:
+        The estimate
+        CMS_ERROR   -   When there are insufficient hashes */
+int32_t cms_salsa_check(CmsSalsa* ss, const char* key);
+int32_t cms_salsa_check_alt(CmsSalsa* ss, uint64_t* hashes, unsigned int num_hashes);
+
+/*  Merge `other` into `ss`; both need the same dimensions and hash function.
+    Each counter takes the wider layout of the two and grows further if the
+    sum overflows it.
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the sketches are not compatible */
+int cms_salsa_merge(CmsSalsa* ss, CmsSalsa* other);
+
+/*  Export the SALSA sketch to file; a header with the dimensions is followed
+    by the counters and the layouts
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the file cannot be written */
+int cms_salsa_export(CmsSalsa* ss, const char* filepath);
+
+/*  Import a SALSA sketch previously exported with `cms_salsa_export`
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the file cannot be read or is not a SALSA sketch */
+int cms_salsa_import_alt(CmsSalsa* ss, const char* filepath, cms_hash_function hash_function);
+static __inline__ int cms_salsa_import(CmsSalsa* ss, const char* filepath) {
+    return cms_salsa_import_alt(ss, filepath, NULL);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
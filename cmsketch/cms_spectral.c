@@ -0,0 +1,268 @@
+/*******************************************************************************
+***     Single array count-min sketch in the style of a spectral Bloom filter
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cms_spectral.h"
+#include "cms_common.h"
+
+#define SPECTRAL_MAGIC "CMSSPC01"
+#define SPECTRAL_MAGIC_SIZE 8
+
+/* On disk: header and the `num_bins` counters */
+typedef struct {
+    char magic[SPECTRAL_MAGIC_SIZE];
+    uint32_t num_bins;
+    uint32_t depth;
+    uint32_t blocked;
+    uint32_t reserved;
+    int64_t elements_added;
+} __spectral_header;
+
+/* private functions */
+static uint64_t* __positions_alloc(const CmsSpectral* sp, uint64_t* stack_pos);
+static unsigned int __positions(const CmsSpectral* sp, const uint64_t* hashes, uint64_t* pos);
+
+
+int cms_spectral_init_alt(CmsSpectral* sp, unsigned int num_bins, unsigned int depth, int blocked, cms_hash_function hash_function) {
+    memset(sp, 0, sizeof(CmsSpectral));
+    if (num_bins == 0 || depth == 0) {
+        fprintf(stderr, "Unable to initialize the single array sketch since both size and depth are required!\n");
+        return CMS_ERROR;
+    }
+    sp->hash_function = (hash_function == NULL) ? cms_default_hash : hash_function;
+    sp->depth = depth;
+    sp->blocked = (blocked != 0);
+    sp->num_bins = (uint32_t) ((num_bins + CMS_SPECTRAL_BLOCK_BINS - 1) & ~(CMS_SPECTRAL_BLOCK_BINS - 1));
+    sp->bins = (int32_t*)aligned_alloc(CMS_SPECTRAL_BLOCK_SIZE, cms_spectral_bytes(sp));
+    if (sp->bins == NULL) {
+        fprintf(stderr, "Failed to allocate the single array sketch!\n");
+        cms_spectral_destroy(sp);
+        return CMS_ERROR;
+    }
+    return cms_spectral_clear(sp);
+}
+
+int cms_spectral_destroy(CmsSpectral* sp) {
+    free(sp->bins);
+    sp->bins = NULL;
+    sp->num_bins = 0;
+    sp->depth = 0;
+    sp->elements_added = 0;
+    sp->hash_function = NULL;
+    return CMS_SUCCESS;
+}
+
+int cms_spectral_clear(CmsSpectral* sp) {
+    memset(sp->bins, 0, cms_spectral_bytes(sp));
+    sp->elements_added = 0;
+    return CMS_SUCCESS;
+}
+
+size_t cms_spectral_bytes(const CmsSpectral* sp) {
+    return (size_t) sp->num_bins * sizeof(int32_t);
+}
+
+int32_t cms_spectral_add_inc_alt(CmsSpectral* sp, uint64_t* hashes, unsigned int num_hashes, uint32_t x) {
+    if (num_hashes < sp->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the addition of the element to the single array sketch!");
+        return CMS_ERROR;
+    }
+    uint64_t stack_pos[CMS_STACK_DEPTH];
+    uint64_t* pos = __positions_alloc(sp, stack_pos);
+    if (pos == NULL) {
+        return CMS_ERROR;
+    }
+    unsigned int n = __positions(sp, hashes, pos);
+    sp->elements_added += x;
+    int32_t num_add = INT32_MAX;
+    for (unsigned int i = 0; i < n; ++i) {
+        int32_t val = __clamp_int32((int64_t) sp->bins[pos[i]] + x);
+        sp->bins[pos[i]] = val;
+        num_add = (val < num_add) ? val : num_add;
+    }
+    if (pos != stack_pos) {
+        free(pos);
+    }
+    return num_add;
+}
+
+int32_t cms_spectral_add_inc(CmsSpectral* sp, const char* key, uint32_t x) {
+    uint64_t* hashes = sp->hash_function(sp->depth, key);
+    int32_t num_add = cms_spectral_add_inc_alt(sp, hashes, sp->depth, x);
+    free(hashes);
+    return num_add;
+}
+
+int32_t cms_spectral_add_conservative_inc_alt(CmsSpectral* sp, uint64_t* hashes, unsigned int num_hashes, uint32_t x) {
+    if (num_hashes < sp->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the addition of the element to the single array sketch!");
+        return CMS_ERROR;
+    }
+    uint64_t stack_pos[CMS_STACK_DEPTH];
+    uint64_t* pos = __positions_alloc(sp, stack_pos);
+    if (pos == NULL) {
+        return CMS_ERROR;
+    }
+    unsigned int n = __positions(sp, hashes, pos);
+    sp->elements_added += x;
+    int32_t min = INT32_MAX;
+    for (unsigned int i = 0; i < n; ++i) {
+        min = (sp->bins[pos[i]] < min) ? sp->bins[pos[i]] : min;
+    }
+    int32_t num_add = __clamp_int32((int64_t) min + x);
+    for (unsigned int i = 0; i < n; ++i) {
+        if (sp->bins[pos[i]] < num_add) {
+            sp->bins[pos[i]] = num_add;
+        }
+    }
+    if (pos != stack_pos) {
+        free(pos);
+    }
+    return num_add;
+}
+
+int32_t cms_spectral_add_conservative_inc(CmsSpectral* sp, const char* key, uint32_t x) {
+    uint64_t* hashes = sp->hash_function(sp->depth, key);
+    int32_t num_add = cms_spectral_add_conservative_inc_alt(sp, hashes, sp->depth, x);
+    free(hashes);
+    return num_add;
+}
+
+int32_t cms_spectral_check_alt(CmsSpectral* sp, uint64_t* hashes, unsigned int num_hashes) {
+    if (num_hashes < sp->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the min lookup of the element in the single array sketch!");
+        return CMS_ERROR;
+    }
+    uint64_t stack_pos[CMS_STACK_DEPTH];
+    uint64_t* pos = __positions_alloc(sp, stack_pos);
+    if (pos == NULL) {
+        return CMS_ERROR;
+    }
+    unsigned int n = __positions(sp, hashes, pos);
+    int32_t num_add = INT32_MAX;
+    for (unsigned int i = 0; i < n; ++i) {
+        num_add = (sp->bins[pos[i]] < num_add) ? sp->bins[pos[i]] : num_add;
+    }
+    if (pos != stack_pos) {
+        free(pos);
+    }
+    return num_add;
+}
+
+int32_t cms_spectral_check(CmsSpectral* sp, const char* key) {
+    uint64_t* hashes = sp->hash_function(sp->depth, key);
+    int32_t num_add = cms_spectral_check_alt(sp, hashes, sp->depth);
+    free(hashes);
+    return num_add;
+}
+
+int cms_spectral_merge(CmsSpectral* sp, CmsSpectral* other) {
+    if (sp->num_bins != other->num_bins || sp->depth != other->depth || sp->blocked != other->blocked
+            || sp->hash_function != other->hash_function) {
+        fprintf(stderr, "Unable to merge single array sketches of different shapes or hash functions!\n");
+        return CMS_ERROR;
+    }
+    for (uint32_t i = 0; i < sp->num_bins; ++i) {
+        sp->bins[i] = __clamp_int32((int64_t) sp->bins[i] + other->bins[i]);
+    }
+    sp->elements_added += other->elements_added;
+    return CMS_SUCCESS;
+}
+
+int cms_spectral_export(CmsSpectral* sp, const char* filepath) {
+    FILE* fp = fopen(filepath, "w+b");
+    if (fp == NULL) {
+        fprintf(stderr, "Can't open file %s!\n", filepath);
+        return CMS_ERROR;
+    }
+    __spectral_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SPECTRAL_MAGIC, SPECTRAL_MAGIC_SIZE);
+    header.num_bins = sp->num_bins;
+    header.depth = sp->depth;
+    header.blocked = (uint32_t) sp->blocked;
+    header.elements_added = sp->elements_added;
+    int res = (fwrite(&header, sizeof(header), 1, fp) == 1
+            && fwrite(sp->bins, sizeof(int32_t), sp->num_bins, fp) == sp->num_bins) ? CMS_SUCCESS : CMS_ERROR;
+    if (fclose(fp) != 0) {
+        res = CMS_ERROR;
+    }
+    return res;
+}
+
+int cms_spectral_import_alt(CmsSpectral* sp, const char* filepath, cms_hash_function hash_function) {
+    FILE* fp = fopen(filepath, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Can't open file %s!\n", filepath);
+        return CMS_ERROR;
+    }
+    __spectral_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, SPECTRAL_MAGIC, SPECTRAL_MAGIC_SIZE) != 0
+            || (header.num_bins % CMS_SPECTRAL_BLOCK_BINS) != 0
+            || cms_spectral_init_alt(sp, header.num_bins, header.depth, (int) header.blocked, hash_function) == CMS_ERROR) {
+        fprintf(stderr, "%s is not a single array sketch!\n", filepath);
+        fclose(fp);
+        return CMS_ERROR;
+    }
+    if (fread(sp->bins, sizeof(int32_t), sp->num_bins, fp) != sp->num_bins) {
+        fprintf(stderr, "%s is truncated!\n", filepath);
+        cms_spectral_destroy(sp);
+        fclose(fp);
+        return CMS_ERROR;
+    }
+    sp->elements_added = header.elements_added;
+    fclose(fp);
+    return CMS_SUCCESS;
+}
+
+
+/*******************************************************************************
+*    PRIVATE FUNCTIONS
+*******************************************************************************/
+/* room for the counters of a key: `stack_pos` for up to CMS_STACK_DEPTH,
+   allocated beyond that */
+static uint64_t* __positions_alloc(const CmsSpectral* sp, uint64_t* stack_pos) {
+    if (sp->depth <= CMS_STACK_DEPTH) {
+        return stack_pos;
+    }
+    uint64_t* pos = (uint64_t*)malloc(sp->depth * sizeof(uint64_t));
+    if (pos == NULL) {
+        fprintf(stderr, "Failed to allocate the counters of the key!\n");
+    }
+    return pos;
+}
+
+/*  The distinct counters of a key. Unblocked, every hash indexes the whole
+    array. Blocked, the top half of the mixed first hash picks the block and
+    4-bit slices of the bottom half the counters in it; keys deeper than 8
+    take the rest from their own hashes. Returns the number of distinct
+    counters written to `pos`. */
+static unsigned int __positions(const CmsSpectral* sp, const uint64_t* hashes, uint64_t* pos) {
+    uint64_t base = 0;
+    uint64_t m = 0;
+    if (sp->blocked) {
+        uint32_t num_blocks = sp->num_bins / CMS_SPECTRAL_BLOCK_BINS;
+        m = __mix(hashes[0]);
+        base = (((m >> 32) * num_blocks) >> 32) * CMS_SPECTRAL_BLOCK_BINS;
+    }
+    unsigned int n = 0;
+    for (unsigned int i = 0; i < sp->depth; ++i) {
+        uint64_t p;
+        if (!sp->blocked) {
+            p = hashes[i] % sp->num_bins;
+        } else {
+            p = base + (((i < 8) ? (m >> (i * 4)) : __mix(hashes[i])) & (CMS_SPECTRAL_BLOCK_BINS - 1));
+        }
+        unsigned int j = 0;
+        while (j < n && pos[j] != p) {
+            ++j;
+        }
+        if (j == n) {
+            pos[n++] = p;
+        }
+    }
+    return n;
+}
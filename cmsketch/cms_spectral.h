@@ -0,0 +1,134 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_SPECTRAL_H__
+#define BARRUST_COUNT_MIN_SKETCH_SPECTRAL_H__
+
+/*******************************************************************************
+***     Single array count-min sketch in the style of a spectral Bloom filter
+***
+***     All `depth` hashes of a key index one shared array of counters instead
+***     of a row each, so a small sketch does not waste the unused columns of
+***     lightly loaded rows. The estimate is still the smallest of the key's
+***     counters. When the sketch is blocked, every counter of a key lies in
+***     the same 64 byte block of 16 counters, so an add or check costs a
+***     single cache miss; the price is more collisions between the keys of a
+***     block and therefore a somewhat larger error for the same memory. Keys
+***     whose hashes pick the same counter count it once. Minimal increase
+***     (conservative update) only raises the key's smallest counters.
+***
+***     Paper: Cohen, Matias - "Spectral Bloom Filters" (SIGMOD 2003)
+*******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "cmsketch.h"
+
+#define CMS_SPECTRAL_BLOCK_SIZE     64
+#define CMS_SPECTRAL_BLOCK_BINS     (CMS_SPECTRAL_BLOCK_SIZE / sizeof(int32_t))
+
+typedef struct {
+    uint32_t depth;             /* counters per key */
+    uint32_t num_bins;          /* a multiple of CMS_SPECTRAL_BLOCK_BINS */
+    int blocked;
+    int64_t elements_added;
+    cms_hash_function hash_function;
+    int32_t* bins;
+} CmsSpectral, cms_spectral;
+
+
+/*  Initialize a single array sketch of (at least) `num_bins` counters, each
+    key using `depth` of them; `blocked` keeps all of a key's counters in one
+    cache line
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When a dimension is 0 or unable to allocate */
+int cms_spectral_init_alt(CmsSpectral* sp, unsigned int num_bins, unsigned int depth, int blocked, cms_hash_function hash_function);
+static __inline__ int cms_spectral_init(CmsSpectral* sp, unsigned int num_bins, unsigned int depth, int blocked) {
+    return cms_spectral_init_alt(sp, num_bins, depth, blocked, NULL);
+}
+
+/*  Free all memory of the sketch
+
+    Returns:
+        CMS_SUCCESS */
+int cms_spectral_destroy(CmsSpectral* sp);
+
+/*  Reset the sketch to zero elements inserted
+
+    Returns:
+        CMS_SUCCESS */
+int cms_spectral_clear(CmsSpectral* sp);
+
+/* The bytes used by the counters of the sketch */
+size_t cms_spectral_bytes(const CmsSpectral* sp);
+
+/*  Insert the key `x` times
+
+    Returns:
+        The estimate of the key after the insert
+        CMS_ERROR   -   When there are insufficient hashes or a deep sketch
+                        cannot allocate the lookup
+
+    NOTE: The single array sketch does not support removes */
+int32_t cms_spectral_add_inc(CmsSpectral* sp, const char* key, uint32_t x);
+int32_t cms_spectral_add_inc_alt(CmsSpectral* sp, uint64_t* hashes, unsigned int num_hashes, uint32_t x);
+static __inline__ int32_t cms_spectral_add(CmsSpectral* sp, const char* key) {
+    return cms_spectral_add_inc(sp, key, 1);
+}
+
+/*  Insert the key `x` times by minimal increase: only the counters below the
+    new estimate are raised to it
+
+    Returns:
+        The estimate of the key after the insert
+        CMS_ERROR   -   When there are insufficient hashes or a deep sketch
+                        cannot allocate the lookup
+
+    NOTE: Merged sketches stay upper bounds, but lose the tighter estimates
+          of minimal increase */
+int32_t cms_spectral_add_conservative_inc(CmsSpectral* sp, const char* key, uint32_t x);
+int32_t cms_spectral_add_conservative_inc_alt(CmsSpectral* sp, uint64_t* hashes, unsigned int num_hashes, uint32_t x);
+
+/*  Determine the maximum number of times the key may have been inserted
+
+    Returns:
+        The estimate
+        CMS_ERROR   -   When there are insufficient hashes or a deep sketch
+                        cannot allocate the lookup */
+int32_t cms_spectral_check(CmsSpectral* sp, const char* key);
+int32_t cms_spectral_check_alt(CmsSpectral* sp, uint64_t* hashes, unsigned int num_hashes);
+
+/*  Add the counters of `other` to `sp`; both need the same size, depth,
+    layout and hash function
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the sketches are not compatible */
+int cms_spectral_merge(CmsSpectral* sp, CmsSpectral* other);
+
+/*  Export the sketch to file; a header with the dimensions and the layout is
+    followed by the counters
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the file cannot be written */
+int cms_spectral_export(CmsSpectral* sp, const char* filepath);
+
+/*  Import a sketch previously exported with `cms_spectral_export`
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the file cannot be read or is not a single array
+                        sketch */
+int cms_spectral_import_alt(CmsSpectral* sp, const char* filepath, cms_hash_function hash_function);
+static __inline__ int cms_spectral_import(CmsSpectral* sp, const char* filepath) {
+    return cms_spectral_import_alt(sp, filepath, NULL);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,337 @@
+/*******************************************************************************
+***     Append-only time-series store of count-min sketch snapshots
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "cms_timeseries.h"
+
+#define TS_MAGIC "CMSTS001"
+#define TS_MAGIC_SIZE 8
+#define TS_INDEX_SUFFIX ".idx"
+
+#if defined(__GNUC__)
+#define CMS_PREFETCH_READ(addr)  __builtin_prefetch((addr), 0, 1)
+#else
+#define CMS_PREFETCH_READ(addr)  ((void) (addr))
+#endif
+
+/*  On disk the store is a header followed by fixed size epochs:
+        header  -   magic, uint32 width, uint32 depth
+        epoch   -   int64 timestamp, int64 elements_added, width * depth int32 bins
+    and the index is one int64 timestamp per epoch */
+typedef struct {
+    char magic[TS_MAGIC_SIZE];
+    uint32_t width;
+    uint32_t depth;
+} __ts_header;
+
+typedef struct {
+    int64_t timestamp;
+    int64_t elements_added;
+} __ts_epoch;
+
+/* private functions */
+static int __ts_write_all(int fd, const void* buf, size_t len, off_t offset);
+static int __ts_load_index(CmsTimeSeries* ts, off_t data_size);
+static int __ts_map(CmsTimeSeries* ts);
+static uint64_t __ts_lower_bound(const CmsTimeSeries* ts, int64_t timestamp);
+static __inline__ off_t __ts_epoch_offset(const CmsTimeSeries* ts, uint64_t epoch);
+
+
+int cms_ts_open_alt(CmsTimeSeries* ts, const char* filepath, unsigned int width, unsigned int depth, cms_hash_function hash_function) {
+    memset(ts, 0, sizeof(CmsTimeSeries));
+    ts->fd = ts->index_fd = -1;
+    if (width < 1 || depth < 1) {
+        fprintf(stderr, "Unable to initialize the time series store; width and depth must be at least 1!\n");
+        return CMS_ERROR;
+    }
+    ts->width = width;
+    ts->depth = depth;
+    ts->epoch_size = sizeof(__ts_epoch) + ((size_t) width * depth * sizeof(int32_t));
+
+    ts->hash_function = (hash_function == NULL) ? cms_default_hash : hash_function;
+
+    size_t len = strlen(filepath);
+    char* index_path = (char*)malloc(len + sizeof(TS_INDEX_SUFFIX));
+    if (index_path == NULL) {
+        fprintf(stderr, "Failed to allocate the time series index path!\n");
+        return CMS_ERROR;
+    }
+    memcpy(index_path, filepath, len);
+    memcpy(index_path + len, TS_INDEX_SUFFIX, sizeof(TS_INDEX_SUFFIX));
+
+    ts->fd = open(filepath, O_RDWR | O_CREAT, 0644);
+    ts->index_fd = open(index_path, O_RDWR | O_CREAT, 0644);
+    if (ts->fd < 0 || ts->index_fd < 0) {
+        fprintf(stderr, "Can't open file %s!\n", (ts->fd < 0) ? filepath : index_path);
+        free(index_path);
+        cms_ts_close(ts);
+        return CMS_ERROR;
+    }
+    free(index_path);
+
+    __ts_header header;
+    off_t size = lseek(ts->fd, 0, SEEK_END);
+    if (size < (off_t) sizeof(__ts_header)) {
+        /* a new store (or one that died before its header was written) */
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TS_MAGIC, TS_MAGIC_SIZE);
+        header.width = width;
+        header.depth = depth;
+        if (ftruncate(ts->index_fd, 0) != 0 || ftruncate(ts->fd, 0) != 0
+                || __ts_write_all(ts->fd, &header, sizeof(header), 0) == CMS_ERROR) {
+            cms_ts_close(ts);
+            return CMS_ERROR;
+        }
+        size = sizeof(header);
+    } else if (pread(ts->fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)
+            || memcmp(header.magic, TS_MAGIC, TS_MAGIC_SIZE) != 0
+            || header.width != width || header.depth != depth) {
+        fprintf(stderr, "%s is not a time series store of %u x %u count-min sketches!\n", filepath, width, depth);
+        cms_ts_close(ts);
+        return CMS_ERROR;
+    }
+    if (__ts_load_index(ts, size) == CMS_ERROR) {
+        cms_ts_close(ts);
+        return CMS_ERROR;
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_ts_close(CmsTimeSeries* ts) {
+    if (ts->map != NULL) {
+        munmap(ts->map, ts->map_size);
+    }
+    if (ts->fd >= 0) {
+        close(ts->fd);
+    }
+    if (ts->index_fd >= 0) {
+        close(ts->index_fd);
+    }
+    free(ts->timestamps);
+    ts->timestamps = NULL;
+    ts->map = NULL;
+    ts->map_size = 0;
+    ts->num_epochs = 0;
+    ts->index_capacity = 0;
+    ts->fd = ts->index_fd = -1;
+    return CMS_SUCCESS;
+}
+
+int cms_ts_append(CmsTimeSeries* ts, CountMinSketch* cms, int64_t timestamp) {
+    if (cms->width != ts->width || cms->depth != ts->depth) {
+        fprintf(stderr, "Unable to append a %u x %u count-min sketch to a store of %u x %u sketches!\n", cms->width, cms->depth, ts->width, ts->depth);
+        return CMS_ERROR;
+    }
+    if (ts->num_epochs > 0 && timestamp < ts->timestamps[ts->num_epochs - 1]) {
+        fprintf(stderr, "Epochs must be appended in timestamp order!\n");
+        return CMS_ERROR;
+    }
+    if (ts->num_epochs == ts->index_capacity) {
+        uint64_t capacity = (ts->index_capacity == 0) ? 64 : ts->index_capacity * 2;
+        int64_t* timestamps = (int64_t*)realloc(ts->timestamps, capacity * sizeof(int64_t));
+        if (timestamps == NULL) {
+            fprintf(stderr, "Failed to grow the time series index!\n");
+            return CMS_ERROR;
+        }
+        ts->timestamps = timestamps;
+        ts->index_capacity = capacity;
+    }
+    cms_flush(cms);
+
+    /* epochs keep 32-bit counters; a promoted sketch is stored only while
+       all of its counters still fit */
+    int32_t* bins = cms->bins;
+    if (cms->wide_bins != NULL) {
+        uint64_t num_bins = (uint64_t) cms->width * cms->depth;
+        bins = (int32_t*)malloc(num_bins * sizeof(int32_t));
+        if (bins == NULL) {
+            fprintf(stderr, "Failed to allocate the epoch of a promoted sketch!\n");
+            return CMS_ERROR;
+        }
+        for (uint64_t i = 0; i < num_bins; ++i) {
+            int64_t val = cms_get_bin(cms, i);
+            if (val > INT32_MAX || val < INT32_MIN) {
+                fprintf(stderr, "Unable to append a promoted count-min sketch whose counters exceed 32 bits!\n");
+                free(bins);
+                return CMS_ERROR;
+            }
+            bins[i] = (int32_t) val;
+        }
+    }
+
+    /* the epoch goes in before its index entry; an epoch without one is
+       dropped when the store is opened again */
+    off_t offset = __ts_epoch_offset(ts, ts->num_epochs);
+    __ts_epoch epoch = {timestamp, cms->elements_added};
+    int res = (__ts_write_all(ts->fd, &epoch, sizeof(epoch), offset) == CMS_ERROR
+            || __ts_write_all(ts->fd, bins, ts->epoch_size - sizeof(epoch), offset + (off_t) sizeof(epoch)) == CMS_ERROR
+            || __ts_write_all(ts->index_fd, &timestamp, sizeof(int64_t), (off_t) (ts->num_epochs * sizeof(int64_t))) == CMS_ERROR);
+    if (bins != cms->bins) {
+        free(bins);
+    }
+    if (res) {
+        return CMS_ERROR;
+    }
+    ts->timestamps[ts->num_epochs++] = timestamp;
+    return CMS_SUCCESS;
+}
+
+int64_t cms_ts_check_range_alt(CmsTimeSeries* ts, uint64_t* hashes, unsigned int num_hashes, int64_t begin, int64_t end) {
+    if (num_hashes < ts->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the min lookup of the element to the count-min sketch!");
+        return CMS_ERROR;
+    }
+    uint64_t first = __ts_lower_bound(ts, begin);
+    uint64_t last = __ts_lower_bound(ts, end);
+    if (first >= last) {
+        return 0;
+    }
+    if (__ts_map(ts) == CMS_ERROR) {
+        return CMS_ERROR;
+    }
+
+    /* the same counters are read in every epoch; resolve their offsets once */
+    uint64_t* bins = (uint64_t*)malloc(ts->depth * sizeof(uint64_t));
+    if (bins == NULL) {
+        fprintf(stderr, "Failed to allocate the time series lookup!\n");
+        return CMS_ERROR;
+    }
+    for (unsigned int i = 0; i < ts->depth; ++i) {
+        bins[i] = (hashes[i] % ts->width) + ((uint64_t) i * ts->width);
+    }
+
+    int64_t total = 0;
+    for (uint64_t e = first; e < last; ++e) {
+        const int32_t* epoch_bins = (const int32_t*) (ts->map + __ts_epoch_offset(ts, e) + sizeof(__ts_epoch));
+        if (e + 1 < last) {
+            const int32_t* next_bins = (const int32_t*) ((const unsigned char*) epoch_bins + ts->epoch_size);
+            for (unsigned int i = 0; i < ts->depth; ++i) {
+                CMS_PREFETCH_READ(&next_bins[bins[i]]);
+            }
+        }
+        int32_t num_add = INT32_MAX;
+        for (unsigned int i = 0; i < ts->depth; ++i) {
+            if (epoch_bins[bins[i]] < num_add) {
+                num_add = epoch_bins[bins[i]];
+            }
+        }
+        total += num_add;
+    }
+    free(bins);
+    return total;
+}
+
+int64_t cms_ts_check_range(CmsTimeSeries* ts, const char* key, int64_t begin, int64_t end) {
+    uint64_t* hashes = ts->hash_function(ts->depth, key);
+    int64_t num_add = cms_ts_check_range_alt(ts, hashes, ts->depth, begin, end);
+    free(hashes);
+    return num_add;
+}
+
+int cms_ts_load_epoch(CmsTimeSeries* ts, uint64_t epoch, CountMinSketch* cms) {
+    if (epoch >= ts->num_epochs) {
+        fprintf(stderr, "Epoch %lu is out of range; the store holds %lu epochs!\n", (unsigned long) epoch, (unsigned long) ts->num_epochs);
+        return CMS_ERROR;
+    }
+    if (__ts_map(ts) == CMS_ERROR || cms_init_alt(cms, ts->width, ts->depth, ts->hash_function) == CMS_ERROR) {
+        return CMS_ERROR;
+    }
+    __ts_epoch header;
+    memcpy(&header, ts->map + __ts_epoch_offset(ts, epoch), sizeof(header));
+    memcpy(cms->bins, ts->map + __ts_epoch_offset(ts, epoch) + sizeof(header), ts->epoch_size - sizeof(header));
+    cms->elements_added = header.elements_added;
+    return CMS_SUCCESS;
+}
+
+
+/*******************************************************************************
+*    PRIVATE FUNCTIONS
+*******************************************************************************/
+static __inline__ off_t __ts_epoch_offset(const CmsTimeSeries* ts, uint64_t epoch) {
+    return (off_t) sizeof(__ts_header) + (off_t) (epoch * ts->epoch_size);
+}
+
+static int __ts_write_all(int fd, const void* buf, size_t len, off_t offset) {
+    const unsigned char* p = (const unsigned char*) buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("cms_ts: ");
+            return CMS_ERROR;
+        }
+        p += n;
+        offset += n;
+        len -= (size_t) n;
+    }
+    return CMS_SUCCESS;
+}
+
+/* read the index and trim both files to the epochs that made it into both */
+static int __ts_load_index(CmsTimeSeries* ts, off_t data_size) {
+    uint64_t data_epochs = (uint64_t) (data_size - (off_t) sizeof(__ts_header)) / ts->epoch_size;
+    uint64_t index_epochs = (uint64_t) lseek(ts->index_fd, 0, SEEK_END) / sizeof(int64_t);
+    ts->num_epochs = (data_epochs < index_epochs) ? data_epochs : index_epochs;
+
+    ts->index_capacity = (ts->num_epochs < 64) ? 64 : ts->num_epochs;
+    ts->timestamps = (int64_t*)malloc(ts->index_capacity * sizeof(int64_t));
+    if (ts->timestamps == NULL) {
+        fprintf(stderr, "Failed to allocate the time series index!\n");
+        return CMS_ERROR;
+    }
+    size_t len = ts->num_epochs * sizeof(int64_t);
+    if (len > 0 && pread(ts->index_fd, ts->timestamps, len, 0) != (ssize_t) len) {
+        fprintf(stderr, "Failed to read the time series index!\n");
+        return CMS_ERROR;
+    }
+    if (ftruncate(ts->fd, __ts_epoch_offset(ts, ts->num_epochs)) != 0
+            || ftruncate(ts->index_fd, (off_t) len) != 0) {
+        perror("cms_ts: ");
+        return CMS_ERROR;
+    }
+    return CMS_SUCCESS;
+}
+
+/* (re)map the data file once epochs were appended past the current mapping */
+static int __ts_map(CmsTimeSeries* ts) {
+    size_t size = (size_t) __ts_epoch_offset(ts, ts->num_epochs);
+    if (ts->map != NULL && ts->map_size >= size) {
+        return CMS_SUCCESS;
+    }
+    if (ts->map != NULL) {
+        munmap(ts->map, ts->map_size);
+        ts->map = NULL;
+        ts->map_size = 0;
+    }
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, ts->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("cms_ts: ");
+        return CMS_ERROR;
+    }
+    ts->map = (unsigned char*) map;
+    ts->map_size = size;
+    return CMS_SUCCESS;
+}
+
+/* first epoch with a timestamp of at least `timestamp` */
+static uint64_t __ts_lower_bound(const CmsTimeSeries* ts, int64_t timestamp) {
+    uint64_t lo = 0, hi = ts->num_epochs;
+    while (lo < hi) {
+        uint64_t mid = lo + ((hi - lo) / 2);
+        if (ts->timestamps[mid] < timestamp) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
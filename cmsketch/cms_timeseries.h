@@ -0,0 +1,91 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_TIMESERIES_H__
+#define BARRUST_COUNT_MIN_SKETCH_TIMESERIES_H__
+
+/*******************************************************************************
+***     Append-only time-series store of count-min sketch snapshots
+***
+***     One file holds a sequence of fixed-shape epochs (timestamp,
+***     elements_added and the bins of one count-min sketch); a sidecar index
+***     (`<path>.idx`) holds just the timestamps. Range queries binary search
+***     the index and then read the `depth` counters of the key directly out
+***     of the memory mapped epochs, without loading whole sketches.
+*******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cmsketch.h"
+
+typedef struct {
+    int fd;
+    int index_fd;
+    uint32_t width;
+    uint32_t depth;
+    cms_hash_function hash_function;
+    uint64_t num_epochs;
+    uint64_t index_capacity;
+    int64_t* timestamps;        /* in memory copy of the index */
+    size_t epoch_size;          /* bytes per epoch in the data file */
+    unsigned char* map;         /* read-only mapping of the data file */
+    size_t map_size;
+} CmsTimeSeries, cms_time_series;
+
+
+/*  Open the store at `filepath`, creating it for sketches of `width` x
+    `depth` if it does not exist; epochs already in the store are kept
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the files cannot be opened or the store holds
+                        sketches of another shape */
+int cms_ts_open_alt(CmsTimeSeries* ts, const char* filepath, unsigned int width, unsigned int depth, cms_hash_function hash_function);
+static __inline__ int cms_ts_open(CmsTimeSeries* ts, const char* filepath, unsigned int width, unsigned int depth) {
+    return cms_ts_open_alt(ts, filepath, width, depth, NULL);
+}
+
+/*  Unmap and close the store
+
+    Returns:
+        CMS_SUCCESS */
+int cms_ts_close(CmsTimeSeries* ts);
+
+/*  Append the count-min sketch as the epoch starting at `timestamp`;
+    timestamps must not decrease
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the sketch is of another shape, the timestamp is
+                        out of order, a counter of a promoted sketch does not
+                        fit in 32 bits or the epoch could not be written
+
+    NOTE: Epochs store 32-bit counters; a promoted sketch (see
+          cms_set_auto_promote) is appended only while all of its counters
+          are in the int32_t range, and nothing is written otherwise */
+int cms_ts_append(CmsTimeSeries* ts, CountMinSketch* cms, int64_t timestamp);
+
+/*  Estimate the number of times the key was inserted in the epochs with
+    `begin <= timestamp < end`; the per-epoch minimums are summed, which is
+    never looser than taking the minimum of the summed rows
+
+    Returns:
+        The estimate; 0 when no epoch is in range
+        CMS_ERROR   -   When there are insufficient hashes or the store
+                        cannot be mapped */
+int64_t cms_ts_check_range(CmsTimeSeries* ts, const char* key, int64_t begin, int64_t end);
+int64_t cms_ts_check_range_alt(CmsTimeSeries* ts, uint64_t* hashes, unsigned int num_hashes, int64_t begin, int64_t end);
+
+/*  Load a single epoch into the newly initialized count-min sketch `cms`
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When `epoch` is out of range or unable to allocate */
+int cms_ts_load_epoch(CmsTimeSeries* ts, uint64_t epoch, CountMinSketch* cms);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
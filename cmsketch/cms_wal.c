@@ -0,0 +1,306 @@
+/*******************************************************************************
+***     Write-ahead update log for a count-min sketch
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cms_wal.h"
+
+#define WAL_MAGIC "CMSWAL01"
+#define WAL_MAGIC_SIZE 8
+#define WAL_REPLAY_RECORDS 4096
+
+/*  On disk the log is a header followed by fixed size records:
+        header  -   magic, uint32 depth, uint32 reserved, int64 base_elements
+        record  -   int64 delta, `depth` uint64 hashes */
+typedef struct {
+    char magic[WAL_MAGIC_SIZE];
+    uint32_t depth;
+    uint32_t reserved;
+    int64_t base_elements;
+} __wal_header;
+
+/* private functions */
+static int __write_header(int fd, uint32_t depth, int64_t base_elements);
+static int __rewrite_header(int fd, uint32_t depth, int64_t base_elements);
+static int __read_header(int fd, __wal_header* header);
+static int __write_all(int fd, const void* buf, size_t len, off_t offset);
+static int __log_record(CmsWal* wal, uint64_t* hashes, int64_t delta);
+
+
+int cms_wal_open(CmsWal* wal, const char* filepath, CountMinSketch* cms, unsigned int group_size, int flags) {
+    memset(wal, 0, sizeof(CmsWal));
+    wal->fd = open(filepath, O_RDWR | O_CREAT, 0644);
+    if (wal->fd < 0) {
+        fprintf(stderr, "Can't open file %s!\n", filepath);
+        return CMS_ERROR;
+    }
+    wal->depth = cms->depth;
+    wal->group_size = (group_size == 0) ? CMS_WAL_GROUP_SIZE : group_size;
+    wal->flags = flags;
+    wal->record_size = sizeof(int64_t) + (wal->depth * sizeof(uint64_t));
+
+    __wal_header header;
+    off_t size = lseek(wal->fd, 0, SEEK_END);
+    if (size == 0) {
+        wal->base_elements = cms->elements_added;
+        if (__write_header(wal->fd, wal->depth, wal->base_elements) == CMS_ERROR) {
+            close(wal->fd);
+            return CMS_ERROR;
+        }
+    } else if (__read_header(wal->fd, &header) == CMS_ERROR || header.depth != wal->depth) {
+        fprintf(stderr, "%s is not an update log for a count-min sketch of depth %u!\n", filepath, wal->depth);
+        close(wal->fd);
+        return CMS_ERROR;
+    } else {
+        /* drop a partially written trailing record so new records stay aligned */
+        off_t records = (size - (off_t) sizeof(__wal_header)) / (off_t) wal->record_size;
+        off_t end = (off_t) sizeof(__wal_header) + (records * (off_t) wal->record_size);
+        if (end != size && ftruncate(wal->fd, end) != 0) {
+            close(wal->fd);
+            return CMS_ERROR;
+        }
+        wal->base_elements = header.base_elements;
+        size = end;
+    }
+    wal->log_size = (size == 0) ? (off_t) sizeof(__wal_header) : size;
+
+    wal->buffer = (unsigned char*)malloc(wal->group_size * wal->record_size);
+    if (wal->buffer == NULL) {
+        fprintf(stderr, "Failed to allocate the update log buffer!\n");
+        close(wal->fd);
+        return CMS_ERROR;
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_wal_close(CmsWal* wal) {
+    int res = cms_wal_commit(wal);
+    close(wal->fd);
+    free(wal->buffer);
+    wal->buffer = NULL;
+    wal->fd = -1;
+    return res;
+}
+
+int32_t cms_wal_add_inc_alt(CmsWal* wal, CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes, uint32_t x) {
+    if (num_hashes < wal->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the addition of the element to the count-min sketch!");
+        return CMS_ERROR;
+    }
+    if (__log_record(wal, hashes, (int64_t) x) == CMS_ERROR) {
+        return CMS_ERROR;
+    }
+    return cms_add_inc_alt(cms, hashes, num_hashes, x);
+}
+
+int32_t cms_wal_add_inc(CmsWal* wal, CountMinSketch* cms, const char* key, uint32_t x) {
+    uint64_t* hashes = cms_get_hashes(cms, key);
+    int32_t num_add = cms_wal_add_inc_alt(wal, cms, hashes, cms->depth, x);
+    free(hashes);
+    return num_add;
+}
+
+int32_t cms_wal_remove_inc_alt(CmsWal* wal, CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes, uint32_t x) {
+    if (num_hashes < wal->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the removal of the element to the count-min sketch!");
+        return CMS_ERROR;
+    }
+    if (__log_record(wal, hashes, -((int64_t) x)) == CMS_ERROR) {
+        return CMS_ERROR;
+    }
+    return cms_remove_inc_alt(cms, hashes, num_hashes, x);
+}
+
+int32_t cms_wal_remove_inc(CmsWal* wal, CountMinSketch* cms, const char* key, uint32_t x) {
+    uint64_t* hashes = cms_get_hashes(cms, key);
+    int32_t num_add = cms_wal_remove_inc_alt(wal, cms, hashes, cms->depth, x);
+    free(hashes);
+    return num_add;
+}
+
+int cms_wal_commit(CmsWal* wal) {
+    if (wal->pending == 0) {
+        return CMS_SUCCESS;
+    }
+    size_t len = wal->pending * wal->record_size;
+    wal->pending = 0;
+    int res = __write_all(wal->fd, wal->buffer, len, wal->log_size);
+    if (res == CMS_SUCCESS && (wal->flags & CMS_WAL_SYNC) && fdatasync(wal->fd) != 0) {
+        perror("cms_wal_commit: ");
+        res = CMS_ERROR;
+    }
+    if (res == CMS_ERROR) {
+        /* a partial (or unsynced) group must not reach the log later on */
+        if (ftruncate(wal->fd, wal->log_size) != 0) {
+            perror("cms_wal_commit: ");
+        }
+        return CMS_ERROR;
+    }
+    wal->log_size += (off_t) len;
+    return CMS_SUCCESS;
+}
+
+int cms_wal_checkpoint(CmsWal* wal, CountMinSketch* cms, const char* snapshot_path) {
+    if (cms_wal_commit(wal) == CMS_ERROR) {
+        return CMS_ERROR;
+    }
+    cms_export_job* job = cms_export_async(cms, snapshot_path, CMS_EXPORT_FSYNC, NULL, NULL);
+    if (job == NULL || cms_export_wait(job) == CMS_ERROR) {
+        return CMS_ERROR;
+    }
+    /*  The snapshot (and its directory entry) is durable; everything logged
+        so far is part of it. Drop the records but keep the old header, which
+        recovery recognises as stale, and only then point the header at the
+        new snapshot. A crash between any two steps leaves a log that is
+        either stale or empty, never the old records under the new header. */
+    wal->base_elements = cms->elements_added;
+    if (ftruncate(wal->fd, sizeof(__wal_header)) != 0) {
+        perror("cms_wal_checkpoint: ");
+        return CMS_ERROR;
+    }
+    wal->log_size = sizeof(__wal_header);
+    if (fdatasync(wal->fd) != 0
+            || __rewrite_header(wal->fd, wal->depth, wal->base_elements) == CMS_ERROR
+            || fdatasync(wal->fd) != 0) {
+        perror("cms_wal_checkpoint: ");
+        return CMS_ERROR;
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_wal_recover_alt(CountMinSketch* cms, const char* snapshot_path, const char* log_path, cms_hash_function hash_function) {
+    if (snapshot_path != NULL && cms_import_alt(cms, snapshot_path, hash_function) == CMS_ERROR) {
+        return CMS_ERROR;
+    }
+
+    int fd = open(log_path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return CMS_SUCCESS;     /* nothing was logged since the snapshot */
+        }
+        fprintf(stderr, "Can't open file %s!\n", log_path);
+        return CMS_ERROR;
+    }
+    if (lseek(fd, 0, SEEK_END) == 0) {
+        close(fd);
+        return CMS_SUCCESS;     /* created but the header never reached the disk */
+    }
+    __wal_header header;
+    if (__read_header(fd, &header) == CMS_ERROR || header.depth != cms->depth
+            || lseek(fd, sizeof(__wal_header), SEEK_SET) < 0) {
+        fprintf(stderr, "%s is not an update log for a count-min sketch of depth %u!\n", log_path, cms->depth);
+        close(fd);
+        return CMS_ERROR;
+    }
+    if (snapshot_path != NULL && header.base_elements != cms->elements_added) {
+        close(fd);
+        return CMS_SUCCESS;     /* the log predates the snapshot */
+    }
+
+    size_t record_size = sizeof(int64_t) + (cms->depth * sizeof(uint64_t));
+    unsigned char* buffer = (unsigned char*)malloc(WAL_REPLAY_RECORDS * record_size);
+    uint64_t* hashes = (uint64_t*)malloc(cms->depth * sizeof(uint64_t));
+    if (buffer == NULL || hashes == NULL) {
+        fprintf(stderr, "Failed to allocate the update log replay buffer!\n");
+        free(buffer);
+        free(hashes);
+        close(fd);
+        return CMS_ERROR;
+    }
+    size_t filled = 0;
+    for (;;) {
+        ssize_t n = read(fd, buffer + filled, (WAL_REPLAY_RECORDS * record_size) - filled);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;      /* a trailing partial record was never committed */
+        }
+        filled += (size_t) n;
+        size_t records = filled / record_size;
+        for (size_t r = 0; r < records; ++r) {
+            int64_t delta;
+            memcpy(&delta, buffer + (r * record_size), sizeof(int64_t));
+            memcpy(hashes, buffer + (r * record_size) + sizeof(int64_t), cms->depth * sizeof(uint64_t));
+            if (delta >= 0) {
+                cms_add_inc_alt(cms, hashes, cms->depth, (uint32_t) delta);
+            } else {
+                cms_remove_inc_alt(cms, hashes, cms->depth, (uint32_t) -delta);
+            }
+        }
+        memmove(buffer, buffer + (records * record_size), filled - (records * record_size));
+        filled -= records * record_size;
+    }
+    free(buffer);
+    free(hashes);
+    close(fd);
+    return CMS_SUCCESS;
+}
+
+
+/*******************************************************************************
+*    PRIVATE FUNCTIONS
+*******************************************************************************/
+static int __write_header(int fd, uint32_t depth, int64_t base_elements) {
+    __wal_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WAL_MAGIC, WAL_MAGIC_SIZE);
+    header.depth = depth;
+    header.base_elements = base_elements;
+    return __write_all(fd, &header, sizeof(header), 0);
+}
+
+/* overwrite the header in place, leaving the file offset alone */
+static int __rewrite_header(int fd, uint32_t depth, int64_t base_elements) {
+    __wal_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WAL_MAGIC, WAL_MAGIC_SIZE);
+    header.depth = depth;
+    header.base_elements = base_elements;
+    if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+        return CMS_ERROR;
+    }
+    return CMS_SUCCESS;
+}
+
+static int __read_header(int fd, __wal_header* header) {
+    if (pread(fd, header, sizeof(__wal_header), 0) != (ssize_t) sizeof(__wal_header)
+            || memcmp(header->magic, WAL_MAGIC, WAL_MAGIC_SIZE) != 0) {
+        return CMS_ERROR;
+    }
+    return CMS_SUCCESS;
+}
+
+static int __write_all(int fd, const void* buf, size_t len, off_t offset) {
+    const unsigned char* p = (const unsigned char*) buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("cms_wal: ");
+            return CMS_ERROR;
+        }
+        p += n;
+        offset += n;
+        len -= (size_t) n;
+    }
+    return CMS_SUCCESS;
+}
+
+/* buffer the record and commit the group once it is full */
+static int __log_record(CmsWal* wal, uint64_t* hashes, int64_t delta) {
+    unsigned char* record = wal->buffer + (wal->pending * wal->record_size);
+    memcpy(record, &delta, sizeof(int64_t));
+    memcpy(record + sizeof(int64_t), hashes, wal->depth * sizeof(uint64_t));
+    if (++wal->pending == wal->group_size) {
+        return cms_wal_commit(wal);
+    }
+    return CMS_SUCCESS;
+}
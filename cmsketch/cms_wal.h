@@ -0,0 +1,113 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_WAL_H__
+#define BARRUST_COUNT_MIN_SKETCH_WAL_H__
+
+/*******************************************************************************
+***     Write-ahead update log for a count-min sketch
+***
+***     Every update made through the log is appended as a (delta, hashes)
+***     record before it is applied to the sketch. Records are buffered and
+***     written with a single write (and optionally fdatasync) per group of
+***     `group_size` records. After a crash the last exported snapshot is
+***     imported and the log is replayed on top of it; a checkpoint exports a
+***     new snapshot and truncates the log.
+*******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "cmsketch.h"
+
+#define CMS_WAL_GROUP_SIZE  256     /* default records per group commit */
+
+/* flags for cms_wal_open */
+#define CMS_WAL_SYNC        1       /* fdatasync on every group commit */
+
+typedef struct {
+    int fd;
+    uint32_t depth;
+    uint32_t group_size;
+    uint32_t pending;           /* records buffered since the last commit */
+    int flags;
+    off_t log_size;             /* bytes of the log that were committed */
+    int64_t base_elements;      /* elements_added of the snapshot the log applies to */
+    size_t record_size;
+    unsigned char* buffer;      /* group_size records */
+} CmsWal, cms_wal;
+
+
+/*  Open (or create) the log at `filepath` for the count-min sketch; an
+    existing log is appended to, a new one applies on top of the current
+    state of `cms`. Passing 0 for `group_size` uses CMS_WAL_GROUP_SIZE.
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the file cannot be opened or was written for a
+                        sketch of another depth */
+int cms_wal_open(CmsWal* wal, const char* filepath, CountMinSketch* cms, unsigned int group_size, int flags);
+
+/*  Commit the pending records and close the log
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the final commit failed */
+int cms_wal_close(CmsWal* wal);
+
+/*  Log the update and then apply it to the count-min sketch; the return
+    values are those of `cms_add_inc_alt` and `cms_remove_inc_alt`, or
+    CMS_ERROR when the group commit failed, in which case this update is not
+    applied (see `cms_wal_commit` for the rest of the group) */
+int32_t cms_wal_add_inc(CmsWal* wal, CountMinSketch* cms, const char* key, uint32_t x);
+int32_t cms_wal_add_inc_alt(CmsWal* wal, CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes, uint32_t x);
+int32_t cms_wal_remove_inc(CmsWal* wal, CountMinSketch* cms, const char* key, uint32_t x);
+int32_t cms_wal_remove_inc_alt(CmsWal* wal, CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes, uint32_t x);
+
+/*  Write the pending records to the log (and fdatasync them with
+    CMS_WAL_SYNC); only committed records survive a crash
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the records could not be written (or synced);
+                        the log is truncated back to its last commit and the
+                        group is dropped, so it is never written later
+
+    NOTE: The updates of a dropped group stay applied to the sketch but are
+    missing from the log; a successful `cms_wal_checkpoint` makes the log
+    match the sketch again */
+int cms_wal_commit(CmsWal* wal);
+
+/*  Export the sketch to `snapshot_path` (fsynced and atomically renamed into
+    place) and truncate the log, which from then on applies to the new
+    snapshot
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the snapshot could not be written; the log is
+                        left intact */
+int cms_wal_checkpoint(CmsWal* wal, CountMinSketch* cms, const char* snapshot_path);
+
+/*  Rebuild a sketch after a crash: import `snapshot_path` into `cms` and
+    replay the committed records of the log at `log_path`. When
+    `snapshot_path` is NULL the records are replayed into the already
+    initialized `cms`. A log that predates the snapshot (the process died
+    during a checkpoint, after writing the snapshot) is skipped, as is an
+    empty log.
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the snapshot or log cannot be read or do not match
+
+    NOTE: A stale log is recognised by `elements_added`; a log whose records
+    sum to zero cannot be told apart from a current one */
+int cms_wal_recover_alt(CountMinSketch* cms, const char* snapshot_path, const char* log_path, cms_hash_function hash_function);
+static __inline__ int cms_wal_recover(CountMinSketch* cms, const char* snapshot_path, const char* log_path) {
+    return cms_wal_recover_alt(cms, snapshot_path, log_path, NULL);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,420 @@
+/*******************************************************************************
+***     Weighted count-min sketch with floating point bins
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "cms_weighted.h"
+
+/* the AVX kernels are built for every x86 target and picked at run time */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WEIGHTED_AVX
+#include <immintrin.h>
+#endif
+
+#define WEIGHTED_MAGIC "CMSWGT01"
+#define WEIGHTED_MAGIC_SIZE 8
+#define CHECK_CHUNK 256     /* keys whose row values are gathered at a time */
+
+/*  On disk: header and the `width` x `depth` bins of `value_size` bytes */
+typedef struct {
+    char magic[WEIGHTED_MAGIC_SIZE];
+    uint32_t width;
+    uint32_t depth;
+    uint32_t type;
+    uint32_t value_size;
+    double weight_added;
+} __weighted_header;
+
+/* private functions */
+static __inline__ size_t __value_size(cms_weight_type type);
+static __inline__ double __get_bin(const CmsWeighted* cw, uint64_t bin);
+static __inline__ float __add_up_float(float a, float b);
+static __inline__ double __add_up_double(double a, double b);
+static __inline__ void __add_bin(CmsWeighted* cw, uint64_t bin, double weight);
+static void __add_weight(CmsWeighted* cw, const uint64_t* hashes, double weight);
+static void __merge_float(float* dst, const float* src, uint64_t n);
+static void __merge_double(double* dst, const double* src, uint64_t n);
+static void __min_into(double* __restrict dst, const double* __restrict src, unsigned int n);
+#if defined(WEIGHTED_AVX)
+static __inline__ int __has_avx(void);
+static uint64_t __merge_float_avx(float* dst, const float* src, uint64_t n);
+static uint64_t __merge_double_avx(double* dst, const double* src, uint64_t n);
+static unsigned int __min_into_avx(double* __restrict dst, const double* __restrict src, unsigned int n);
+#endif
+
+
+int cms_weighted_init_alt(CmsWeighted* cw, unsigned int width, unsigned int depth, cms_weight_type type, cms_hash_function hash_function) {
+    memset(cw, 0, sizeof(CmsWeighted));
+    if (width == 0 || depth == 0 || (type != CMS_WEIGHT_FLOAT && type != CMS_WEIGHT_DOUBLE)) {
+        fprintf(stderr, "Unable to initialize the weighted sketch since it needs a width, depth and bin type!\n");
+        return CMS_ERROR;
+    }
+    cw->hash_function = (hash_function == NULL) ? cms_default_hash : hash_function;
+
+    cw->bins = calloc((size_t) width * depth, __value_size(type));
+    if (cw->bins == NULL) {
+        fprintf(stderr, "Failed to allocate the weighted sketch!\n");
+        return CMS_ERROR;
+    }
+    cw->width = width;
+    cw->depth = depth;
+    cw->type = type;
+    return CMS_SUCCESS;
+}
+
+int cms_weighted_destroy(CmsWeighted* cw) {
+    free(cw->bins);
+    cw->bins = NULL;
+    cw->width = 0;
+    cw->depth = 0;
+    cw->weight_added = 0.0;
+    cw->hash_function = NULL;
+    return CMS_SUCCESS;
+}
+
+int cms_weighted_clear(CmsWeighted* cw) {
+    memset(cw->bins, 0, (size_t) cw->width * cw->depth * __value_size(cw->type));
+    cw->weight_added = 0.0;
+    return CMS_SUCCESS;
+}
+
+int cms_weighted_add_alt(CmsWeighted* cw, uint64_t* hashes, unsigned int num_hashes, double weight) {
+    if (num_hashes < cw->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the addition of the element to the weighted sketch!");
+        return CMS_ERROR;
+    }
+    if (!(weight >= 0.0)) {
+        fprintf(stderr, "Weights added to the weighted sketch must not be negative!\n");
+        return CMS_ERROR;
+    }
+    __add_weight(cw, hashes, weight);
+    return CMS_SUCCESS;
+}
+
+int cms_weighted_add(CmsWeighted* cw, const char* key, double weight) {
+    uint64_t* hashes = cw->hash_function(cw->depth, key);
+    int res = cms_weighted_add_alt(cw, hashes, cw->depth, weight);
+    free(hashes);
+    return res;
+}
+
+int cms_weighted_add_batch_alt(CmsWeighted* cw, const uint64_t* hashes, unsigned int num_hashes, const double* weights, unsigned int num_keys) {
+    if (num_hashes < cw->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the batch addition to the weighted sketch!");
+        return CMS_ERROR;
+    }
+    for (unsigned int k = 0; k < num_keys; ++k) {
+        if (!(weights[k] >= 0.0)) {
+            fprintf(stderr, "Weights added to the weighted sketch must not be negative!\n");
+            return CMS_ERROR;
+        }
+    }
+    for (unsigned int k = 0; k < num_keys; ++k) {
+        __add_weight(cw, hashes + (size_t) k * num_hashes, weights[k]);
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_weighted_add_batch(CmsWeighted* cw, const char** keys, const double* weights, unsigned int num_keys) {
+    if (num_keys == 0) {
+        return CMS_SUCCESS;
+    }
+    uint64_t* hashes = (uint64_t*)malloc((size_t) num_keys * cw->depth * sizeof(uint64_t));
+    if (hashes == NULL) {
+        fprintf(stderr, "Failed to allocate the hashes of the batch!\n");
+        return CMS_ERROR;
+    }
+    for (unsigned int k = 0; k < num_keys; ++k) {
+        uint64_t* key_hashes = cw->hash_function(cw->depth, keys[k]);
+        memcpy(hashes + (size_t) k * cw->depth, key_hashes, cw->depth * sizeof(uint64_t));
+        free(key_hashes);
+    }
+    int res = cms_weighted_add_batch_alt(cw, hashes, cw->depth, weights, num_keys);
+    free(hashes);
+    return res;
+}
+
+double cms_weighted_check_alt(CmsWeighted* cw, uint64_t* hashes, unsigned int num_hashes) {
+    if (num_hashes < cw->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the min lookup of the element in the weighted sketch!");
+        return CMS_ERROR;
+    }
+    double num_add = INFINITY;
+    for (unsigned int i = 0; i < cw->depth; ++i) {
+        double val = __get_bin(cw, (hashes[i] % cw->width) + (uint64_t) i * cw->width);
+        num_add = (val < num_add) ? val : num_add;
+    }
+    return num_add;
+}
+
+double cms_weighted_check(CmsWeighted* cw, const char* key) {
+    uint64_t* hashes = cw->hash_function(cw->depth, key);
+    double num_add = cms_weighted_check_alt(cw, hashes, cw->depth);
+    free(hashes);
+    return num_add;
+}
+
+int cms_weighted_check_batch_alt(CmsWeighted* cw, const uint64_t* hashes, unsigned int num_hashes, unsigned int num_keys, double* results) {
+    if (num_hashes < cw->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the batch lookup in the weighted sketch!");
+        return CMS_ERROR;
+    }
+    double row_values[CHECK_CHUNK];
+    for (unsigned int begin = 0; begin < num_keys; begin += CHECK_CHUNK) {
+        unsigned int n = (num_keys - begin < CHECK_CHUNK) ? num_keys - begin : CHECK_CHUNK;
+        for (unsigned int k = 0; k < n; ++k) {
+            results[begin + k] = INFINITY;
+        }
+        /* gather a row's values for the chunk, then take the min of whole arrays */
+        for (unsigned int i = 0; i < cw->depth; ++i) {
+            for (unsigned int k = 0; k < n; ++k) {
+                uint64_t hash = hashes[(size_t) (begin + k) * num_hashes + i];
+                row_values[k] = __get_bin(cw, (hash % cw->width) + (uint64_t) i * cw->width);
+            }
+            __min_into(results + begin, row_values, n);
+        }
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_weighted_check_batch(CmsWeighted* cw, const char** keys, unsigned int num_keys, double* results) {
+    if (num_keys == 0) {
+        return CMS_SUCCESS;
+    }
+    uint64_t* hashes = (uint64_t*)malloc((size_t) num_keys * cw->depth * sizeof(uint64_t));
+    if (hashes == NULL) {
+        fprintf(stderr, "Failed to allocate the hashes of the batch!\n");
+        return CMS_ERROR;
+    }
+    for (unsigned int k = 0; k < num_keys; ++k) {
+        uint64_t* key_hashes = cw->hash_function(cw->depth, keys[k]);
+        memcpy(hashes + (size_t) k * cw->depth, key_hashes, cw->depth * sizeof(uint64_t));
+        free(key_hashes);
+    }
+    int res = cms_weighted_check_batch_alt(cw, hashes, cw->depth, num_keys, results);
+    free(hashes);
+    return res;
+}
+
+int cms_weighted_merge(CmsWeighted* cw, CmsWeighted* other) {
+    if (cw->width != other->width || cw->depth != other->depth || cw->type != other->type
+            || cw->hash_function != other->hash_function) {
+        fprintf(stderr, "Unable to merge weighted sketches of different shapes, bin types or hash functions!\n");
+        return CMS_ERROR;
+    }
+    uint64_t num_bins = (uint64_t) cw->width * cw->depth;
+    if (cw->type == CMS_WEIGHT_FLOAT) {
+        __merge_float((float*) cw->bins, (const float*) other->bins, num_bins);
+    } else {
+        __merge_double((double*) cw->bins, (const double*) other->bins, num_bins);
+    }
+    cw->weight_added += other->weight_added;
+    return CMS_SUCCESS;
+}
+
+int cms_weighted_export(CmsWeighted* cw, const char* filepath) {
+    FILE* fp = fopen(filepath, "w+b");
+    if (fp == NULL) {
+        fprintf(stderr, "Can't open file %s!\n", filepath);
+        return CMS_ERROR;
+    }
+    __weighted_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WEIGHTED_MAGIC, WEIGHTED_MAGIC_SIZE);
+    header.width = cw->width;
+    header.depth = cw->depth;
+    header.type = (uint32_t) cw->type;
+    header.value_size = (uint32_t) __value_size(cw->type);
+    header.weight_added = cw->weight_added;
+    size_t num_bins = (size_t) cw->width * cw->depth;
+    int res = (fwrite(&header, sizeof(header), 1, fp) == 1
+            && fwrite(cw->bins, header.value_size, num_bins, fp) == num_bins) ? CMS_SUCCESS : CMS_ERROR;
+    if (fclose(fp) != 0) {
+        res = CMS_ERROR;
+    }
+    return res;
+}
+
+int cms_weighted_import_alt(CmsWeighted* cw, const char* filepath, cms_hash_function hash_function) {
+    FILE* fp = fopen(filepath, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Can't open file %s!\n", filepath);
+        return CMS_ERROR;
+    }
+    __weighted_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, WEIGHTED_MAGIC, WEIGHTED_MAGIC_SIZE) != 0
+            || (header.type != CMS_WEIGHT_FLOAT && header.type != CMS_WEIGHT_DOUBLE)
+            || header.value_size != __value_size((cms_weight_type) header.type)
+            || cms_weighted_init_alt(cw, header.width, header.depth, (cms_weight_type) header.type, hash_function) == CMS_ERROR) {
+        fprintf(stderr, "%s is not a weighted sketch!\n", filepath);
+        fclose(fp);
+        return CMS_ERROR;
+    }
+    size_t num_bins = (size_t) header.width * header.depth;
+    if (fread(cw->bins, header.value_size, num_bins, fp) != num_bins) {
+        fprintf(stderr, "%s is truncated!\n", filepath);
+        cms_weighted_destroy(cw);
+        fclose(fp);
+        return CMS_ERROR;
+    }
+    cw->weight_added = header.weight_added;
+    fclose(fp);
+    return CMS_SUCCESS;
+}
+
+
+/*******************************************************************************
+*    PRIVATE FUNCTIONS
+*******************************************************************************/
+static __inline__ size_t __value_size(cms_weight_type type) {
+    return (type == CMS_WEIGHT_FLOAT) ? sizeof(float) : sizeof(double);
+}
+
+static __inline__ double __get_bin(const CmsWeighted* cw, uint64_t bin) {
+    if (cw->type == CMS_WEIGHT_FLOAT) {
+        return ((const float*) cw->bins)[bin];
+    }
+    return ((const double*) cw->bins)[bin];
+}
+
+/*  a + b for non-negative a and b, rounded up instead of to nearest so the
+    bins never fall below the exact sums. TwoSum recovers the rounding error
+    of the sum; a sum that was rounded down moves up by at least one ulp
+    (scaling by 1 + epsilon for normal numbers, adding the smallest
+    subnormal otherwise). The AVX merges below do the same per lane. */
+static __inline__ float __add_up_float(float a, float b) {
+    float s = a + b;
+    float bv = s - a;
+    float err = (a - (s - bv)) + (b - bv);
+    float scaled = s * (1.0f + FLT_EPSILON);
+    float tiny = s + FLT_TRUE_MIN;
+    float s_up = (scaled > tiny) ? scaled : tiny;
+    return (err > 0) ? s_up : s;
+}
+
+static __inline__ double __add_up_double(double a, double b) {
+    double s = a + b;
+    double bv = s - a;
+    double err = (a - (s - bv)) + (b - bv);
+    double scaled = s * (1.0 + DBL_EPSILON);
+    double tiny = s + DBL_TRUE_MIN;
+    double s_up = (scaled > tiny) ? scaled : tiny;
+    return (err > 0) ? s_up : s;
+}
+
+static __inline__ void __add_bin(CmsWeighted* cw, uint64_t bin, double weight) {
+    if (cw->type == CMS_WEIGHT_FLOAT) {
+        /* the weight itself is rounded up to float first */
+        float w = (float) weight;
+        float w_up = (w * (1.0f + FLT_EPSILON) > w + FLT_TRUE_MIN) ? w * (1.0f + FLT_EPSILON) : w + FLT_TRUE_MIN;
+        ((float*) cw->bins)[bin] = __add_up_float(((float*) cw->bins)[bin], ((double) w < weight) ? w_up : w);
+    } else {
+        ((double*) cw->bins)[bin] = __add_up_double(((double*) cw->bins)[bin], weight);
+    }
+}
+
+static void __add_weight(CmsWeighted* cw, const uint64_t* hashes, double weight) {
+    for (unsigned int i = 0; i < cw->depth; ++i) {
+        __add_bin(cw, (hashes[i] % cw->width) + (uint64_t) i * cw->width, weight);
+    }
+    cw->weight_added += weight;
+}
+
+/* `dst` and `src` may be the same array (a sketch merged into itself); each
+   element is read before it is written */
+static void __merge_float(float* dst, const float* src, uint64_t n) {
+    uint64_t i = 0;
+#if defined(WEIGHTED_AVX)
+    if (__has_avx()) {
+        i = __merge_float_avx(dst, src, n);
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = __add_up_float(dst[i], src[i]);
+    }
+}
+
+static void __merge_double(double* dst, const double* src, uint64_t n) {
+    uint64_t i = 0;
+#if defined(WEIGHTED_AVX)
+    if (__has_avx()) {
+        i = __merge_double_avx(dst, src, n);
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = __add_up_double(dst[i], src[i]);
+    }
+}
+
+static void __min_into(double* __restrict dst, const double* __restrict src, unsigned int n) {
+    unsigned int i = 0;
+#if defined(WEIGHTED_AVX)
+    if (__has_avx()) {
+        i = __min_into_avx(dst, src, n);
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = (src[i] < dst[i]) ? src[i] : dst[i];
+    }
+}
+
+#if defined(WEIGHTED_AVX)
+static __inline__ int __has_avx(void) {
+#if defined(__AVX__)
+    return 1;
+#else
+    return __builtin_cpu_supports("avx");
+#endif
+}
+
+/* the AVX kernels handle whole vectors and return the number of elements
+   done; the callers finish the tail */
+__attribute__((target("avx")))
+static uint64_t __merge_float_avx(float* dst, const float* src, uint64_t n) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 up = _mm256_set1_ps(1.0f + FLT_EPSILON);
+    const __m256 tiny = _mm256_set1_ps(FLT_TRUE_MIN);
+    uint64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 a = _mm256_loadu_ps(dst + i);
+        __m256 b = _mm256_loadu_ps(src + i);
+        __m256 s = _mm256_add_ps(a, b);
+        __m256 bv = _mm256_sub_ps(s, a);
+        __m256 err = _mm256_add_ps(_mm256_sub_ps(a, _mm256_sub_ps(s, bv)), _mm256_sub_ps(b, bv));
+        __m256 s_up = _mm256_max_ps(_mm256_mul_ps(s, up), _mm256_add_ps(s, tiny));
+        _mm256_storeu_ps(dst + i, _mm256_blendv_ps(s, s_up, _mm256_cmp_ps(err, zero, _CMP_GT_OQ)));
+    }
+    return i;
+}
+
+__attribute__((target("avx")))
+static uint64_t __merge_double_avx(double* dst, const double* src, uint64_t n) {
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d up = _mm256_set1_pd(1.0 + DBL_EPSILON);
+    const __m256d tiny = _mm256_set1_pd(DBL_TRUE_MIN);
+    uint64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d a = _mm256_loadu_pd(dst + i);
+        __m256d b = _mm256_loadu_pd(src + i);
+        __m256d s = _mm256_add_pd(a, b);
+        __m256d bv = _mm256_sub_pd(s, a);
+        __m256d err = _mm256_add_pd(_mm256_sub_pd(a, _mm256_sub_pd(s, bv)), _mm256_sub_pd(b, bv));
+        __m256d s_up = _mm256_max_pd(_mm256_mul_pd(s, up), _mm256_add_pd(s, tiny));
+        _mm256_storeu_pd(dst + i, _mm256_blendv_pd(s, s_up, _mm256_cmp_pd(err, zero, _CMP_GT_OQ)));
+    }
+    return i;
+}
+
+__attribute__((target("avx")))
+static unsigned int __min_into_avx(double* __restrict dst, const double* __restrict src, unsigned int n) {
+    unsigned int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(dst + i, _mm256_min_pd(_mm256_loadu_pd(dst + i), _mm256_loadu_pd(src + i)));
+    }
+    return i;
+}
+#endif
@@ -0,0 +1,131 @@
+#ifndef BARRUST_COUNT_MIN_SKETCH_WEIGHTED_H__
+#define BARRUST_COUNT_MIN_SKETCH_WEIGHTED_H__
+
+/*******************************************************************************
+***     Weighted count-min sketch with floating point bins
+***
+***     For sketching non-integer quantities (bytes, revenue, decayed weights)
+***     without scaling and rounding into uint32_t increments. The bins are
+***     either float, with a 24-bit significand for half the memory, or
+***     double, with 53 bits. Sums are rounded up, so an estimate is never
+***     below the exact total but may exceed it by the rounding of each add:
+***     about one part in 2^24 (float) or 2^53 (double), and in float bins a
+***     weight below a 2^-24 share of its bin still raises the bin by one
+***     ulp. Merging and the min across rows of a batch lookup run on whole
+***     arrays and use AVX when the CPU supports it.
+*******************************************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "cmsketch.h"
+
+/* the type of the bins */
+typedef enum {
+    CMS_WEIGHT_FLOAT = 0,
+    CMS_WEIGHT_DOUBLE = 1
+} cms_weight_type;
+
+typedef struct {
+    uint32_t depth;
+    uint32_t width;
+    cms_weight_type type;
+    double weight_added;
+    cms_hash_function hash_function;
+    void* bins;                 /* float or double, as `type` */
+} CmsWeighted, cms_weighted;
+
+
+/*  Initialize a weighted sketch of `width` x `depth` bins of the given type
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When a dimension is 0 or unable to allocate */
+int cms_weighted_init_alt(CmsWeighted* cw, unsigned int width, unsigned int depth, cms_weight_type type, cms_hash_function hash_function);
+static __inline__ int cms_weighted_init(CmsWeighted* cw, unsigned int width, unsigned int depth, cms_weight_type type) {
+    return cms_weighted_init_alt(cw, width, depth, type, NULL);
+}
+
+/*  Free all memory of the sketch
+
+    Returns:
+        CMS_SUCCESS */
+int cms_weighted_destroy(CmsWeighted* cw);
+
+/*  Reset the sketch to zero weight inserted
+
+    Returns:
+        CMS_SUCCESS */
+int cms_weighted_clear(CmsWeighted* cw);
+
+/*  Add `weight` to the key
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When there are insufficient hashes or the weight is
+                        negative or not a number */
+int cms_weighted_add(CmsWeighted* cw, const char* key, double weight);
+int cms_weighted_add_alt(CmsWeighted* cw, uint64_t* hashes, unsigned int num_hashes, double weight);
+
+/*  Add `weights[i]` to the i-th key of the batch; for the hashes version
+    `num_hashes` hashes per key are stored one key after the other
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When there are insufficient hashes or a weight is
+                        negative or not a number; nothing is added then */
+int cms_weighted_add_batch(CmsWeighted* cw, const char** keys, const double* weights, unsigned int num_keys);
+int cms_weighted_add_batch_alt(CmsWeighted* cw, const uint64_t* hashes, unsigned int num_hashes, const double* weights, unsigned int num_keys);
+
+/*  Determine the maximum weight that may have been added to the key
+
+    Returns:
+        The estimate
+        CMS_ERROR   -   When there are insufficient hashes */
+double cms_weighted_check(CmsWeighted* cw, const char* key);
+double cms_weighted_check_alt(CmsWeighted* cw, uint64_t* hashes, unsigned int num_hashes);
+
+/*  Determine the estimate of each key of a batch into `results`, which must
+    hold `num_keys` values; the layout of the hashes is as for
+    `cms_weighted_add_batch_alt`
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When there are insufficient hashes */
+int cms_weighted_check_batch(CmsWeighted* cw, const char** keys, unsigned int num_keys, double* results);
+int cms_weighted_check_batch_alt(CmsWeighted* cw, const uint64_t* hashes, unsigned int num_hashes, unsigned int num_keys, double* results);
+
+/*  Add the bins of `other` to `cw`; both need the same dimensions, bin type
+    and hash function. `other` may be `cw` itself, which doubles it
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the sketches are not compatible */
+int cms_weighted_merge(CmsWeighted* cw, CmsWeighted* other);
+
+/*  Export the weighted sketch to file; a header with the dimensions and the
+    bin type is followed by the bins
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the file cannot be written */
+int cms_weighted_export(CmsWeighted* cw, const char* filepath);
+
+/*  Import a weighted sketch previously exported with `cms_weighted_export`;
+    the bin type is taken from the file
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When the file cannot be read or is not a weighted sketch */
+int cms_weighted_import_alt(CmsWeighted* cw, const char* filepath, cms_hash_function hash_function);
+static __inline__ int cms_weighted_import(CmsWeighted* cw, const char* filepath) {
+    return cms_weighted_import_alt(cw, filepath, NULL);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -13,22 +13,163 @@
 #include <limits.h>
 #include <inttypes.h>       /* PRIu64 */
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>          /* sched_yield */
+#include <unistd.h>         /* fsync */
+#include <fcntl.h>          /* open */
 #include "cmsketch.h"
+#include "cms_common.h"
+#include "cms_pool.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #define LOG_TWO 0.6931471805599453
+#define GOLDEN_RATIO_64 0x9E3779B97F4A7C15ULL
+#define PREFETCH_DISTANCE 8
+
+#if defined(__GNUC__)
+#define CMS_PREFETCH_READ(addr)  __builtin_prefetch((addr), 0, 1)
+#define CMS_PREFETCH_WRITE(addr) __builtin_prefetch((addr), 1, 1)
+#else
+#define CMS_PREFETCH_READ(addr)  ((void) (addr))
+#define CMS_PREFETCH_WRITE(addr) ((void) (addr))
+#endif
+
+typedef struct {
+    uint32_t bin;
+    uint32_t x;
+} __bin_update;
+
+struct cms_export_job {
+    pthread_t thread;
+    void* bins;             /* snapshot of the bins */
+    cms_export_snapshot* snapshot;  /* copy progress of `bins`; owned by the sketch */
+    size_t value_size;      /* sizeof(int32_t), or sizeof(int64_t) for a promoted sketch */
+    uint64_t* membership;   /* snapshot of the membership filter; NULL when disabled */
+    uint64_t membership_blocks;
+    uint32_t width;
+    uint32_t depth;
+    int64_t elements_added;
+    int flags;
+    int cancelled;
+    int result;
+    char* filepath;
+    char* tmp_filepath;
+    cms_export_callback callback;
+    void* context;
+};
+
+/* counters written per fwrite by the background export; also the cancellation granularity */
+#define EXPORT_CHUNK (1U << 20)
+
+/* counters copied at once into an export snapshot, by the export thread or
+   by a writer about to change one of them */
+#define SNAPSHOT_CHUNK (1U << 16)
+#define SNAPSHOT_PENDING 0
+#define SNAPSHOT_COPYING 1
+#define SNAPSHOT_COPIED  2
+
+struct cms_export_snapshot {
+    void* dst;              /* the job's copy of the bins */
+    const void* src;        /* the sketch's bins */
+    size_t value_size;
+    uint64_t num_bins;
+    uint64_t num_chunks;
+    uint8_t* state;         /* SNAPSHOT_PENDING, _COPYING or _COPIED for each chunk */
+    int active;             /* cleared by the export thread once every chunk is copied */
+};
+
+typedef struct {
+    CountMinSketch* base;
+    CountMinSketch** sketches;
+    int num_sketches;
+} __merge_job;
+
+struct cms_coalesce_buffer {
+    uint32_t num_slots;
+    uint32_t shift;         /* 64 - log2(num_slots) */
+    uint32_t used;
+    uint64_t* tags;         /* first hash of the key in each slot */
+    uint32_t* counts;       /* pending increments; 0 marks an empty slot */
+    int32_t* estimates;     /* min of the key's counters when it entered the buffer */
+    uint32_t* columns;      /* num_slots x depth columns of the buffered keys */
+};
+
+/*  512-bit blocks; on disk the blocks are followed by their number and
+    MEMBERSHIP_MAGIC, right before the trailer */
+#define MEMBERSHIP_BLOCK_WORDS 8
+#define MEMBERSHIP_BLOCK_BITS (MEMBERSHIP_BLOCK_WORDS * 64)
+#define MEMBERSHIP_MAGIC "CMSMBR01"
+#define MEMBERSHIP_MAGIC_SIZE 8
+
+struct cms_membership_filter {
+    uint64_t num_blocks;
+    uint64_t* words;        /* num_blocks x MEMBERSHIP_BLOCK_WORDS, cache line aligned */
+};
+
+struct cms_hot_filter {
+    uint32_t capacity;
+    uint32_t used;          /* items [0, used) are valid */
+    uint32_t coldest;       /* item with the smallest count */
+    uint64_t* tags;         /* first hash of each key */
+    int64_t* counts;        /* estimate of each key */
+    int64_t* flushed;       /* part of `counts` already in the bins */
+    uint64_t* hashes;       /* capacity x depth hashes of the keys */
+};
 
 /* private functions */
 static int __setup_cms(CountMinSketch* cms, uint32_t width, uint32_t depth, double error_rate, double confidence, cms_hash_function hash_function);
 static void __write_to_file(CountMinSketch* cms, FILE *fp, short on_disk);
 static void __read_from_file(CountMinSketch* cms, FILE *fp, short on_disk, const char* filename);
-static void __merge_cms(CountMinSketch* base, int num_sketches, va_list* args);
+static int __merge_cms(CountMinSketch* base, int num_sketches, va_list* args);
+static void __merge_range(void* arg, uint64_t begin, uint64_t end);
+static void __clear_range(void* arg, uint64_t begin, uint64_t end);
+static void __for_each_bin_range(CountMinSketch* cms, cms_range_function body, void* arg);
+static __inline__ void __snapshot_touch(CountMinSketch* cms, uint64_t bin);
+static void __snapshot_copy(cms_export_snapshot* snapshot, uint64_t chunk);
+static void __snapshot_finish(CountMinSketch* cms);
+static void* __export_worker(void* arg);
+static void __free_export_job(cms_export_job* job);
+static int __fsync_parent(const char* filepath);
+static int __fold(CountMinSketch* cms, unsigned int factor, bool use_max);
+static bool __fold_overflows(const CountMinSketch* cms, uint32_t width);
 static int __validate_merge(CountMinSketch* base, int num_sketches, va_list* args);
-static uint64_t* __default_hash(unsigned int num_hashes, const char* key);
 static uint64_t __fnv_1a(const char* key, int seed);
-static int __compare(const void * a, const void * b);
+static int64_t __median(int64_t* values, unsigned int n);
+static __inline__ int64_t __sign(uint64_t hash);
+static int32_t __signed_update(CountMinSketch* cms, uint64_t* hashes, uint32_t x, int direction);
 static int32_t __safe_add(int32_t a, uint32_t b);
-static int32_t __safe_sub(int32_t a, uint32_t b);
 static int32_t __safe_add_2(int32_t a, int32_t b);
+static __inline__ void __write_begin(CountMinSketch* cms);
+static __inline__ void __write_end(CountMinSketch* cms);
+static __inline__ uint32_t __read_begin(const CountMinSketch* cms);
+static __inline__ bool __read_retry(const CountMinSketch* cms, uint32_t seq, unsigned int* attempts);
+static __inline__ int64_t __load_bin(const CountMinSketch* cms, uint64_t bin);
+static __inline__ void __store_bin(CountMinSketch* cms, uint64_t bin, int32_t val);
+static __inline__ const void* __bin_address(const CountMinSketch* cms, uint64_t bin);
+static int64_t __add_to_bin(CountMinSketch* cms, uint64_t bin, int64_t delta);
+static int __promote_begin(CountMinSketch* cms);
+static void __promote_step(CountMinSketch* cms);
+static void __promote_complete(CountMinSketch* cms);
+static int32_t __coalesce_add(CountMinSketch* cms, uint64_t* hashes, uint32_t x);
+static void __coalesce_flush_slot(CountMinSketch* cms, uint32_t slot);
+static __inline__ uint32_t __coalesce_slot(const cms_coalesce_buffer* buf, uint64_t tag);
+static __inline__ void __auto_flush(CountMinSketch* cms);
+static int64_t __check_bins(CountMinSketch* cms, uint64_t tag, const uint64_t* bins);
+static int64_t __add_bins(CountMinSketch* cms, uint64_t* hashes, uint32_t x);
+static int32_t __hot_add(CountMinSketch* cms, uint64_t* hashes, uint32_t x);
+static void __hot_flush(CountMinSketch* cms);
+static void __hot_flush_item(CountMinSketch* cms, uint32_t item);
+static __inline__ int __hot_find(const cms_hot_filter* hot, uint64_t tag);
+static void __hot_find_coldest(cms_hot_filter* hot);
+static cms_membership_filter* __membership_alloc(uint64_t num_blocks);
+static void __membership_free(cms_membership_filter* filter);
+static __inline__ uint64_t* __membership_block(const cms_membership_filter* filter, uint64_t hash, uint64_t* bits);
+static __inline__ void __membership_insert(cms_membership_filter* filter, uint64_t hash);
+static __inline__ bool __membership_contains(const cms_membership_filter* filter, uint64_t hash);
+static void __add_batch_serial(CountMinSketch* cms, const uint64_t* hashes, unsigned int num_hashes, unsigned int num_keys, const uint32_t* x);
+static int __add_batch_partitioned(CountMinSketch* cms, const uint64_t* hashes, unsigned int num_hashes, unsigned int num_keys, const uint32_t* x);
 
 // Compatibility with non-clang compilers
 #ifndef __has_builtin
@@ -58,7 +199,15 @@ int cms_init_alt(CountMinSketch* cms, uint32_t width, uint32_t depth, cms_hash_f
 }
 
 int cms_destroy(CountMinSketch* cms) {
+    __snapshot_finish(cms);
+    cms_set_coalescing(cms, 0);
+    cms_set_hot_filter(cms, 0);
+    cms_set_membership_filter(cms, 0);
     free(cms->bins);
+    free(cms->wide_bins);
+    cms->wide_bins = NULL;
+    cms->wide_migrated = 0;
+    cms->auto_promote = 0;
     cms->width = 0;
     cms->depth = 0;
     cms->confidence = 0.0;
@@ -66,16 +215,192 @@ int cms_destroy(CountMinSketch* cms) {
     cms->elements_added = 0;
     cms->hash_function = NULL;
     cms->bins = NULL;
+    cms->concurrent_reads = 0;
+    cms->sequence = 0;
+
+    return CMS_SUCCESS;
+}
+
+int cms_set_concurrent_reads(CountMinSketch* cms, int enabled) {
+    if (enabled && cms->hot != NULL) {
+        fprintf(stderr, "Concurrent reads cannot be combined with the hot item filter!\n");
+        return CMS_ERROR;
+    }
+    /* make sure readers never start from an odd (in flight) sequence */
+    cms->sequence = (cms->sequence + 1) & ~1U;
+    cms->concurrent_reads = (enabled != 0);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return CMS_SUCCESS;
+}
+
+int cms_set_coalescing(CountMinSketch* cms, unsigned int num_slots) {
+    cms_coalesce_buffer* buf = cms->coalesce;
+    if (buf != NULL) {
+        cms_flush(cms);
+        cms->coalesce = NULL;
+        free(buf->tags);
+        free(buf->counts);
+        free(buf->estimates);
+        free(buf->columns);
+        free(buf);
+    }
+    if (num_slots == 0) {
+        return CMS_SUCCESS;
+    }
+    if (cms->hot != NULL) {
+        fprintf(stderr, "Update coalescing cannot be combined with the hot item filter!\n");
+        return CMS_ERROR;
+    }
+
+    uint32_t bits = 0;
+    while ((1U << bits) < num_slots && bits < 31) {
+        ++bits;
+    }
+    buf = (cms_coalesce_buffer*)calloc(1, sizeof(cms_coalesce_buffer));
+    if (buf == NULL) {
+        fprintf(stderr, "Failed to allocate the coalescing buffer!\n");
+        return CMS_ERROR;
+    }
+    buf->num_slots = 1U << bits;
+    buf->shift = 64 - bits;
+    buf->tags = (uint64_t*)calloc(buf->num_slots, sizeof(uint64_t));
+    buf->counts = (uint32_t*)calloc(buf->num_slots, sizeof(uint32_t));
+    buf->estimates = (int32_t*)calloc(buf->num_slots, sizeof(int32_t));
+    buf->columns = (uint32_t*)calloc((size_t) buf->num_slots * cms->depth, sizeof(uint32_t));
+    if (buf->tags == NULL || buf->counts == NULL || buf->estimates == NULL || buf->columns == NULL) {
+        fprintf(stderr, "Failed to allocate the coalescing buffer!\n");
+        free(buf->tags);
+        free(buf->counts);
+        free(buf->estimates);
+        free(buf->columns);
+        free(buf);
+        return CMS_ERROR;
+    }
+    cms->coalesce = buf;
+    return CMS_SUCCESS;
+}
+
+int cms_set_hot_filter(CountMinSketch* cms, unsigned int num_items) {
+    cms_hot_filter* hot = cms->hot;
+    if (hot != NULL) {
+        __hot_flush(cms);
+        cms->hot = NULL;
+        free(hot->tags);
+        free(hot->counts);
+        free(hot->flushed);
+        free(hot->hashes);
+        free(hot);
+    }
+    if (num_items == 0) {
+        return CMS_SUCCESS;
+    }
+    if (cms->coalesce != NULL || cms->concurrent_reads) {
+        fprintf(stderr, "The hot item filter cannot be combined with update coalescing or concurrent reads!\n");
+        return CMS_ERROR;
+    }
+    if (num_items > CMS_HOT_MAX_ITEMS) {
+        num_items = CMS_HOT_MAX_ITEMS;
+    }
+    hot = (cms_hot_filter*)calloc(1, sizeof(cms_hot_filter));
+    if (hot == NULL) {
+        fprintf(stderr, "Failed to allocate the hot item filter!\n");
+        return CMS_ERROR;
+    }
+    hot->capacity = num_items;
+    hot->tags = (uint64_t*)calloc(num_items, sizeof(uint64_t));
+    hot->counts = (int64_t*)calloc(num_items, sizeof(int64_t));
+    hot->flushed = (int64_t*)calloc(num_items, sizeof(int64_t));
+    hot->hashes = (uint64_t*)calloc((size_t) num_items * cms->depth, sizeof(uint64_t));
+    if (hot->tags == NULL || hot->counts == NULL || hot->flushed == NULL || hot->hashes == NULL) {
+        fprintf(stderr, "Failed to allocate the hot item filter!\n");
+        free(hot->tags);
+        free(hot->counts);
+        free(hot->flushed);
+        free(hot->hashes);
+        free(hot);
+        return CMS_ERROR;
+    }
+    cms->hot = hot;
+    return CMS_SUCCESS;
+}
+
+int cms_set_auto_promote(CountMinSketch* cms, int enabled) {
+    cms->auto_promote = (enabled != 0);
+    return CMS_SUCCESS;
+}
+
+int cms_set_membership_filter(CountMinSketch* cms, unsigned int num_keys) {
+    if (num_keys == 0) {
+        if (cms->membership != NULL) {
+            __membership_free(cms->membership);
+            cms->membership = NULL;
+        }
+        return CMS_SUCCESS;
+    }
+    /* on failure the current filter (if any) stays in place */
+    cms_flush(cms);
+    uint64_t num_bins = (uint64_t) cms->width * cms->depth;
+    for (uint64_t bin = 0; bin < num_bins; ++bin) {
+        if (__load_bin(cms, bin) != 0) {
+            fprintf(stderr, "The membership filter can only be added to an empty count-min sketch!\n");
+            return CMS_ERROR;
+        }
+    }
+    uint64_t num_bits = (uint64_t) num_keys * CMS_MEMBERSHIP_BITS_PER_KEY;
+    cms_membership_filter* filter = __membership_alloc((num_bits + MEMBERSHIP_BLOCK_BITS - 1) / MEMBERSHIP_BLOCK_BITS);
+    if (filter == NULL) {
+        return CMS_ERROR;
+    }
+    if (cms->membership != NULL) {
+        __membership_free(cms->membership);
+    }
+    cms->membership = filter;
+    return CMS_SUCCESS;
+}
+
+int cms_flush(CountMinSketch* cms) {
+    if (cms->hot != NULL) {
+        __hot_flush(cms);
+    }
+    cms_coalesce_buffer* buf = cms->coalesce;
+    if (buf == NULL || buf->used == 0) {
+        return CMS_SUCCESS;
+    }
+    for (uint32_t slot = 0; slot < buf->num_slots && buf->used > 0; ++slot) {
+        if (buf->counts[slot] != 0) {
+            __coalesce_flush_slot(cms, slot);
+        }
+    }
+    return CMS_SUCCESS;
+}
 
+int cms_add_elements(CountMinSketch* cms, int64_t x) {
+    __write_begin(cms);
+    __atomic_store_n(&cms->elements_added, cms->elements_added + x, __ATOMIC_RELAXED);
+    __write_end(cms);
     return CMS_SUCCESS;
 }
 
 int cms_clear(CountMinSketch* cms) {
-    uint32_t i, j = cms->width * cms->depth;
-    for (i = 0; i < j; ++i) {
-        cms->bins[i] = 0;
+    if (cms->coalesce != NULL) {
+        memset(cms->coalesce->counts, 0, cms->coalesce->num_slots * sizeof(uint32_t));
+        cms->coalesce->used = 0;
     }
-    cms->elements_added = 0;
+    if (cms->hot != NULL) {
+        cms->hot->used = 0;
+        cms->hot->coldest = 0;
+    }
+    __snapshot_finish(cms);
+    __write_begin(cms);
+    if (cms->membership != NULL) {
+        uint64_t num_words = cms->membership->num_blocks * MEMBERSHIP_BLOCK_WORDS;
+        for (uint64_t i = 0; i < num_words; ++i) {
+            __atomic_store_n(&cms->membership->words[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+    __for_each_bin_range(cms, __clear_range, cms);
+    __atomic_store_n(&cms->elements_added, 0, __ATOMIC_RELAXED);
+    __write_end(cms);
     return CMS_SUCCESS;
 }
 
@@ -84,17 +409,76 @@ int32_t cms_add_inc_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_
         fprintf(stderr, "Insufficient hashes to complete the addition of the element to the count-min sketch!");
         return CMS_ERROR;
     }
-    int num_add = INT32_MAX;
-    for (unsigned int i = 0; i < cms->depth; ++i) {
-        uint64_t bin = (hashes[i] % cms->width) + (i * cms->width);
-        cms->bins[bin] = __safe_add(cms->bins[bin], x);
-        /* currently a standard min strategy */
-        if (cms->bins[bin] < num_add) {
-            num_add = cms->bins[bin];
+    if (cms->membership != NULL) {
+        __membership_insert(cms->membership, hashes[0]);
+    }
+    if (cms->coalesce != NULL && x != 0) {
+        return __coalesce_add(cms, hashes, x);
+    }
+    if (cms->hot != NULL && x != 0) {
+        return __hot_add(cms, hashes, x);
+    }
+    return __clamp_int32(__add_bins(cms, hashes, x));
+}
+
+int cms_add_inc_batch_alt(CountMinSketch* cms, const uint64_t* hashes, unsigned int num_hashes, unsigned int num_keys, const uint32_t* x) {
+    if (num_hashes < cms->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the batch addition of the elements to the count-min sketch!");
+        return CMS_ERROR;
+    }
+    if (cms->hot != NULL) {
+        for (unsigned int k = 0; k < num_keys; ++k) {
+            cms_add_inc_alt(cms, (uint64_t*) hashes + ((size_t) k * num_hashes), num_hashes, (x == NULL) ? 1 : x[k]);
         }
+        return CMS_SUCCESS;
     }
-    cms->elements_added += x;
-    return num_add;
+    if (cms->membership != NULL) {
+        for (unsigned int k = 0; k < num_keys; ++k) {
+            __membership_insert(cms->membership, hashes[(size_t) k * num_hashes]);
+        }
+    }
+    /* partitions apply a key's rows at different times, so readers running
+       alongside the writer get the serial path, which applies each key in
+       one write section */
+    uint64_t num_bins = (uint64_t) cms->width * cms->depth;
+    uint64_t num_updates = (uint64_t) num_keys * cms->depth;
+    if (cms->concurrent_reads || num_bins < CMS_RADIX_MIN_BINS || num_updates < CMS_RADIX_MIN_UPDATES || num_updates > UINT32_MAX
+            || __add_batch_partitioned(cms, hashes, num_hashes, num_keys, x) == CMS_ERROR) {
+        __add_batch_serial(cms, hashes, num_hashes, num_keys, x);
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_add_inc_batch(CountMinSketch* cms, const char** keys, unsigned int num_keys, const uint32_t* x) {
+    uint64_t* hashes = (uint64_t*)malloc((size_t) num_keys * cms->depth * sizeof(uint64_t));
+    if (hashes == NULL) {
+        fprintf(stderr, "Failed to allocate the hashes for the batch addition!\n");
+        return CMS_ERROR;
+    }
+    for (unsigned int k = 0; k < num_keys; ++k) {
+        uint64_t* key_hashes = cms_get_hashes(cms, keys[k]);
+        memcpy(hashes + ((size_t) k * cms->depth), key_hashes, cms->depth * sizeof(uint64_t));
+        free(key_hashes);
+    }
+    int res = cms_add_inc_batch_alt(cms, hashes, cms->depth, num_keys, x);
+    free(hashes);
+    return res;
+}
+
+int cms_add_row_inc(CountMinSketch* cms, unsigned int row, const uint32_t* columns, const uint32_t* x, unsigned int num_updates) {
+    if (row >= cms->depth) {
+        fprintf(stderr, "Row %u is out of range for a count-min sketch of depth %u!\n", row, cms->depth);
+        return CMS_ERROR;
+    }
+    if (cms->membership != NULL) {
+        fprintf(stderr, "Row updates cannot maintain the membership filter of the count-min sketch!\n");
+        return CMS_ERROR;
+    }
+    uint64_t offset = (uint64_t) row * cms->width;
+    for (unsigned int i = 0; i < num_updates; ++i) {
+        __add_to_bin(cms, offset + columns[i], (x == NULL) ? 1 : x[i]);
+    }
+    return CMS_SUCCESS;
 }
 
 int32_t cms_add_inc(CountMinSketch* cms, const char* key, unsigned int x) {
@@ -109,16 +493,41 @@ int32_t cms_remove_inc_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int n
         fprintf(stderr, "Insufficient hashes to complete the removal of the element to the count-min sketch!");
         return CMS_ERROR;
     }
-    int32_t num_add = INT32_MAX;
+    if (cms->membership != NULL) {
+        /* a removed key's (negative) counts must stay visible */
+        __membership_insert(cms->membership, hashes[0]);
+    }
+    if (cms->coalesce != NULL) {
+        /* pending increments of the key must land before it is decremented */
+        uint32_t slot = __coalesce_slot(cms->coalesce, hashes[0]);
+        if (cms->coalesce->counts[slot] != 0 && cms->coalesce->tags[slot] == hashes[0]) {
+            __coalesce_flush_slot(cms, slot);
+        }
+    }
+    if (cms->hot != NULL) {
+        int item = __hot_find(cms->hot, hashes[0]);
+        if (item >= 0) {
+            cms->hot->counts[item] -= x;
+            cms->elements_added -= x;
+            if (cms->hot->counts[item] < cms->hot->counts[cms->hot->coldest]) {
+                cms->hot->coldest = (uint32_t) item;
+            }
+            return __clamp_int32(cms->hot->counts[item]);
+        }
+    }
+    int64_t num_add = INT64_MAX;
+    __write_begin(cms);
     for (unsigned int i = 0; i < cms->depth; ++i) {
-        uint32_t bin = (hashes[i] % cms->width) + (i * cms->width);
-        cms->bins[bin] = __safe_sub(cms->bins[bin], x);
-        if (cms->bins[bin] < num_add) {
-            num_add = cms->bins[bin];
+        uint64_t bin = (hashes[i] % cms->width) + ((uint64_t) i * cms->width);
+        int64_t val = __add_to_bin(cms, bin, -(int64_t) x);
+        if (val < num_add) {
+            num_add = val;
         }
     }
-    cms->elements_added -= x;
-    return num_add;
+    __atomic_store_n(&cms->elements_added, cms->elements_added - x, __ATOMIC_RELAXED);
+    __promote_step(cms);
+    __write_end(cms);
+    return __clamp_int32(num_add);
 }
 
 int32_t cms_remove_inc(CountMinSketch* cms, const char* key, uint32_t x) {
@@ -129,20 +538,45 @@ int32_t cms_remove_inc(CountMinSketch* cms, const char* key, uint32_t x) {
 }
 
 int32_t cms_check_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes) {
+    return __clamp_int32(cms_check_wide_alt(cms, hashes, num_hashes));
+}
+
+int64_t cms_check_wide_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes) {
     if (num_hashes < cms->depth) {
         fprintf(stderr, "Insufficient hashes to complete the min lookup of the element to the count-min sketch!");
         return CMS_ERROR;
     }
-    int32_t num_add = INT32_MAX;
+    if (cms->membership != NULL && !__membership_contains(cms->membership, hashes[0])) {
+        return 0;
+    }
+    __auto_flush(cms);
+    uint64_t stack_bins[CMS_STACK_DEPTH];
+    uint64_t* bins = (cms->depth <= CMS_STACK_DEPTH) ? stack_bins : (uint64_t*)malloc(cms->depth * sizeof(uint64_t));
+    if (bins == NULL) {
+        fprintf(stderr, "Failed to allocate the min lookup!\n");
+        return CMS_ERROR;
+    }
     for (unsigned int i = 0; i < cms->depth; ++i) {
-        uint32_t bin = (hashes[i] % cms->width) + (i * cms->width);
-        if (cms->bins[bin] < num_add) {
-            num_add = cms->bins[bin];
-        }
+        bins[i] = (hashes[i] % cms->width) + ((uint64_t) i * cms->width);
+    }
+    int64_t num_add = __check_bins(cms, hashes[0], bins);
+    if (bins != stack_bins) {
+        free(bins);
     }
     return num_add;
 }
 
+int64_t cms_check_wide(CountMinSketch* cms, const char* key) {
+    uint64_t* hashes = cms_get_hashes(cms, key);
+    int64_t num_add = cms_check_wide_alt(cms, hashes, cms->depth);
+    free(hashes);
+    return num_add;
+}
+
+int64_t cms_get_bin(const CountMinSketch* cms, uint64_t bin) {
+    return __load_bin(cms, bin);
+}
+
 int32_t cms_check(CountMinSketch* cms, const char* key) {
     uint64_t* hashes = cms_get_hashes(cms, key);
 //    for(int i = 0; i < cms->depth; i++) printf("%"PRIu32" " ,hashes[i]);
@@ -152,17 +586,105 @@ int32_t cms_check(CountMinSketch* cms, const char* key) {
     return num_add;
 }
 
+int cms_check_prefetch_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes) {
+    if (num_hashes < cms->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the prefetch of the element in the count-min sketch!");
+        return CMS_ERROR;
+    }
+    for (unsigned int i = 0; i < cms->depth; ++i) {
+        CMS_PREFETCH_READ(__bin_address(cms, (hashes[i] % cms->width) + ((uint64_t) i * cms->width)));
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_check_batch_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes, unsigned int num_keys, int32_t* results) {
+    if (num_hashes < cms->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the batch lookup of the elements in the count-min sketch!");
+        return CMS_ERROR;
+    }
+    __auto_flush(cms);
+    /* the counter indices of a group are computed once, in stage 1 */
+    uint64_t stack_bins[CMS_CHECK_GROUP_SIZE * CMS_STACK_DEPTH];
+    uint64_t* bins = (cms->depth <= CMS_STACK_DEPTH) ? stack_bins : (uint64_t*)malloc((size_t) CMS_CHECK_GROUP_SIZE * cms->depth * sizeof(uint64_t));
+    if (bins == NULL) {
+        fprintf(stderr, "Failed to allocate the batch lookup!\n");
+        return CMS_ERROR;
+    }
+    bool present[CMS_CHECK_GROUP_SIZE];
+    for (unsigned int start = 0; start < num_keys; start += CMS_CHECK_GROUP_SIZE) {
+        unsigned int end = (num_keys - start < CMS_CHECK_GROUP_SIZE) ? num_keys : start + CMS_CHECK_GROUP_SIZE;
+        if (cms->membership != NULL) {
+            /* stage 0: the filter blocks first, so absent keys never fetch their counters */
+            uint64_t bits[CMS_MEMBERSHIP_HASHES];
+            for (unsigned int k = start; k < end; ++k) {
+                CMS_PREFETCH_READ(__membership_block(cms->membership, hashes[(size_t) k * num_hashes], bits));
+            }
+            for (unsigned int k = start; k < end; ++k) {
+                present[k - start] = __membership_contains(cms->membership, hashes[(size_t) k * num_hashes]);
+            }
+        } else {
+            memset(present, 1, sizeof(present));
+        }
+        /* stage 1: get every counter of the group in flight */
+        for (unsigned int k = start; k < end; ++k) {
+            if (present[k - start]) {
+                const uint64_t* key_hashes = hashes + ((size_t) k * num_hashes);
+                uint64_t* key_bins = bins + ((size_t) (k - start) * cms->depth);
+                for (unsigned int i = 0; i < cms->depth; ++i) {
+                    key_bins[i] = (key_hashes[i] % cms->width) + ((uint64_t) i * cms->width);
+                    CMS_PREFETCH_READ(__bin_address(cms, key_bins[i]));
+                }
+            }
+        }
+        /* stage 2: by now the first lookups' counters have arrived */
+        for (unsigned int k = start; k < end; ++k) {
+            results[k] = (!present[k - start]) ? 0
+                    : __clamp_int32(__check_bins(cms, hashes[(size_t) k * num_hashes], bins + ((size_t) (k - start) * cms->depth)));
+        }
+    }
+    if (bins != stack_bins) {
+        free(bins);
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_check_batch(CountMinSketch* cms, const char** keys, unsigned int num_keys, int32_t* results) {
+    uint64_t* hashes = (uint64_t*)malloc((size_t) num_keys * cms->depth * sizeof(uint64_t));
+    if (hashes == NULL) {
+        fprintf(stderr, "Failed to allocate the hashes for the batch lookup!\n");
+        return CMS_ERROR;
+    }
+    for (unsigned int k = 0; k < num_keys; ++k) {
+        uint64_t* key_hashes = cms_get_hashes(cms, keys[k]);
+        memcpy(hashes + ((size_t) k * cms->depth), key_hashes, cms->depth * sizeof(uint64_t));
+        free(key_hashes);
+    }
+    int res = cms_check_batch_alt(cms, hashes, cms->depth, num_keys, results);
+    free(hashes);
+    return res;
+}
+
 int32_t cms_check_mean_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes) {
     if (num_hashes < cms->depth) {
         fprintf(stderr, "Insufficient hashes to complete the mean lookup of the element to the count-min sketch!");
         return CMS_ERROR;
     }
-    int32_t num_add = 0;
-    for (unsigned int i = 0; i < cms->depth; ++i) {
-        uint32_t bin = (hashes[i] % cms->width) + (i * cms->width);
-        num_add += cms->bins[bin];
+    __auto_flush(cms);
+    if (cms->hot != NULL) {
+        __hot_flush(cms);
     }
-    return num_add / cms->depth;
+    int64_t num_add;
+    unsigned int attempts = 0;
+    uint32_t seq;
+    do {
+        seq = __read_begin(cms);
+        num_add = 0;
+        for (unsigned int i = 0; i < cms->depth; ++i) {
+            uint64_t bin = (hashes[i] % cms->width) + ((uint64_t) i * cms->width);
+            num_add += __load_bin(cms, bin);
+        }
+    } while (__read_retry(cms, seq, &attempts));
+    return __clamp_int32(num_add / cms->depth);
 }
 
 int32_t cms_check_mean(CountMinSketch* cms, const char* key) {
@@ -177,22 +699,28 @@ int32_t cms_check_mean_min_alt(CountMinSketch* cms, uint64_t* hashes, unsigned i
         fprintf(stderr, "Insufficient hashes to complete the mean-min lookup of the element to the count-min sketch!");
         return CMS_ERROR;
     }
-    int32_t num_add = 0;
-    int64_t* mean_min_values = (int64_t*)calloc(cms->depth, sizeof(int64_t));
-    for (unsigned int i = 0; i < cms->depth; ++i) {
-        uint32_t bin = (hashes[i] % cms->width) + (i * cms->width);
-        int32_t val = cms->bins[bin];
-        mean_min_values[i] = val - ((cms->elements_added - val) / (cms->width - 1));
+    __auto_flush(cms);
+    if (cms->hot != NULL) {
+        __hot_flush(cms);
     }
-    // return the median of the mean_min_value array... need to sort first
-    qsort(mean_min_values, cms->depth, sizeof(int64_t), __compare);
-    int32_t n = cms->depth;
-    if (n % 2 == 0) {
-        num_add = (mean_min_values[n/2] + mean_min_values[n/2 - 1]) / 2;
-    } else {
-        num_add = mean_min_values[n/2];
+    int64_t stack_values[CMS_STACK_DEPTH];
+    int64_t* mean_min_values = (cms->depth <= CMS_STACK_DEPTH) ? stack_values : (int64_t*)calloc(cms->depth, sizeof(int64_t));
+    unsigned int attempts = 0;
+    uint32_t seq;
+    do {
+        seq = __read_begin(cms);
+        int64_t elements_added = __atomic_load_n(&cms->elements_added, __ATOMIC_RELAXED);
+        for (unsigned int i = 0; i < cms->depth; ++i) {
+            uint64_t bin = (hashes[i] % cms->width) + ((uint64_t) i * cms->width);
+            int64_t val = __load_bin(cms, bin);
+            mean_min_values[i] = val - ((elements_added - val) / (cms->width - 1));
+        }
+    } while (__read_retry(cms, seq, &attempts));
+    // return the median of the mean_min_value array
+    int32_t num_add = __clamp_int32(__median(mean_min_values, cms->depth));
+    if (mean_min_values != stack_values) {
+        free(mean_min_values);
     }
-    free(mean_min_values);
     return num_add;
 }
 
@@ -203,10 +731,133 @@ int32_t cms_check_mean_min(CountMinSketch* cms, const char* key) {
     return num_add;
 }
 
+int32_t cms_signed_add_inc_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes, uint32_t x) {
+    if (num_hashes < cms->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the addition of the element to the count sketch!");
+        return CMS_ERROR;
+    }
+    if (cms->hot != NULL) {
+        fprintf(stderr, "The signed (count sketch) functions cannot be combined with the hot item filter!\n");
+        return CMS_ERROR;
+    }
+    return __signed_update(cms, hashes, x, 1);
+}
+
+int32_t cms_signed_add_inc(CountMinSketch* cms, const char* key, uint32_t x) {
+    uint64_t* hashes = cms_get_hashes(cms, key);
+    int32_t num_add = cms_signed_add_inc_alt(cms, hashes, cms->depth, x);
+    free(hashes);
+    return num_add;
+}
+
+int32_t cms_signed_remove_inc_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes, uint32_t x) {
+    if (num_hashes < cms->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the removal of the element from the count sketch!");
+        return CMS_ERROR;
+    }
+    if (cms->hot != NULL) {
+        fprintf(stderr, "The signed (count sketch) functions cannot be combined with the hot item filter!\n");
+        return CMS_ERROR;
+    }
+    return __signed_update(cms, hashes, x, -1);
+}
+
+int32_t cms_signed_remove_inc(CountMinSketch* cms, const char* key, uint32_t x) {
+    uint64_t* hashes = cms_get_hashes(cms, key);
+    int32_t num_add = cms_signed_remove_inc_alt(cms, hashes, cms->depth, x);
+    free(hashes);
+    return num_add;
+}
+
+int32_t cms_check_median_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes) {
+    if (num_hashes < cms->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the median lookup of the element in the count sketch!");
+        return CMS_ERROR;
+    }
+    if (cms->hot != NULL) {
+        fprintf(stderr, "The signed (count sketch) functions cannot be combined with the hot item filter!\n");
+        return CMS_ERROR;
+    }
+    int64_t stack_values[CMS_STACK_DEPTH];
+    int64_t* values = (cms->depth <= CMS_STACK_DEPTH) ? stack_values : (int64_t*)malloc(cms->depth * sizeof(int64_t));
+    if (values == NULL) {
+        fprintf(stderr, "Failed to allocate the median lookup!\n");
+        return CMS_ERROR;
+    }
+    unsigned int attempts = 0;
+    uint32_t seq;
+    do {
+        seq = __read_begin(cms);
+        for (unsigned int i = 0; i < cms->depth; ++i) {
+            uint64_t bin = (hashes[i] % cms->width) + ((uint64_t) i * cms->width);
+            values[i] = __sign(hashes[i]) * __load_bin(cms, bin);
+        }
+    } while (__read_retry(cms, seq, &attempts));
+    int32_t num_add = __clamp_int32(__median(values, cms->depth));
+    if (values != stack_values) {
+        free(values);
+    }
+    return num_add;
+}
+
+int32_t cms_check_median(CountMinSketch* cms, const char* key) {
+    uint64_t* hashes = cms_get_hashes(cms, key);
+    int32_t num_add = cms_check_median_alt(cms, hashes, cms->depth);
+    free(hashes);
+    return num_add;
+}
+
+int cms_check_median_batch_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes, unsigned int num_keys, int32_t* results) {
+    if (num_hashes < cms->depth) {
+        fprintf(stderr, "Insufficient hashes to complete the batch lookup of the elements in the count sketch!");
+        return CMS_ERROR;
+    }
+    if (cms->hot != NULL) {
+        fprintf(stderr, "The signed (count sketch) functions cannot be combined with the hot item filter!\n");
+        return CMS_ERROR;
+    }
+    for (unsigned int start = 0; start < num_keys; start += CMS_CHECK_GROUP_SIZE) {
+        unsigned int end = (num_keys - start < CMS_CHECK_GROUP_SIZE) ? num_keys : start + CMS_CHECK_GROUP_SIZE;
+        for (unsigned int k = start; k < end; ++k) {
+            cms_check_prefetch_alt(cms, hashes + ((size_t) k * num_hashes), num_hashes);
+        }
+        for (unsigned int k = start; k < end; ++k) {
+            results[k] = cms_check_median_alt(cms, hashes + ((size_t) k * num_hashes), num_hashes);
+        }
+    }
+    return CMS_SUCCESS;
+}
+
+int cms_check_median_batch(CountMinSketch* cms, const char** keys, unsigned int num_keys, int32_t* results) {
+    uint64_t* hashes = (uint64_t*)malloc((size_t) num_keys * cms->depth * sizeof(uint64_t));
+    if (hashes == NULL) {
+        fprintf(stderr, "Failed to allocate the hashes for the batch lookup!\n");
+        return CMS_ERROR;
+    }
+    for (unsigned int k = 0; k < num_keys; ++k) {
+        uint64_t* key_hashes = cms_get_hashes(cms, keys[k]);
+        memcpy(hashes + ((size_t) k * cms->depth), key_hashes, cms->depth * sizeof(uint64_t));
+        free(key_hashes);
+    }
+    int res = cms_check_median_batch_alt(cms, hashes, cms->depth, num_keys, results);
+    free(hashes);
+    return res;
+}
+
 uint64_t* cms_get_hashes_alt(CountMinSketch* cms, unsigned int num_hashes, const char* key) {
     return cms->hash_function(num_hashes, key);
 }
 
+/* NOTE: The caller will free the results */
+uint64_t* cms_default_hash(unsigned int num_hashes, const char* str) {
+    uint64_t* results = (uint64_t*)calloc(num_hashes, sizeof(uint64_t));
+    int i;
+    for (i = 0; i < num_hashes; ++i) {
+        results[i] = __fnv_1a(str, i);
+    }
+    return results;
+}
+
 int cms_export(CountMinSketch* cms, const char* filepath) {
     FILE *fp;
     fp = fopen(filepath, "w+b");
@@ -214,11 +865,88 @@ int cms_export(CountMinSketch* cms, const char* filepath) {
         fprintf(stderr, "Can't open file %s!\n", filepath);
         return CMS_ERROR;
     }
+    cms_flush(cms);
     __write_to_file(cms, fp, 0);
     fclose(fp);
     return CMS_SUCCESS;
 }
 
+cms_export_job* cms_export_async(CountMinSketch* cms, const char* filepath, int flags, cms_export_callback callback, void* context) {
+    cms_export_job* job = (cms_export_job*)calloc(1, sizeof(cms_export_job));
+    if (job == NULL) {
+        fprintf(stderr, "Failed to allocate the export job!\n");
+        return NULL;
+    }
+    size_t len = strlen(filepath);
+    job->filepath = (char*)malloc(len + 1);
+    job->tmp_filepath = (char*)malloc(len + 5);
+    /* a promoted sketch is written with its 64-bit counters */
+    cms_flush(cms);
+    __promote_complete(cms);
+    __snapshot_finish(cms);
+    uint64_t num_bins = (uint64_t) cms->width * cms->depth;
+    job->value_size = (cms->wide_bins != NULL) ? sizeof(int64_t) : sizeof(int32_t);
+    job->bins = malloc((size_t) num_bins * job->value_size);
+    job->snapshot = (cms_export_snapshot*)calloc(1, sizeof(cms_export_snapshot));
+    if (job->snapshot != NULL) {
+        job->snapshot->num_chunks = (num_bins + SNAPSHOT_CHUNK - 1) / SNAPSHOT_CHUNK;
+        job->snapshot->state = (uint8_t*)calloc(job->snapshot->num_chunks, sizeof(uint8_t));
+    }
+    if (job->filepath == NULL || job->tmp_filepath == NULL || job->bins == NULL || job->snapshot == NULL || job->snapshot->state == NULL) {
+        fprintf(stderr, "Failed to allocate %zu bytes for the export snapshot!\n", ((size_t) cms->width * cms->depth * job->value_size));
+        __free_export_job(job);
+        return NULL;
+    }
+    memcpy(job->filepath, filepath, len + 1);
+    sprintf(job->tmp_filepath, "%s.tmp", filepath);
+    job->flags = flags;
+    job->callback = callback;
+    job->context = context;
+
+    /* the caller is the writer, so nothing changes between here and
+       publishing the snapshot; the export thread then copies the bins */
+    job->width = cms->width;
+    job->depth = cms->depth;
+    job->elements_added = cms->elements_added;
+    job->snapshot->dst = job->bins;
+    job->snapshot->src = (cms->wide_bins != NULL) ? (const void*) cms->wide_bins : (const void*) cms->bins;
+    job->snapshot->value_size = job->value_size;
+    job->snapshot->num_bins = num_bins;
+    job->snapshot->active = 1;
+    if (cms->membership != NULL) {
+        size_t membership_bytes = cms->membership->num_blocks * MEMBERSHIP_BLOCK_WORDS * sizeof(uint64_t);
+        job->membership = (uint64_t*)malloc(membership_bytes);
+        if (job->membership == NULL) {
+            fprintf(stderr, "Failed to allocate %zu bytes for the export snapshot!\n", membership_bytes);
+            __free_export_job(job);
+            return NULL;
+        }
+        memcpy(job->membership, cms->membership->words, membership_bytes);
+        job->membership_blocks = cms->membership->num_blocks;
+    }
+
+    __atomic_store_n(&cms->snapshot, job->snapshot, __ATOMIC_RELEASE);
+    if (pthread_create(&job->thread, NULL, __export_worker, job) != 0) {
+        fprintf(stderr, "Failed to start the export thread!\n");
+        __atomic_store_n(&cms->snapshot, NULL, __ATOMIC_RELAXED);
+        __free_export_job(job);
+        return NULL;
+    }
+    return job;
+}
+
+int cms_export_wait(cms_export_job* job) {
+    pthread_join(job->thread, NULL);
+    int res = job->result;
+    __free_export_job(job);
+    return res;
+}
+
+int cms_export_cancel(cms_export_job* job) {
+    __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELAXED);
+    return CMS_SUCCESS;
+}
+
 int cms_import_alt(CountMinSketch* cms, const char* filepath, cms_hash_function hash_function) {
     FILE *fp;
     fp = fopen(filepath, "r+b");
@@ -227,7 +955,11 @@ int cms_import_alt(CountMinSketch* cms, const char* filepath, cms_hash_function
         return CMS_ERROR;
     }
     __read_from_file(cms, fp, 0, NULL);
-    cms->hash_function = (hash_function == NULL) ? __default_hash : hash_function;
+    cms->concurrent_reads = 0;
+    cms->sequence = 0;
+    cms->coalesce = NULL;
+    cms->hot = NULL;
+    cms->hash_function = (hash_function == NULL) ? cms_default_hash : hash_function;
     fclose(fp);
     return CMS_SUCCESS;
 }
@@ -251,13 +983,25 @@ int cms_merge(CountMinSketch* cms, int num_sketches, ...) {
         va_end(ap);
         return CMS_ERROR;
     }
+    if (base->membership != NULL) {
+        /* validated above: every sketch has a filter of this size */
+        cms->membership = __membership_alloc(base->membership->num_blocks);
+        if (cms->membership == NULL) {
+            cms_destroy(cms);
+            va_end(ap);
+            return CMS_ERROR;
+        }
+    }
     va_end(ap);
 
     va_start(ap, num_sketches);
-    __merge_cms(cms, num_sketches, &ap);
+    res = __merge_cms(cms, num_sketches, &ap);
     va_end(ap);
+    if (res == CMS_ERROR) {
+        cms_destroy(cms);
+    }
 
-    return CMS_SUCCESS;
+    return res;
 }
 
 int cms_merge_into(CountMinSketch* cms, int num_sketches, ...) {
@@ -273,26 +1017,123 @@ int cms_merge_into(CountMinSketch* cms, int num_sketches, ...) {
 
     /* merge */
     va_start(ap, num_sketches);
-    __merge_cms(cms, num_sketches, &ap);
+    res = __merge_cms(cms, num_sketches, &ap);
     va_end(ap);
 
-    return CMS_SUCCESS;
+    return res;
+}
+
+int cms_fold(CountMinSketch* cms, unsigned int factor) {
+    return __fold(cms, factor, false);
+}
+
+int cms_fold_max(CountMinSketch* cms, unsigned int factor) {
+    return __fold(cms, factor, true);
 }
 
 
 /*******************************************************************************
 *    PRIVATE FUNCTIONS
 *******************************************************************************/
-static int __setup_cms(CountMinSketch* cms, unsigned int width, unsigned int depth, double error_rate, double confidence, cms_hash_function hash_function) {
-    cms->width = width;
-    cms->depth = depth;
-    cms->confidence = confidence;
-    cms->error_rate = error_rate;
-    cms->elements_added = 0;
-    cms->bins = (int32_t*)calloc((width * depth), sizeof(int32_t));
-    cms->hash_function = (hash_function == NULL) ? __default_hash : hash_function;
-
-    if (NULL == cms->bins) {
+static int __fold(CountMinSketch* cms, unsigned int factor, bool use_max) {
+    if (factor == 0 || cms->width % factor != 0) {
+        fprintf(stderr, "Unable to fold a count-min sketch of width %u by %u!\n", cms->width, factor);
+        return CMS_ERROR;
+    }
+    if (factor == 1) {
+        return CMS_SUCCESS;
+    }
+    cms_flush(cms);
+    __snapshot_finish(cms);
+    uint32_t width = cms->width / factor;
+    if (!use_max && cms->auto_promote && cms->wide_bins == NULL && __fold_overflows(cms, width)
+            && __promote_begin(cms) == CMS_ERROR) {
+        return CMS_ERROR;
+    }
+    if (cms->wide_bins != NULL) {
+        __promote_complete(cms);
+        for (uint64_t i = 0; i < cms->depth; ++i) {
+            int64_t* row = cms->wide_bins + (i * cms->width);
+            for (uint32_t k = 1; k < factor; ++k) {
+                const int64_t* src = row + (k * width);
+                for (uint32_t j = 0; j < width; ++j) {
+                    row[j] = use_max ? ((src[j] > row[j]) ? src[j] : row[j]) : row[j] + src[j];
+                }
+            }
+            memmove(cms->wide_bins + (i * width), row, width * sizeof(int64_t));
+        }
+        int64_t* wide_bins = (int64_t*)realloc(cms->wide_bins, ((uint64_t) width * cms->depth) * sizeof(int64_t));
+        if (wide_bins != NULL) {
+            cms->wide_bins = wide_bins;
+        }
+        cms->wide_migrated = (uint64_t) width * cms->depth;
+        cms->width = width;
+        cms->error_rate = 2 / (double) width;
+        return CMS_SUCCESS;
+    }
+    for (uint64_t i = 0; i < cms->depth; ++i) {
+        /* fold the row onto its first `width` columns, then move it down;
+           the new row ends before the next old row starts */
+        int32_t* row = cms->bins + (i * cms->width);
+        for (uint32_t k = 1; k < factor; ++k) {
+            const int32_t* src = row + (k * width);
+            if (use_max) {
+                for (uint32_t j = 0; j < width; ++j) {
+                    row[j] = (src[j] > row[j]) ? src[j] : row[j];
+                }
+            } else {
+                for (uint32_t j = 0; j < width; ++j) {
+                    row[j] = __safe_add_2(row[j], src[j]);
+                }
+            }
+        }
+        memmove(cms->bins + (i * width), row, width * sizeof(int32_t));
+    }
+    int32_t* bins = (int32_t*)realloc(cms->bins, ((uint64_t) width * cms->depth) * sizeof(int32_t));
+    if (bins != NULL) {
+        cms->bins = bins;   /* a failed shrink leaves the old allocation in place */
+    }
+    cms->width = width;
+    cms->error_rate = 2 / (double) width;
+    return CMS_SUCCESS;
+}
+
+/* whether summing the columns of a narrow sketch down to `width` saturates a counter */
+static bool __fold_overflows(const CountMinSketch* cms, uint32_t width) {
+    for (uint64_t i = 0; i < cms->depth; ++i) {
+        const int32_t* row = cms->bins + (i * cms->width);
+        for (uint32_t j = 0; j < width; ++j) {
+            int64_t sum = 0;
+            for (uint32_t k = j; k < cms->width; k += width) {
+                sum += row[k];
+            }
+            if (sum >= INT32_MAX || sum <= INT32_MIN) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static int __setup_cms(CountMinSketch* cms, unsigned int width, unsigned int depth, double error_rate, double confidence, cms_hash_function hash_function) {
+    cms->width = width;
+    cms->depth = depth;
+    cms->confidence = confidence;
+    cms->error_rate = error_rate;
+    cms->elements_added = 0;
+    cms->concurrent_reads = 0;
+    cms->sequence = 0;
+    cms->coalesce = NULL;
+    cms->hot = NULL;
+    cms->wide_bins = NULL;
+    cms->wide_migrated = 0;
+    cms->auto_promote = 0;
+    cms->membership = NULL;
+    cms->snapshot = NULL;
+    cms->bins = (int32_t*)calloc((width * depth), sizeof(int32_t));
+    cms->hash_function = (hash_function == NULL) ? cms_default_hash : hash_function;
+
+    if (NULL == cms->bins) {
         fprintf(stderr, "Failed to allocate %zu bytes for bins!", ((width * depth) * sizeof(int32_t)));
         return CMS_ERROR;
     }
@@ -301,7 +1142,12 @@ static int __setup_cms(CountMinSketch* cms, unsigned int width, unsigned int dep
 
 static void __write_to_file(CountMinSketch* cms, FILE *fp, short on_disk) {
     unsigned long long length = cms->depth * cms->width;
-    if (on_disk == 0) {
+    if (on_disk == 0 && cms->wide_bins != NULL) {
+        __promote_complete(cms);
+        for (unsigned long long i = 0; i < length; ++i) {
+            fwrite(&cms->wide_bins[i], sizeof(int64_t), 1, fp);
+        }
+    } else if (on_disk == 0) {
         for (unsigned long long i = 0; i < length; ++i) {
             fwrite(&cms->bins[i], sizeof(int32_t), 1, fp);
         }
@@ -314,11 +1160,169 @@ static void __write_to_file(CountMinSketch* cms, FILE *fp, short on_disk) {
         //     fwrite(&q, sizeof(int), 1, fp);
         // }
     }
+    if (cms->membership != NULL) {
+        fwrite(cms->membership->words, sizeof(uint64_t), cms->membership->num_blocks * MEMBERSHIP_BLOCK_WORDS, fp);
+        fwrite(&cms->membership->num_blocks, sizeof(uint64_t), 1, fp);
+        fwrite(MEMBERSHIP_MAGIC, 1, MEMBERSHIP_MAGIC_SIZE, fp);
+    }
     fwrite(&cms->width, sizeof(int32_t), 1, fp);
     fwrite(&cms->depth, sizeof(int32_t), 1, fp);
     fwrite(&cms->elements_added, sizeof(int64_t), 1, fp);
 }
 
+/*  Copy-on-write export snapshot. The export thread copies the chunks in
+    order; a writer about to change a counter copies its chunk first unless
+    that already happened. Whoever moves a chunk from PENDING to COPYING
+    copies it, anyone else waits for COPIED. */
+static __inline__ void __snapshot_touch(CountMinSketch* cms, uint64_t bin) {
+    cms_export_snapshot* snapshot = __atomic_load_n(&cms->snapshot, __ATOMIC_ACQUIRE);
+    if (__builtin_expect(snapshot != NULL, 0) && __atomic_load_n(&snapshot->active, __ATOMIC_ACQUIRE)) {
+        __snapshot_copy(snapshot, bin / SNAPSHOT_CHUNK);
+    }
+}
+
+static void __snapshot_copy(cms_export_snapshot* snapshot, uint64_t chunk) {
+    uint8_t expected = SNAPSHOT_PENDING;
+    if (__atomic_compare_exchange_n(&snapshot->state[chunk], &expected, SNAPSHOT_COPYING, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        uint64_t begin = chunk * SNAPSHOT_CHUNK;
+        uint64_t end = (snapshot->num_bins - begin < SNAPSHOT_CHUNK) ? snapshot->num_bins : begin + SNAPSHOT_CHUNK;
+        memcpy((char*) snapshot->dst + (begin * snapshot->value_size), (const char*) snapshot->src + (begin * snapshot->value_size), (end - begin) * snapshot->value_size);
+        __atomic_store_n(&snapshot->state[chunk], SNAPSHOT_COPIED, __ATOMIC_RELEASE);
+        return;
+    }
+    while (__atomic_load_n(&snapshot->state[chunk], __ATOMIC_ACQUIRE) != SNAPSHOT_COPIED) {
+        sched_yield();
+    }
+}
+
+/* copy whatever the export thread has not copied yet and release the
+   snapshot; called by the writer before the bins are changed wholesale */
+static void __snapshot_finish(CountMinSketch* cms) {
+    cms_export_snapshot* snapshot = cms->snapshot;
+    if (snapshot == NULL) {
+        return;
+    }
+    for (uint64_t chunk = 0; chunk < snapshot->num_chunks && __atomic_load_n(&snapshot->active, __ATOMIC_ACQUIRE); ++chunk) {
+        __snapshot_copy(snapshot, chunk);
+    }
+    while (__atomic_load_n(&snapshot->active, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    __atomic_store_n(&cms->snapshot, NULL, __ATOMIC_RELAXED);
+    free(snapshot->state);
+    free(snapshot);
+}
+
+/*  copies the bins, then writes the snapshot in the `cms_export` format to a
+    temporary file and renames it into place */
+static void* __export_worker(void* arg) {
+    cms_export_job* job = (cms_export_job*) arg;
+    uint64_t length = (uint64_t) job->width * job->depth;
+    int res = CMS_ERROR;
+
+    /* once `active` is cleared the sketch may free the snapshot at any time */
+    cms_export_snapshot* snapshot = job->snapshot;
+    job->snapshot = NULL;
+    for (uint64_t chunk = 0; chunk < snapshot->num_chunks; ++chunk) {
+        if (!__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED)) {
+            __snapshot_copy(snapshot, chunk);
+            continue;
+        }
+        uint8_t expected = SNAPSHOT_PENDING;
+        if (!__atomic_compare_exchange_n(&snapshot->state[chunk], &expected, SNAPSHOT_COPIED, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            __snapshot_copy(snapshot, chunk);   /* waits for the writer copying it */
+        }
+    }
+    __atomic_store_n(&snapshot->active, 0, __ATOMIC_RELEASE);
+
+    FILE* fp = fopen(job->tmp_filepath, "w+b");
+    if (fp == NULL) {
+        fprintf(stderr, "Can't open file %s!\n", job->tmp_filepath);
+    } else {
+        uint64_t i;
+        for (i = 0; i < length && !__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED); i += EXPORT_CHUNK) {
+            size_t n = (length - i < EXPORT_CHUNK) ? (size_t) (length - i) : EXPORT_CHUNK;
+            if (fwrite((const char*) job->bins + (i * job->value_size), job->value_size, n, fp) != n) {
+                break;
+            }
+        }
+        size_t membership_words = job->membership_blocks * MEMBERSHIP_BLOCK_WORDS;
+        if (i >= length && !__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED)
+                && (job->membership == NULL
+                    || (fwrite(job->membership, sizeof(uint64_t), membership_words, fp) == membership_words
+                        && fwrite(&job->membership_blocks, sizeof(uint64_t), 1, fp) == 1
+                        && fwrite(MEMBERSHIP_MAGIC, 1, MEMBERSHIP_MAGIC_SIZE, fp) == MEMBERSHIP_MAGIC_SIZE))
+                && fwrite(&job->width, sizeof(int32_t), 1, fp) == 1
+                && fwrite(&job->depth, sizeof(int32_t), 1, fp) == 1
+                && fwrite(&job->elements_added, sizeof(int64_t), 1, fp) == 1
+                && fflush(fp) == 0
+                && ((job->flags & CMS_EXPORT_FSYNC) == 0 || fsync(fileno(fp)) == 0)) {
+            res = CMS_SUCCESS;
+        }
+        if (fclose(fp) != 0) {
+            res = CMS_ERROR;
+        }
+        if (res == CMS_SUCCESS && rename(job->tmp_filepath, job->filepath) != 0) {
+            fprintf(stderr, "Can't rename %s to %s!\n", job->tmp_filepath, job->filepath);
+            res = CMS_ERROR;
+        }
+        /* the rename is only durable once the directory entry is */
+        if (res == CMS_SUCCESS && (job->flags & CMS_EXPORT_FSYNC) && __fsync_parent(job->filepath) == CMS_ERROR) {
+            fprintf(stderr, "Can't sync the directory of %s!\n", job->filepath);
+            res = CMS_ERROR;
+        }
+        if (res == CMS_ERROR) {
+            remove(job->tmp_filepath);
+        }
+    }
+
+    /* the snapshot is no longer needed; release it before the callback runs */
+    free(job->bins);
+    free(job->membership);
+    job->bins = NULL;
+    job->membership = NULL;
+    job->result = res;
+    if (job->callback != NULL) {
+        job->callback(res, job->filepath, job->context);
+    }
+    return NULL;
+}
+
+/* fsync the directory holding `filepath` so a rename into it survives a crash */
+static int __fsync_parent(const char* filepath) {
+    const char* slash = strrchr(filepath, '/');
+    char* dir = NULL;
+    if (slash != NULL) {
+        size_t len = (slash == filepath) ? 1 : (size_t) (slash - filepath);
+        dir = (char*)malloc(len + 1);
+        if (dir == NULL) {
+            return CMS_ERROR;
+        }
+        memcpy(dir, filepath, len);
+        dir[len] = '\0';
+    }
+    int fd = open((dir == NULL) ? "." : dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd < 0) {
+        return CMS_ERROR;
+    }
+    int res = (fsync(fd) == 0) ? CMS_SUCCESS : CMS_ERROR;
+    close(fd);
+    return res;
+}
+
+static void __free_export_job(cms_export_job* job) {
+    if (job->snapshot != NULL) {
+        free(job->snapshot->state);
+        free(job->snapshot);
+    }
+    free(job->bins);
+    free(job->membership);
+    free(job->filepath);
+    free(job->tmp_filepath);
+    free(job);
+}
+
 static void __read_from_file(CountMinSketch* cms, FILE *fp, short on_disk, const char* filename) {
     /* read in the values from the file before getting the sketch itself */
     int offset = (sizeof(int32_t) * 2) + sizeof(long);
@@ -329,10 +1333,41 @@ static void __read_from_file(CountMinSketch* cms, FILE *fp, short on_disk, const
     cms->confidence = 1 - (1 / pow(2, cms->depth));
     cms->error_rate = 2 / (double) cms->width;
     fread(&cms->elements_added, sizeof(int64_t), 1, fp);
+    long file_size = ftell(fp);
+
+    /* an optional membership filter section ends right before the trailer */
+    uint64_t membership_blocks = 0;
+    long counters_size = file_size - offset;
+    char magic[MEMBERSHIP_MAGIC_SIZE];
+    if (counters_size >= (long) (sizeof(uint64_t) + MEMBERSHIP_MAGIC_SIZE)) {
+        fseek(fp, (long) (offset + sizeof(uint64_t) + MEMBERSHIP_MAGIC_SIZE) * -1, SEEK_END);
+        if (fread(&membership_blocks, sizeof(uint64_t), 1, fp) == 1 && fread(magic, 1, MEMBERSHIP_MAGIC_SIZE, fp) == MEMBERSHIP_MAGIC_SIZE
+                && memcmp(magic, MEMBERSHIP_MAGIC, MEMBERSHIP_MAGIC_SIZE) == 0) {
+            counters_size -= (long) (membership_blocks * MEMBERSHIP_BLOCK_WORDS * sizeof(uint64_t) + sizeof(uint64_t) + MEMBERSHIP_MAGIC_SIZE);
+        } else {
+            membership_blocks = 0;
+        }
+    }
 
     rewind(fp);
     size_t length = cms->width * cms->depth;
-    if (on_disk == 0) {
+    cms->wide_bins = NULL;
+    cms->wide_migrated = 0;
+    cms->auto_promote = 0;
+    cms->membership = NULL;
+    cms->snapshot = NULL;
+    if (on_disk == 0 && (size_t) counters_size == length * sizeof(int64_t)) {
+        /* exported after promotion; stays promoted */
+        cms->bins = NULL;
+        cms->wide_bins = (int64_t*)malloc(length * sizeof(int64_t));
+        size_t read = (cms->wide_bins == NULL) ? 0 : fread(cms->wide_bins, sizeof(int64_t), length, fp);
+        if (read != length) {
+            perror("__read_from_file: ");
+            exit(1);
+        }
+        cms->wide_migrated = length;
+        cms->auto_promote = 1;
+    } else if (on_disk == 0) {
         cms->bins = (int32_t*)malloc(length * sizeof(int32_t));
         size_t read = fread(cms->bins, sizeof(int32_t), length, fp);
         if (read != length) {
@@ -342,23 +1377,199 @@ static void __read_from_file(CountMinSketch* cms, FILE *fp, short on_disk, const
     } else {
         // TODO: decide if this should be done directly on disk or not
     }
+    if (on_disk == 0 && membership_blocks != 0) {
+        /* the section follows the counters */
+        cms->membership = __membership_alloc(membership_blocks);
+        size_t num_words = membership_blocks * MEMBERSHIP_BLOCK_WORDS;
+        if (cms->membership == NULL || fread(cms->membership->words, sizeof(uint64_t), num_words, fp) != num_words) {
+            perror("__read_from_file: ");
+            exit(1);
+        }
+    }
+}
+
+/* apply the batch key by key, prefetching the counters of a key a few keys ahead */
+static void __add_batch_serial(CountMinSketch* cms, const uint64_t* hashes, unsigned int num_hashes, unsigned int num_keys, const uint32_t* x) {
+    for (unsigned int k = 0; k < num_keys; ++k) {
+        if (k + PREFETCH_DISTANCE < num_keys) {
+            const uint64_t* ahead = hashes + ((size_t) (k + PREFETCH_DISTANCE) * num_hashes);
+            for (unsigned int i = 0; i < cms->depth; ++i) {
+                CMS_PREFETCH_WRITE(__bin_address(cms, (ahead[i] % cms->width) + ((uint64_t) i * cms->width)));
+            }
+        }
+        const uint64_t* key_hashes = hashes + ((size_t) k * num_hashes);
+        uint32_t inc = (x == NULL) ? 1 : x[k];
+        __write_begin(cms);
+        for (unsigned int i = 0; i < cms->depth; ++i) {
+            uint64_t bin = (key_hashes[i] % cms->width) + ((uint64_t) i * cms->width);
+            __add_to_bin(cms, bin, inc);
+        }
+        __atomic_store_n(&cms->elements_added, cms->elements_added + inc, __ATOMIC_RELAXED);
+        __promote_step(cms);
+        __write_end(cms);
+    }
+}
+
+/*  Radix partition the (bin, increment) pairs of the batch by memory region
+    with a counting sort and then apply one region at a time. Saturating
+    addition of non-negative increments does not depend on the order so the
+    result matches the serial path exactly. Never used with concurrent reads. */
+static int __add_batch_partitioned(CountMinSketch* cms, const uint64_t* hashes, unsigned int num_hashes, unsigned int num_keys, const uint32_t* x) {
+    uint64_t num_bins = (uint64_t) cms->width * cms->depth;
+    uint32_t num_updates = num_keys * cms->depth;
+    uint32_t region_bits = CMS_RADIX_REGION_BITS;
+    while ((num_bins >> region_bits) >= CMS_RADIX_MAX_FANOUT) {
+        ++region_bits;
+    }
+    uint32_t fanout = (uint32_t) (num_bins >> region_bits) + 1;
+
+    __bin_update* updates = (__bin_update*)malloc((size_t) num_updates * sizeof(__bin_update));
+    __bin_update* partitioned = (__bin_update*)malloc((size_t) num_updates * sizeof(__bin_update));
+    uint32_t* offsets = (uint32_t*)calloc(fanout + 1, sizeof(uint32_t));
+    if (updates == NULL || partitioned == NULL || offsets == NULL) {
+        free(updates);
+        free(partitioned);
+        free(offsets);
+        return CMS_ERROR;
+    }
+
+    /* pass 1: compute the bins and the size of each partition */
+    uint32_t n = 0;
+    for (unsigned int k = 0; k < num_keys; ++k) {
+        const uint64_t* key_hashes = hashes + ((size_t) k * num_hashes);
+        uint32_t inc = (x == NULL) ? 1 : x[k];
+        for (unsigned int i = 0; i < cms->depth; ++i, ++n) {
+            updates[n].bin = (uint32_t) ((key_hashes[i] % cms->width) + ((uint64_t) i * cms->width));
+            updates[n].x = inc;
+            ++offsets[(updates[n].bin >> region_bits) + 1];
+        }
+    }
+    for (uint32_t p = 0; p < fanout; ++p) {
+        offsets[p + 1] += offsets[p];
+    }
+
+    /* pass 2: scatter into partitions; offsets[p] ends up at the end of partition p */
+    for (uint32_t j = 0; j < num_updates; ++j) {
+        partitioned[offsets[updates[j].bin >> region_bits]++] = updates[j];
+    }
+
+    /* pass 3: apply each partition while its region is resident */
+    uint32_t start = 0;
+    for (uint32_t p = 0; p < fanout; ++p) {
+        for (uint32_t j = start; j < offsets[p]; ++j) {
+            __add_to_bin(cms, partitioned[j].bin, partitioned[j].x);
+        }
+        __promote_step(cms);
+        start = offsets[p];
+    }
+    int64_t total = 0;
+    for (unsigned int k = 0; k < num_keys; ++k) {
+        total += (x == NULL) ? 1 : x[k];
+    }
+    cms->elements_added += total;
+
+    free(updates);
+    free(partitioned);
+    free(offsets);
+    return CMS_SUCCESS;
 }
 
-static void __merge_cms(CountMinSketch* base, int num_sketches, va_list* args) {
+static int __merge_cms(CountMinSketch* base, int num_sketches, va_list* args) {
     int i;
-    uint32_t bin, bins = (base->width * base->depth);
+    int64_t elements_added = base->elements_added;
+    int promote = 0;
+    int any_wide = 0;
+    __merge_job job = {base, NULL, num_sketches};
+
+    job.sketches = (CountMinSketch**)malloc(num_sketches * sizeof(CountMinSketch*));
+    if (job.sketches == NULL) {
+        fprintf(stderr, "Failed to allocate memory to merge the count-min sketches!\n");
+        return CMS_ERROR;
+    }
 
     va_list ap;
     va_copy(ap, *args);
-
+    cms_flush(base);
+    if (base->hot != NULL) {
+        base->hot->used = 0;    /* the filter counts would miss the merged ones */
+        base->hot->coldest = 0;
+    }
     for (i = 0; i < num_sketches; ++i) {
-        CountMinSketch *individual_cms = va_arg(ap, CountMinSketch *);
-        base->elements_added += individual_cms->elements_added;
-        for (bin = 0; bin < bins; ++bin) {
-            base->bins[bin] = __safe_add_2(base->bins[bin], individual_cms->bins[bin]);
-        }
+        job.sketches[i] = va_arg(ap, CountMinSketch *);
+        cms_flush(job.sketches[i]);
+        elements_added += job.sketches[i]->elements_added;
+        promote |= (job.sketches[i]->wide_bins != NULL || job.sketches[i]->auto_promote);
+        any_wide |= (job.sketches[i]->wide_bins != NULL);
     }
     va_end(ap);
+
+    /* the sums of promoted (or promotable) sketches would saturate in narrow
+       counters; the base takes over their promotion */
+    if (promote) {
+        base->auto_promote = 1;
+        if (any_wide && base->wide_bins == NULL && __promote_begin(base) == CMS_ERROR) {
+            free(job.sketches);
+            return CMS_ERROR;
+        }
+    }
+
+    __write_begin(base);
+    __for_each_bin_range(base, __merge_range, &job);
+    if (base->membership != NULL) {
+        uint64_t num_words = base->membership->num_blocks * MEMBERSHIP_BLOCK_WORDS;
+        for (i = 0; i < num_sketches; ++i) {
+            const uint64_t* words = job.sketches[i]->membership->words;
+            for (uint64_t w = 0; w < num_words; ++w) {
+                __atomic_store_n(&base->membership->words[w], base->membership->words[w] | words[w], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    __atomic_store_n(&base->elements_added, elements_added, __ATOMIC_RELAXED);
+    __promote_step(base);
+    __write_end(base);
+    free(job.sketches);
+    return CMS_SUCCESS;
+}
+
+static void __merge_range(void* arg, uint64_t begin, uint64_t end) {
+    __merge_job* job = (__merge_job*) arg;
+    CountMinSketch* base = job->base;
+    for (int i = 0; i < job->num_sketches; ++i) {
+        const CountMinSketch* other = job->sketches[i];
+        for (uint64_t bin = begin; bin < end; ++bin) {
+            __add_to_bin(base, bin, __load_bin(other, bin));
+        }
+    }
+}
+
+static void __clear_range(void* arg, uint64_t begin, uint64_t end) {
+    CountMinSketch* cms = (CountMinSketch*) arg;
+    if (cms->wide_bins != NULL) {
+        /* cleared counters read as 0 whether or not they have been migrated */
+        for (uint64_t bin = begin; bin < end; ++bin) {
+            __atomic_store_n(&cms->wide_bins[bin], 0, __ATOMIC_RELAXED);
+        }
+        if (cms->bins == NULL) {
+            return;
+        }
+    }
+    if (cms->concurrent_reads) {
+        for (uint64_t bin = begin; bin < end; ++bin) {
+            __store_bin(cms, bin, 0);
+        }
+    } else {
+        memset(cms->bins + begin, 0, (end - begin) * sizeof(int32_t));
+    }
+}
+
+/* sweep all of the bins, splitting them across the thread pool when the sketch is large */
+static void __for_each_bin_range(CountMinSketch* cms, cms_range_function body, void* arg) {
+    uint64_t num_bins = (uint64_t) cms->width * cms->depth;
+    if (num_bins < CMS_PARALLEL_MIN_BINS) {
+        body(arg, 0, num_bins);
+    } else {
+        cms_pool_parallel_for(num_bins, CMS_PARALLEL_MIN_CHUNK, body, arg);
+    }
 }
 
 
@@ -374,6 +1585,12 @@ static int __validate_merge(CountMinSketch* base, int num_sketches, va_list* arg
 
     for (/* skip */; i < num_sketches; ++i) {
         CountMinSketch *individual_cms = va_arg(ap, CountMinSketch *);
+        if (base->membership != NULL
+                && (individual_cms->membership == NULL || individual_cms->membership->num_blocks != base->membership->num_blocks)) {
+            fprintf(stderr, "Cannot merge sketches without a membership filter of the same size into one with a filter!\n");
+            va_end(ap);
+            return CMS_ERROR;
+        }
         if (!(base->depth == individual_cms->depth
               && base->width == individual_cms->width
               && base->hash_function == individual_cms->hash_function)) {
@@ -389,16 +1606,6 @@ static int __validate_merge(CountMinSketch* base, int num_sketches, va_list* arg
     return CMS_SUCCESS;
 }
 
-/* NOTE: The caller will free the results */
-static uint64_t* __default_hash(unsigned int num_hashes, const char* str) {
-    uint64_t* results = (uint64_t*)calloc(num_hashes, sizeof(uint64_t));
-    int i;
-    for (i = 0; i < num_hashes; ++i) {
-        results[i] = __fnv_1a(str, i);
-    }
-    return results;
-}
-
 static uint64_t __fnv_1a(const char* key, int seed) {
     // FNV-1a hash (http://www.isthe.com/chongo/tech/comp/fnv/)
     int i, len = strlen(key);
@@ -411,8 +1618,53 @@ static uint64_t __fnv_1a(const char* key, int seed) {
 }
 
 
-static int __compare(const void *a, const void *b) {
-    return ( *(int64_t*)a - *(int64_t*)b );
+/* median by insertion sort; depth is small, so this beats qsort */
+static int64_t __median(int64_t* values, unsigned int n) {
+    for (unsigned int i = 1; i < n; ++i) {
+        int64_t v = values[i];
+        unsigned int j = i;
+        for (; j > 0 && values[j - 1] > v; --j) {
+            values[j] = values[j - 1];
+        }
+        values[j] = v;
+    }
+    if (n % 2 == 0) {
+        return (values[n/2] + values[n/2 - 1]) / 2;
+    }
+    return values[n/2];
+}
+
+/* the count sketch sign of a row; the top bit of the mixed hash is
+   independent of the column taken from the low bits */
+static __inline__ int64_t __sign(uint64_t hash) {
+    return ((hash * GOLDEN_RATIO_64) >> 63) ? -1 : 1;
+}
+
+static int32_t __signed_update(CountMinSketch* cms, uint64_t* hashes, uint32_t x, int direction) {
+    int64_t stack_values[CMS_STACK_DEPTH];
+    int64_t* values = (cms->depth <= CMS_STACK_DEPTH) ? stack_values : (int64_t*)malloc(cms->depth * sizeof(int64_t));
+    if (values == NULL) {
+        fprintf(stderr, "Failed to allocate the median lookup!\n");
+        return CMS_ERROR;
+    }
+    if (cms->membership != NULL) {
+        __membership_insert(cms->membership, hashes[0]);
+    }
+    __write_begin(cms);
+    for (unsigned int i = 0; i < cms->depth; ++i) {
+        uint64_t bin = (hashes[i] % cms->width) + ((uint64_t) i * cms->width);
+        int64_t sign = __sign(hashes[i]);
+        int64_t val = __add_to_bin(cms, bin, sign * direction * (int64_t) x);
+        values[i] = sign * val;
+    }
+    __atomic_store_n(&cms->elements_added, cms->elements_added + (direction * (int64_t) x), __ATOMIC_RELAXED);
+    __promote_step(cms);
+    __write_end(cms);
+    int32_t num_add = __clamp_int32(__median(values, cms->depth));
+    if (values != stack_values) {
+        free(values);
+    }
+    return num_add;
 }
 
 
@@ -435,25 +1687,6 @@ static int32_t __safe_add(int32_t a, uint32_t b) {
     return c;
 }
 
-static int32_t __safe_sub(int32_t a, uint32_t b) {
-    if (a == INT32_MAX || a == INT32_MIN) {
-        return a;
-    }
-
-    /* use the gcc macro if compiling with GCC, otherwise, simple overflow check */
-    int32_t c = 0;
-#if (__has_builtin(__builtin_sub_overflow)) || (defined(__GNUC__) && __GNUC__ >= 5)
-    bool bl = __builtin_sub_overflow(a, b, &c);
-        if (bl) {
-            c = INT32_MIN;
-        }
-#else
-    c = ((int64_t) b - a < INT32_MIN) ? INT32_MAX : (a - b);
-#endif
-
-    return c;
-}
-
 static int32_t __safe_add_2(int32_t a, int32_t b) {
     if (a == INT32_MAX || a == INT32_MIN) {
         return a;
@@ -466,4 +1699,387 @@ static int32_t __safe_add_2(int32_t a, int32_t b) {
     else if (c >= INT32_MAX)
         return INT32_MAX;
     return (int32_t) c;
-}
\ No newline at end of file
+}
+
+/*  Seqlock helpers for the single-writer/multi-reader mode. The writer makes
+    the sequence odd before touching the counters and even again afterwards;
+    a reader's view is consistent if it saw the same even sequence before and
+    after reading. Counters are always accessed through relaxed atomics which
+    compile to plain loads and stores on the common platforms. */
+static __inline__ void __write_begin(CountMinSketch* cms) {
+    if (cms->concurrent_reads) {
+        __atomic_store_n(&cms->sequence, cms->sequence + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+}
+
+static __inline__ void __write_end(CountMinSketch* cms) {
+    if (cms->concurrent_reads) {
+        __atomic_store_n(&cms->sequence, cms->sequence + 1, __ATOMIC_RELEASE);
+    }
+}
+
+static __inline__ uint32_t __read_begin(const CountMinSketch* cms) {
+    return __atomic_load_n(&cms->sequence, __ATOMIC_ACQUIRE);
+}
+
+static __inline__ bool __read_retry(const CountMinSketch* cms, uint32_t seq, unsigned int* attempts) {
+    if (cms->concurrent_reads == 0) {
+        return false;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if ((seq & 1) == 0 && seq == __atomic_load_n(&cms->sequence, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    /* a torn read can even miss the narrow part of a counter being
+       promoted, so never give up; let a preempted writer run instead */
+    if (++(*attempts) >= CMS_READ_RETRIES) {
+        sched_yield();
+    }
+    return true;
+}
+
+/* while a sketch is being promoted a counter that has not been migrated yet
+   is the sum of its narrow and wide parts */
+static __inline__ int64_t __load_bin(const CountMinSketch* cms, uint64_t bin) {
+    const int64_t* wide_bins = __atomic_load_n(&cms->wide_bins, __ATOMIC_ACQUIRE);
+    if (__builtin_expect(wide_bins == NULL, 1)) {
+        return __atomic_load_n(&cms->bins[bin], __ATOMIC_RELAXED);
+    }
+    int64_t val = __atomic_load_n(&wide_bins[bin], __ATOMIC_RELAXED);
+    if (bin >= __atomic_load_n(&cms->wide_migrated, __ATOMIC_RELAXED)) {
+        val += __atomic_load_n(&cms->bins[bin], __ATOMIC_RELAXED);
+    }
+    return val;
+}
+
+static __inline__ void __store_bin(CountMinSketch* cms, uint64_t bin, int32_t val) {
+    __snapshot_touch(cms, bin);
+    __atomic_store_n(&cms->bins[bin], val, __ATOMIC_RELAXED);
+}
+
+static __inline__ const void* __bin_address(const CountMinSketch* cms, uint64_t bin) {
+    return (cms->wide_bins != NULL) ? (const void*) (cms->wide_bins + bin) : (const void*) (cms->bins + bin);
+}
+
+/*  Add `delta` to a counter and return its new value. Narrow counters
+    saturate (and then stay) at INT32_MAX or INT32_MIN unless promotion is
+    enabled, in which case the sketch is promoted and the update goes to the
+    wide counter. cms_add_row_inc calls this from several threads on
+    different rows, so the promotion is published with a compare and swap. */
+static int64_t __add_to_bin(CountMinSketch* cms, uint64_t bin, int64_t delta) {
+    int64_t* wide_bins = __atomic_load_n(&cms->wide_bins, __ATOMIC_ACQUIRE);
+    if (__builtin_expect(wide_bins == NULL, 1)) {
+        int32_t cur = cms->bins[bin];
+        if (cur == INT32_MAX || cur == INT32_MIN) {
+            return cur;
+        }
+        int64_t val = (int64_t) cur + delta;
+        if (val > INT32_MIN && val < INT32_MAX) {
+            __store_bin(cms, bin, (int32_t) val);
+            return val;
+        }
+        if (!cms->auto_promote || __promote_begin(cms) == CMS_ERROR) {
+            int32_t saturated = (val > 0) ? INT32_MAX : INT32_MIN;
+            __store_bin(cms, bin, saturated);
+            return saturated;
+        }
+        wide_bins = __atomic_load_n(&cms->wide_bins, __ATOMIC_ACQUIRE);
+    }
+    __snapshot_touch(cms, bin);
+    __atomic_store_n(&wide_bins[bin], wide_bins[bin] + delta, __ATOMIC_RELAXED);
+    return __load_bin(cms, bin);
+}
+
+static int __promote_begin(CountMinSketch* cms) {
+    uint64_t num_bins = (uint64_t) cms->width * cms->depth;
+    int64_t* wide_bins = (int64_t*)calloc(num_bins, sizeof(int64_t));
+    if (wide_bins == NULL) {
+        fprintf(stderr, "Failed to allocate %zu bytes to promote the bins!\n", (size_t) (num_bins * sizeof(int64_t)));
+        return CMS_ERROR;
+    }
+    int64_t* expected = NULL;
+    if (!__atomic_compare_exchange_n(&cms->wide_bins, &expected, wide_bins, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        free(wide_bins);    /* another row's thread promoted first */
+    }
+    return CMS_SUCCESS;
+}
+
+/* move the next block of narrow counters over; called by the writer inside its update */
+static void __promote_step(CountMinSketch* cms) {
+    uint64_t num_bins = (uint64_t) cms->width * cms->depth;
+    if (__builtin_expect(cms->wide_bins == NULL, 1) || cms->wide_migrated >= num_bins) {
+        return;
+    }
+    uint64_t end = (num_bins - cms->wide_migrated < CMS_PROMOTE_BLOCK) ? num_bins : cms->wide_migrated + CMS_PROMOTE_BLOCK;
+    for (uint64_t bin = cms->wide_migrated; bin < end; ++bin) {
+        __atomic_store_n(&cms->wide_bins[bin], cms->wide_bins[bin] + cms->bins[bin], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&cms->wide_migrated, end, __ATOMIC_RELAXED);
+    if (end == num_bins && !cms->concurrent_reads) {
+        /* readers may still hold the narrow bins in concurrent mode; freed on destroy */
+        __snapshot_finish(cms);
+        free(cms->bins);
+        cms->bins = NULL;
+    }
+}
+
+static void __promote_complete(CountMinSketch* cms) {
+    if (cms->wide_bins == NULL) {
+        return;
+    }
+    __write_begin(cms);
+    while (cms->wide_migrated < (uint64_t) cms->width * cms->depth) {
+        __promote_step(cms);
+    }
+    __write_end(cms);
+}
+
+
+/*  Update coalescing; each key owns at most one slot, found by multiplicative
+    hashing of its first hash. A different key landing on an occupied slot
+    evicts (flushes) the previous occupant. */
+static int32_t __coalesce_add(CountMinSketch* cms, uint64_t* hashes, uint32_t x) {
+    cms_coalesce_buffer* buf = cms->coalesce;
+    uint64_t tag = hashes[0];
+    uint32_t slot = __coalesce_slot(buf, tag);
+
+    if (buf->counts[slot] != 0 && (buf->tags[slot] != tag || buf->counts[slot] > UINT32_MAX - x)) {
+        __coalesce_flush_slot(cms, slot);
+    }
+    if (buf->counts[slot] == 0) {
+        uint32_t* columns = buf->columns + ((size_t) slot * cms->depth);
+        int32_t estimate = INT32_MAX;
+        for (unsigned int i = 0; i < cms->depth; ++i) {
+            columns[i] = hashes[i] % cms->width;
+            int32_t val = __clamp_int32(__load_bin(cms, columns[i] + ((uint64_t) i * cms->width)));
+            if (val < estimate) {
+                estimate = val;
+            }
+        }
+        buf->tags[slot] = tag;
+        buf->estimates[slot] = estimate;
+        ++buf->used;
+    }
+    buf->counts[slot] += x;
+    __atomic_store_n(&cms->elements_added, cms->elements_added + x, __ATOMIC_RELAXED);
+    return __safe_add(buf->estimates[slot], buf->counts[slot]);
+}
+
+static void __coalesce_flush_slot(CountMinSketch* cms, uint32_t slot) {
+    cms_coalesce_buffer* buf = cms->coalesce;
+    const uint32_t* columns = buf->columns + ((size_t) slot * cms->depth);
+    uint32_t x = buf->counts[slot];
+
+    __write_begin(cms);
+    for (unsigned int i = 0; i < cms->depth; ++i) {
+        __add_to_bin(cms, columns[i] + ((uint64_t) i * cms->width), x);
+    }
+    __promote_step(cms);
+    __write_end(cms);
+    buf->counts[slot] = 0;
+    --buf->used;
+}
+
+static __inline__ uint32_t __coalesce_slot(const cms_coalesce_buffer* buf, uint64_t tag) {
+    return (buf->shift == 64) ? 0 : (uint32_t) ((tag * GOLDEN_RATIO_64) >> buf->shift);
+}
+
+/* add to the bins directly; a standard min strategy */
+static int64_t __add_bins(CountMinSketch* cms, uint64_t* hashes, uint32_t x) {
+    int64_t num_add = INT64_MAX;
+    __write_begin(cms);
+    for (unsigned int i = 0; i < cms->depth; ++i) {
+        uint64_t bin = (hashes[i] % cms->width) + ((uint64_t) i * cms->width);
+        int64_t val = __add_to_bin(cms, bin, x);
+        if (val < num_add) {
+            num_add = val;
+        }
+    }
+    __atomic_store_n(&cms->elements_added, cms->elements_added + x, __ATOMIC_RELAXED);
+    __promote_step(cms);
+    __write_end(cms);
+    return num_add;
+}
+
+static int32_t __hot_add(CountMinSketch* cms, uint64_t* hashes, uint32_t x) {
+    cms_hot_filter* hot = cms->hot;
+    int item = __hot_find(hot, hashes[0]);
+    if (item >= 0) {
+        hot->counts[item] += x;
+        cms->elements_added += x;
+        if ((uint32_t) item == hot->coldest) {
+            __hot_find_coldest(hot);
+        }
+        return __clamp_int32(hot->counts[item]);
+    }
+
+    int64_t estimate;
+    if (hot->used < hot->capacity) {
+        /* the key may have been counted in the bins before; start from there */
+        estimate = cms_check_wide_alt(cms, hashes, cms->depth);
+        item = (int) hot->used++;
+        cms->elements_added += x;
+    } else {
+        estimate = __add_bins(cms, hashes, x);
+        /* promote the key once it overtakes the coldest filtered key */
+        if (estimate <= hot->counts[hot->coldest]) {
+            return __clamp_int32(estimate);
+        }
+        __hot_flush_item(cms, hot->coldest);
+        item = (int) hot->coldest;
+        x = 0;
+    }
+    hot->tags[item] = hashes[0];
+    hot->flushed[item] = estimate;
+    hot->counts[item] = estimate + x;
+    memcpy(hot->hashes + ((size_t) item * cms->depth), hashes, cms->depth * sizeof(uint64_t));
+    if ((uint32_t) item == hot->coldest) {
+        __hot_find_coldest(hot);    /* the evicted key was the coldest */
+    } else if (hot->counts[item] < hot->counts[hot->coldest]) {
+        hot->coldest = (uint32_t) item;
+    }
+    return __clamp_int32(hot->counts[item]);
+}
+
+/* apply the pending count of a filtered key to the bins; it stays filtered */
+static void __hot_flush_item(CountMinSketch* cms, uint32_t item) {
+    cms_hot_filter* hot = cms->hot;
+    int64_t delta = hot->counts[item] - hot->flushed[item];
+    if (delta == 0) {
+        return;
+    }
+    const uint64_t* hashes = hot->hashes + ((size_t) item * cms->depth);
+    __write_begin(cms);
+    for (unsigned int i = 0; i < cms->depth; ++i) {
+        uint64_t bin = (hashes[i] % cms->width) + ((uint64_t) i * cms->width);
+        __add_to_bin(cms, bin, delta);
+    }
+    __promote_step(cms);
+    __write_end(cms);
+    hot->flushed[item] = hot->counts[item];
+}
+
+static void __hot_flush(CountMinSketch* cms) {
+    for (uint32_t i = 0; i < cms->hot->used; ++i) {
+        __hot_flush_item(cms, i);
+    }
+}
+
+/* index of the filtered key with the tag, -1 when not filtered */
+static __inline__ int __hot_find(const cms_hot_filter* hot, uint64_t tag) {
+    uint32_t i = 0;
+#if defined(__AVX2__)
+    __m256i needle = _mm256_set1_epi64x((long long) tag);
+    for (; i + 4 <= hot->used; i += 4) {
+        __m256i tags = _mm256_loadu_si256((const __m256i*) (hot->tags + i));
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(tags, needle)));
+        if (mask != 0) {
+            return (int) i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    int found = -1;
+    for (; i < hot->used; ++i) {
+        found = (hot->tags[i] == tag) ? (int) i : found;
+    }
+    return found;
+}
+
+/* rescan for the coldest key; only needed once the coldest key grows */
+static void __hot_find_coldest(cms_hot_filter* hot) {
+    uint32_t coldest = 0;
+    for (uint32_t i = 1; i < hot->used; ++i) {
+        coldest = (hot->counts[i] < hot->counts[coldest]) ? i : coldest;
+    }
+    hot->coldest = coldest;
+}
+
+static cms_membership_filter* __membership_alloc(uint64_t num_blocks) {
+    size_t num_bytes = num_blocks * MEMBERSHIP_BLOCK_WORDS * sizeof(uint64_t);
+    cms_membership_filter* filter = (cms_membership_filter*)malloc(sizeof(cms_membership_filter));
+    uint64_t* words = (uint64_t*)aligned_alloc(MEMBERSHIP_BLOCK_WORDS * sizeof(uint64_t), num_bytes);
+    if (filter == NULL || words == NULL) {
+        fprintf(stderr, "Failed to allocate %zu bytes for the membership filter!\n", num_bytes);
+        free(filter);
+        free(words);
+        return NULL;
+    }
+    memset(words, 0, num_bytes);
+    filter->num_blocks = num_blocks;
+    filter->words = words;
+    return filter;
+}
+
+static void __membership_free(cms_membership_filter* filter) {
+    free(filter->words);
+    free(filter);
+}
+
+/*  The block of a key and the bits it sets there. The first hash is mixed
+    once; the top half picks the block and the top bits of a second multiply
+    the CMS_MEMBERSHIP_HASHES bit positions. */
+static __inline__ uint64_t* __membership_block(const cms_membership_filter* filter, uint64_t hash, uint64_t* bits) {
+    uint64_t h = hash ^ (hash >> 31);
+    h *= GOLDEN_RATIO_64;
+    h ^= h >> 29;
+    uint64_t block = ((h >> 32) * filter->num_blocks) >> 32;
+    uint64_t g = h * GOLDEN_RATIO_64;
+    for (unsigned int i = 0; i < CMS_MEMBERSHIP_HASHES; ++i) {
+        bits[i] = (g >> (64 - 9 * (i + 1))) & (MEMBERSHIP_BLOCK_BITS - 1);
+    }
+    return filter->words + (block * MEMBERSHIP_BLOCK_WORDS);
+}
+
+/* only the writer inserts; readers with concurrent reads enabled use relaxed loads */
+static __inline__ void __membership_insert(cms_membership_filter* filter, uint64_t hash) {
+    uint64_t bits[CMS_MEMBERSHIP_HASHES];
+    uint64_t* block = __membership_block(filter, hash, bits);
+    for (unsigned int i = 0; i < CMS_MEMBERSHIP_HASHES; ++i) {
+        uint64_t* word = &block[bits[i] >> 6];
+        __atomic_store_n(word, *word | (1ULL << (bits[i] & 63)), __ATOMIC_RELAXED);
+    }
+}
+
+static __inline__ bool __membership_contains(const cms_membership_filter* filter, uint64_t hash) {
+    uint64_t bits[CMS_MEMBERSHIP_HASHES];
+    const uint64_t* block = __membership_block(filter, hash, bits);
+    uint64_t found = 1;
+    for (unsigned int i = 0; i < CMS_MEMBERSHIP_HASHES; ++i) {
+        found &= __atomic_load_n(&block[bits[i] >> 6], __ATOMIC_RELAXED) >> (bits[i] & 63);
+    }
+    return (found & 1) != 0;
+}
+
+/* readers only flush when they are the writer, i.e. concurrent reads are off */
+static __inline__ void __auto_flush(CountMinSketch* cms) {
+    if (cms->coalesce != NULL && cms->coalesce->used != 0 && cms->concurrent_reads == 0) {
+        cms_flush(cms);
+    }
+}
+
+/*  The min lookup of a key whose `depth` counter indices are in `bins`; `tag`
+    is its first hash, for the hot item filter */
+static int64_t __check_bins(CountMinSketch* cms, uint64_t tag, const uint64_t* bins) {
+    if (cms->hot != NULL) {
+        /* pending filter counts only lower the estimates of other keys */
+        int item = __hot_find(cms->hot, tag);
+        if (item >= 0) {
+            return cms->hot->counts[item];
+        }
+    }
+    int64_t num_add;
+    unsigned int attempts = 0;
+    uint32_t seq;
+    do {
+        seq = __read_begin(cms);
+        num_add = INT64_MAX;
+        for (unsigned int i = 0; i < cms->depth; ++i) {
+            int64_t val = __load_bin(cms, bins[i]);
+            if (val < num_add) {
+                num_add = val;
+            }
+        }
+    } while (__read_retry(cms, seq, &attempts));
+    return num_add;
+}
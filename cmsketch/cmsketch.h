@@ -24,6 +24,11 @@ extern "C" {
 #define CMS_SUCCESS  0
 #define CMS_ERROR   INT32_MIN
 
+/* number of times a reader re-reads the counters of an update in flight before
+   it starts yielding between attempts; only used when concurrent reads are
+   enabled */
+#define CMS_READ_RETRIES 16
+
 
 
 /* https://gcc.gnu.org/onlinedocs/gcc/Alternate-Keywords.html#Alternate-Keywords */
@@ -31,9 +36,60 @@ extern "C" {
 #define __inline__ inline
 #endif
 
+/* default number of slots in the update coalescing buffer */
+#define CMS_COALESCE_SLOTS 256
+
+/* batch insertions are radix partitioned by memory region when the sketch
+   has at least CMS_RADIX_MIN_BINS counters and the batch produces at least
+   CMS_RADIX_MIN_UPDATES counter updates; each region spans
+   2^CMS_RADIX_REGION_BITS counters */
+#define CMS_RADIX_MIN_BINS      (1U << 23)
+#define CMS_RADIX_MIN_UPDATES   (1U << 16)
+#define CMS_RADIX_REGION_BITS   16
+#define CMS_RADIX_MAX_FANOUT    1024
+
+/* number of lookups that are in flight at once in the batch check functions */
+#define CMS_CHECK_GROUP_SIZE    16
+
+/* default and maximum number of keys tracked by the hot item filter */
+#define CMS_HOT_ITEMS           32
+#define CMS_HOT_MAX_ITEMS       256
+
+/* number of counters moved to 64-bit by each update while a sketch is being
+   promoted; see cms_set_auto_promote */
+#define CMS_PROMOTE_BLOCK       4096
+
+/* bits per expected key and bits set per key in the membership filter; 10
+   bits and 4 hashes in 512-bit blocks give roughly 1% false positives; see
+   cms_set_membership_filter */
+#define CMS_MEMBERSHIP_BITS_PER_KEY 10
+#define CMS_MEMBERSHIP_HASHES       4
+
 /* hashing function type */
 typedef uint64_t* (*cms_hash_function) (unsigned int num_hashes, const char* key);
 
+/* flags for cms_export_async */
+#define CMS_EXPORT_FSYNC    1   /* fsync the file and its directory before reporting success */
+
+/* called from the background thread once an asynchronous export finishes;
+   `result` is CMS_SUCCESS or CMS_ERROR (including when it was cancelled) */
+typedef void (*cms_export_callback)(int result, const char* filepath, void* context);
+
+/* a background export started by cms_export_async */
+typedef struct cms_export_job cms_export_job;
+
+/* copy-on-write snapshot of the bins taken by cms_export_async */
+typedef struct cms_export_snapshot cms_export_snapshot;
+
+/* update coalescing buffer; see cms_set_coalescing */
+typedef struct cms_coalesce_buffer cms_coalesce_buffer;
+
+/* hot item filter; see cms_set_hot_filter */
+typedef struct cms_hot_filter cms_hot_filter;
+
+/* blocked Bloom filter of the keys in the sketch; see cms_set_membership_filter */
+typedef struct cms_membership_filter cms_membership_filter;
+
 typedef struct {
     uint32_t depth;
     uint32_t width;
@@ -42,6 +98,15 @@ typedef struct {
     double error_rate;
     cms_hash_function hash_function;
     int32_t* bins;
+    uint32_t concurrent_reads;  /* single-writer/multi-reader mode; see cms_set_concurrent_reads */
+    uint32_t sequence;          /* seqlock sequence number; odd while an update is in flight */
+    cms_coalesce_buffer* coalesce;  /* pending updates of recently seen keys; NULL when disabled */
+    cms_hot_filter* hot;        /* counts of the heaviest keys; NULL when disabled */
+    int64_t* wide_bins;         /* 64-bit counters once promoted; NULL while narrow */
+    uint64_t wide_migrated;     /* counters below this index live only in `wide_bins` */
+    uint32_t auto_promote;      /* promote instead of saturating; see cms_set_auto_promote */
+    cms_membership_filter* membership;  /* keys that updated the bins; NULL when disabled */
+    cms_export_snapshot* snapshot;      /* bins an export may still need to copy; NULL when none */
 }  CountMinSketch, count_min_sketch;
 
 
@@ -77,19 +142,199 @@ static __inline__ int cms_init_optimal(CountMinSketch* cms, float error_rate, fl
 int cms_destroy(CountMinSketch* cms);
 
 
+/*  Enable or disable the single-writer/multi-reader mode
+
+    When enabled, every update (add, remove, clear, merge_into) is wrapped in
+    a seqlock so that the check family of functions can run on other threads
+    while a single writer thread updates the sketch. Readers never take a
+    lock; they retry when they observe an update in flight so that all
+    `depth` counters and `elements_added` come from the same version.
+    A reader retries until it gets a consistent view, yielding between
+    attempts after the first CMS_READ_RETRIES; since the writer holds the
+    sequence only for the duration of one update, a reader waits at most
+    about that long (longer only while the writer thread is preempted). The
+    writer never waits for the readers: its only extra work is two stores
+    to the sequence per update, and readers never write to the sketch.
+
+    NOTE: Set the mode before the sketch is shared between threads
+    NOTE: Only one thread may update the sketch at a time
+
+    Return:
+        CMS_SUCCESS
+        CMS_ERROR   -   When enabling with the hot item filter enabled */
+int cms_set_concurrent_reads(CountMinSketch* cms, int enabled);
+
+/*  Enable, resize or disable (num_slots = 0) the update coalescing buffer
+
+    The buffer is a small, direct mapped table that sits in front of the bins
+    and aggregates the increments of recently seen keys; a hot key then costs
+    a single cache hit per add instead of `depth` random writes. Keys are
+    identified by their first hash. A key's pending count is applied to the
+    bins, exactly as `cms_add_inc_alt` would have, when another key maps to
+    its slot, on `cms_flush` and automatically before any check, export or
+    merge; `elements_added` is always up to date.
+
+    While a key is buffered the add functions return the minimum of its
+    counters when it entered the buffer plus its pending count.
+
+    NOTE: When concurrent reads are enabled readers do not flush; the writer
+    is responsible for calling `cms_flush`
+    NOTE: Passing 0 for `num_slots` flushes and frees the buffer; otherwise
+    the number of slots is rounded up to a power of two
+
+    Return:
+        CMS_SUCCESS
+        CMS_ERROR   -   When unable to allocate the buffer or the hot item
+                        filter is enabled */
+int cms_set_coalescing(CountMinSketch* cms, unsigned int num_slots);
+
+/*  Enable, resize or disable (num_items = 0) the hot item filter
+
+    The filter (ASketch) is a small array of the heaviest keys, identified by
+    their first hash, in front of the bins. Adds and removes of a key in the
+    filter only touch its count there; a key that is not counts in the bins
+    as usual and replaces the coldest key of a full filter once its estimate
+    overtakes it, at which point the evicted key's pending count is applied
+    to the bins. `cms_check` answers filtered keys from the filter, which
+    for skewed streams is both faster and more accurate: a filtered key's
+    estimate is at most what the plain sketch would report and never below
+    its true count. The coldest filtered key is tracked, so a key that does
+    not overtake it costs no scan of the filter.
+
+    The filter is scanned with AVX2 when compiled with it and otherwise with
+    a branchless loop the compiler can vectorize.
+
+    NOTE: Pending filter counts are applied to the bins (the keys stay
+    filtered) on `cms_flush` and before any mean check, export or merge;
+    merging into a sketch empties its filter
+    NOTE: Cannot be combined with update coalescing, concurrent reads or the
+    signed (count sketch) updates
+    NOTE: `num_items` is capped at CMS_HOT_MAX_ITEMS
+
+    Return:
+        CMS_SUCCESS
+        CMS_ERROR   -   When unable to allocate the filter or an incompatible
+                        mode is enabled */
+int cms_set_hot_filter(CountMinSketch* cms, unsigned int num_items);
+
+/*  Enable or disable promotion of the counters to 64-bit; off by default
+
+    With promotion enabled, the first update that would saturate a counter
+    at INT32_MAX (or INT32_MIN) allocates a zeroed array of 64-bit counters
+    instead; from then on updates go to the wide counters and every update
+    moves the next CMS_PROMOTE_BLOCK narrow counters over, so no single
+    update pays for the whole conversion. Once all counters have moved the
+    narrow bins are released (kept until destroy with concurrent reads).
+    Estimates beyond the int32_t range are clamped by the int32_t lookups;
+    use `cms_check_wide` for the full value. A promoted sketch is exported
+    with 64-bit counters.
+
+    Disabling only stops future promotions; a promoted sketch stays wide.
+
+    Return:
+        CMS_SUCCESS */
+int cms_set_auto_promote(CountMinSketch* cms, int enabled);
+
+/*  Enable, resize or disable (num_keys = 0) the membership pre-check
+
+    A blocked Bloom filter, sized at CMS_MEMBERSHIP_BITS_PER_KEY bits for
+    each of the `num_keys` expected keys, records every key that adds to or
+    removes from the sketch. All bits of a key lie in one 64 byte block, so
+    `cms_check` (and the other min lookups) answer a key that was never
+    inserted with 0 after a single cache line probe instead of `depth`
+    random reads; for such keys 0 is also the better estimate. Keys that are
+    present, or false positives, are looked up as usual.
+
+    The filter is merged (OR) and exported together with the sketch; it does
+    not change when the sketch is folded.
+
+    NOTE: Only an empty sketch can be given a filter, since the keys already
+          counted are unknown
+    NOTE: `cms_add_row_inc` does not know its keys and fails while the filter
+          is enabled
+    NOTE: Sketches merged into one with a filter need a filter of the same size
+
+    Return:
+        CMS_SUCCESS
+        CMS_ERROR   -   When unable to allocate the filter or the sketch is
+                        not empty; the current filter is then kept */
+int cms_set_membership_filter(CountMinSketch* cms, unsigned int num_keys);
+
+/*  Apply every pending update in the coalescing buffer (and hot item
+    filter) to the bins
+
+    Return:
+        CMS_SUCCESS */
+int cms_flush(CountMinSketch* cms);
+
+/*  Count `x` elements in `elements_added` without touching the bins, e.g.
+    updates that were shed under load; the change is made in a write
+    section so concurrent readers see it together with the bins
+
+    Return:
+        CMS_SUCCESS */
+int cms_add_elements(CountMinSketch* cms, int64_t x);
+
 /*  Reset the count-min sketch to zero elements inserted
 
+    NOTE: Large sketches are cleared in parallel when a thread pool or
+    executor is configured; see cms_pool.h
+
     Return:
         CMS_SUCCESS */
 int cms_clear(CountMinSketch* cms);
 
 /* Export count-min sketch to file
 
+    NOTE: A promoted sketch writes its counters as int64_t; the trailer is
+    unchanged and `cms_import` tells the two apart by the file size
+    NOTE: The membership filter, when enabled, is written in a tagged section
+    between the counters and the trailer; files without it import as before
+
     Return:
         CMS_SUCCESS - When file is opened and written
         CMS_ERROR   - When file is unable to be opened */
 int cms_export(CountMinSketch* cms, const char* filepath);
 
+/*  Export the count-min sketch to file from a background thread
+
+    The snapshot of the bins is copy-on-write: the background thread copies
+    the counters while the caller keeps updating the sketch, and an update
+    to a block of counters that has not been copied yet copies that block
+    first. Clearing, folding or destroying the sketch, completing a
+    promotion, or starting another export first finishes the copy. The
+    snapshot is written to `filepath` with a temporary name and renamed
+    into place once complete so a reader never sees a partial file.
+    `callback` (may be NULL) is invoked from the background thread when the
+    export finishes.
+
+    Possible arguments:
+        flags       -   0 or CMS_EXPORT_FSYNC
+        context     -   Passed through to `callback`
+
+    Return:
+        The job to pass to `cms_export_wait`; it must be waited on exactly
+        once to release its resources
+        NULL        - When the snapshot could not be taken or the thread
+                      could not be started; the callback is not called
+
+    NOTE: The file format is the same as `cms_export` */
+cms_export_job* cms_export_async(CountMinSketch* cms, const char* filepath, int flags, cms_export_callback callback, void* context);
+
+/*  Wait for an asynchronous export to finish and release the job
+
+    Return:
+        CMS_SUCCESS - When the file was written
+        CMS_ERROR   - When the file could not be written or the job was cancelled */
+int cms_export_wait(cms_export_job* job);
+
+/*  Ask an asynchronous export to stop as soon as possible; the partial file
+    is removed. `cms_export_wait` must still be called.
+
+    Return:
+        CMS_SUCCESS */
+int cms_export_cancel(cms_export_job* job);
+
 /*  Import count-min sketch from file
 
     Return:
@@ -133,6 +378,45 @@ static __inline__ int32_t cms_add_alt(CountMinSketch* cms, uint64_t* hashes, uns
     return cms_add_inc_alt(cms, hashes, num_hashes, 1);
 }
 
+/*  Add a batch of keys (or hashes) to the count-min sketch
+    Possible arguments:
+        keys        -   The keys to insert
+        hashes      -   The hashes of the keys to insert; `num_hashes` hashes
+                        per key stored one key after the other
+        num_keys    -   The number of keys in the batch
+        x           -   The number of times to insert each key; NULL means 1
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When there is an issue with the number of hashes
+
+    NOTE: Large batches into large sketches are turned into (bin, increment)
+    pairs and radix partitioned by memory region so that each region is
+    updated while it is cache and TLB resident; the resulting bins are
+    identical to calling `cms_add_inc` for each key in turn
+    NOTE: With concurrent reads the batch is always applied key by key, each
+    key (with `elements_added`) in its own write section, so readers never
+    see a key in only some of its rows
+    NOTE: The coalescing buffer is bypassed */
+int cms_add_inc_batch(CountMinSketch* cms, const char** keys, unsigned int num_keys, const uint32_t* x);
+int cms_add_inc_batch_alt(CountMinSketch* cms, const uint64_t* hashes, unsigned int num_hashes, unsigned int num_keys, const uint32_t* x);
+
+/*  Add a batch of updates to a single row of the count-min sketch
+    Possible arguments:
+        row         -   The row (0 <= row < depth) to update
+        columns     -   The column of each update within the row; i.e.
+                        `hashes[row] % width` of the key being inserted
+        x           -   The increment of each update; NULL means 1 for each
+        num_updates -   The number of entries in `columns` and `x`
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When `row` is out of range
+
+    NOTE: Rows are independent so different rows may be updated from different
+    threads at the same time; `elements_added` is left to the caller since it
+    must only be counted once per key
+    NOTE: Fails while the membership filter is enabled */
+int cms_add_row_inc(CountMinSketch* cms, unsigned int row, const uint32_t* columns, const uint32_t* x, unsigned int num_updates);
+
 /*  Remove the provided key to the count-min sketch `x` times;
     NOTE: Result Values can be negative
     NOTE: Best check method when remove is used is `cms_check_mean` */
@@ -152,6 +436,21 @@ static __inline__ int32_t cms_remove_alt(CountMinSketch* cms, uint64_t* hashes,
 /* Determine the maximum number of times the key may have been inserted */
 int32_t cms_check(CountMinSketch* cms, const char* key);
 int32_t cms_check_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes);
+
+/*  Determine the maximum number of times the key may have been inserted
+    without clamping to the int32_t range; for promoted sketches (see
+    `cms_set_auto_promote`)
+
+    Returns:
+        The estimate
+        CMS_ERROR   -   When there are insufficient hashes or a deep sketch
+                        cannot allocate the lookup */
+int64_t cms_check_wide(CountMinSketch* cms, const char* key);
+int64_t cms_check_wide_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes);
+
+/* The value of the counter at index `bin` (row * width + column), whether
+   or not the sketch has been promoted */
+int64_t cms_get_bin(const CountMinSketch* cms, uint64_t bin);
 static __inline__ int32_t cms_check_min(CountMinSketch* cms, const char* key) {
     return cms_check(cms, key);
 }
@@ -159,6 +458,32 @@ static __inline__ int32_t cms_check_min_alt(CountMinSketch* cms, uint64_t* hashe
     return cms_check_alt(cms, hashes, num_hashes);
 }
 
+/*  Issue prefetches for the `depth` counters of the provided hashes without
+    waiting for them; this is the first half of a lookup that is completed
+    by calling `cms_check_alt` (or the mean variants) with the same hashes.
+    Interleaving many lookups this way (prefetch, switch to another lookup,
+    resume) hides the memory latency of large sketches; a C++ coroutine can
+    call this, suspend, and call `cms_check_alt` when it is resumed.
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When there are insufficient hashes */
+int cms_check_prefetch_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes);
+
+/*  Determine the maximum number of times each key of a batch may have been
+    inserted; `results` must hold `num_keys` values. For the hashes version
+    `num_hashes` hashes per key are stored one key after the other.
+    Lookups are group prefetched, CMS_CHECK_GROUP_SIZE at a time; this pays
+    off once the counters no longer fit in the caches, while for a sketch
+    that does a loop of `cms_check_alt` is faster.
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When there are insufficient hashes or a deep sketch
+                        cannot allocate the lookup */
+int cms_check_batch(CountMinSketch* cms, const char** keys, unsigned int num_keys, int32_t* results);
+int cms_check_batch_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes, unsigned int num_keys, int32_t* results);
+
 /*  Determine the mean number of times the key may have been inserted
     NOTE: Mean check increases the over counting but is a `better` strategy
     when removes are added and negatives are possible */
@@ -168,6 +493,46 @@ int32_t cms_check_mean_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int n
 int32_t cms_check_mean_min(CountMinSketch* cms, const char* key);
 int32_t cms_check_mean_min_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes);
 
+/*  Count Sketch updates and lookups on the same bins: each row adds
+    `sign * x` where the +1/-1 sign is derived from the same hash as the
+    column, and the estimate is the median of `sign * counter` over the rows.
+    Unlike the min estimator it is unbiased, so it stays accurate on
+    turnstile streams with many removes. Merge, export and import work
+    unchanged on a count sketch.
+
+    Returns:
+        The median estimate for the key (after the update for add/remove)
+        CMS_ERROR   -   When there are insufficient hashes or the hot item
+                        filter is enabled
+
+    NOTE: A sketch must be updated with either the signed or the unsigned
+    functions, and checked with the matching estimators, never both; signed
+    updates bypass update coalescing and cannot be combined with the hot
+    item filter */
+int32_t cms_signed_add_inc(CountMinSketch* cms, const char* key, uint32_t x);
+int32_t cms_signed_add_inc_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes, uint32_t x);
+int32_t cms_signed_remove_inc(CountMinSketch* cms, const char* key, uint32_t x);
+int32_t cms_signed_remove_inc_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes, uint32_t x);
+static __inline__ int32_t cms_signed_add(CountMinSketch* cms, const char* key) {
+    return cms_signed_add_inc(cms, key, 1);
+}
+static __inline__ int32_t cms_signed_remove(CountMinSketch* cms, const char* key) {
+    return cms_signed_remove_inc(cms, key, 1);
+}
+
+int32_t cms_check_median(CountMinSketch* cms, const char* key);
+int32_t cms_check_median_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes);
+
+/*  Batch version of `cms_check_median`; the layout of `hashes` and
+    `results` is that of `cms_check_batch`
+
+    Returns:
+        CMS_SUCCESS
+        CMS_ERROR   -   When there are insufficient hashes or the hot item
+                        filter is enabled */
+int cms_check_median_batch(CountMinSketch* cms, const char** keys, unsigned int num_keys, int32_t* results);
+int cms_check_median_batch_alt(CountMinSketch* cms, uint64_t* hashes, unsigned int num_hashes, unsigned int num_keys, int32_t* results);
+
 /*  Return the hashes for the provided key based on the hashing function of
     the count-min sketch
     NOTE: Useful when multiple count-min sketches use the same hashing
@@ -178,6 +543,11 @@ static __inline__ uint64_t* cms_get_hashes(CountMinSketch* cms, const char* key)
     return cms_get_hashes_alt(cms, cms->depth, key);
 }
 
+/*  The hashing function used when none is passed at initialization; the
+    other sketch types of the library default to it as well
+    NOTE: Up to the caller to free the array of hash values */
+uint64_t* cms_default_hash(unsigned int num_hashes, const char* key);
+
 /*  Initialized count-min sketch and merge the cms' directly into the newly
     initialized object
     Return:
@@ -185,7 +555,8 @@ static __inline__ uint64_t* cms_get_hashes(CountMinSketch* cms, const char* key)
                       were successfully merged
         CMS_ERROR   - When there was an error completing the merge; including
                       when the cms' are not all of the same demensions, unable
-                      to allocate the correct memory, etc.
+                      to allocate the correct memory, etc.; `cms` is then left
+                      destroyed, so it holds no memory
 */
 int cms_merge(CountMinSketch* cms, int num_sketches, ...);
 
@@ -197,9 +568,39 @@ int cms_merge(CountMinSketch* cms, int num_sketches, ...);
         CMS_ERROR   - When there was an error completing the merge; including
                       when the cms' are not all of the same demensions, unable
                       to allocate the correct memory, etc.
+
+    NOTE: For both merge functions the bins of large sketches are merged in
+    parallel when a thread pool or executor is configured; see cms_pool.h
+    NOTE: When any of the merged sketches is promoted or has promotion
+    enabled, promotion is enabled on `cms` as well, and `cms` is promoted
+    up front if one of them already is; see cms_set_auto_promote
 */
 int cms_merge_into(CountMinSketch* cms, int num_sketches, ...);
 
+/*  Shrink the count-min sketch in place by summing every `factor` columns
+    of each row into one; the folded sketch has width / `factor` columns and
+    answers exactly as a sketch of that width that saw the same updates
+    Return:
+        CMS_SUCCESS
+        CMS_ERROR   - When `factor` is 0 or does not divide the width, or
+                      unable to promote the sketch
+
+    NOTE: The bins are reallocated; not safe with concurrent readers
+    NOTE: With promotion enabled, a sketch whose summed columns would
+    saturate is promoted first; see cms_set_auto_promote
+*/
+int cms_fold(CountMinSketch* cms, unsigned int factor);
+
+/*  Same as `cms_fold` but keeps the largest of the folded counters instead
+    of their sum; every counter still bounds the counters it replaces, so
+    the min estimate stays an overestimate while growing less than with a
+    sum. Only valid for sketches without removes.
+    Return:
+        CMS_SUCCESS
+        CMS_ERROR   - When `factor` is 0 or does not divide the width
+*/
+int cms_fold_max(CountMinSketch* cms, unsigned int factor);
+
 
 #ifdef __cplusplus
 } // extern "C"